@@ -42,6 +42,21 @@
 #ifndef APPCONF_SEND_CAN_STATUS_RATE_HZ
 #define APPCONF_SEND_CAN_STATUS_RATE_HZ		50
 #endif
+#ifndef APPCONF_SEND_CAN_STATUS_2_RATE_HZ
+#define APPCONF_SEND_CAN_STATUS_2_RATE_HZ	APPCONF_SEND_CAN_STATUS_RATE_HZ
+#endif
+#ifndef APPCONF_SEND_CAN_STATUS_3_RATE_HZ
+#define APPCONF_SEND_CAN_STATUS_3_RATE_HZ	APPCONF_SEND_CAN_STATUS_RATE_HZ
+#endif
+#ifndef APPCONF_SEND_CAN_STATUS_4_RATE_HZ
+#define APPCONF_SEND_CAN_STATUS_4_RATE_HZ	APPCONF_SEND_CAN_STATUS_RATE_HZ
+#endif
+#ifndef APPCONF_SEND_CAN_STATUS_5_RATE_HZ
+#define APPCONF_SEND_CAN_STATUS_5_RATE_HZ	APPCONF_SEND_CAN_STATUS_RATE_HZ
+#endif
+#ifndef APPCONF_SEND_CAN_STATUS_ON_CHANGE
+#define APPCONF_SEND_CAN_STATUS_ON_CHANGE	false
+#endif
 #ifndef APPCONF_CAN_BAUD_RATE
 #define APPCONF_CAN_BAUD_RATE				CAN_BAUD_500K
 #endif
@@ -235,8 +235,10 @@ static THD_FUNCTION(output_thread, arg) {
 		const volatile mc_configuration *mcconf = mc_interface_get_configuration();
 		static bool is_reverse = false;
 		static bool was_z = false;
-		const float current_now = mc_interface_get_tot_current_directional_filtered();
-		const float duty_now = mc_interface_get_duty_cycle_now();
+		mc_motor_values val;
+		mc_interface_get_values(&val);
+		const float current_now = val.current_directional_filtered;
+		const float duty_now = val.duty_now;
 		static float prev_current = 0.0;
 		const float max_current_diff = mcconf->l_current_max * mcconf->l_current_max_scale * 0.2;
 
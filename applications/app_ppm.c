@@ -342,8 +342,11 @@ static THD_FUNCTION(ppm_thread, arg) {
 			continue;
 		}
 
-		const float duty_now = mc_interface_get_duty_cycle_now();
-		float current_highest_abs = fabsf(mc_interface_get_tot_current_directional_filtered());
+		mc_motor_values val;
+		mc_interface_get_values(&val);
+
+		const float duty_now = val.duty_now;
+		float current_highest_abs = fabsf(val.current_directional_filtered);
 		float duty_highest_abs = fabsf(duty_now);
 
 		if (config.multi_esc) {
@@ -404,8 +407,8 @@ static THD_FUNCTION(ppm_thread, arg) {
 		}
 
 		if ((send_current || send_duty) && config.multi_esc) {
-			float current_filtered = mc_interface_get_tot_current_directional_filtered();
-			float duty = mc_interface_get_duty_cycle_now();
+			float current_filtered = val.current_directional_filtered;
+			float duty = val.duty_now;
 
 			for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
 				can_status_msg *msg = comm_can_get_status_msg_index(i);
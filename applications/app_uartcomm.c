@@ -49,10 +49,14 @@ static bool send_mutex_p_init_done = false;
 // Private functions
 static void process_packet(unsigned char *data, unsigned int len);
 static void send_packet(unsigned char *data, unsigned int len);
+static unsigned char *send_buffer_begin(void);
+static void send_buffer_end(unsigned int len);
 
 #ifdef HW_UART_P_DEV
 static void process_packet_p(unsigned char *data, unsigned int len);
 static void send_packet_p(unsigned char *data, unsigned int len);
+static unsigned char *send_buffer_begin_p(void);
+static void send_buffer_end_p(unsigned int len);
 #endif
 
 static SerialConfig uart_cfg = {
@@ -101,8 +105,41 @@ static void send_packet_p(unsigned char *data, unsigned int len) {
 }
 #endif
 
+static unsigned char *send_buffer_begin(void) {
+	if (!send_mutex_init_done) {
+		chMtxObjectInit(&send_mutex);
+		send_mutex_init_done = true;
+	}
+
+	chMtxLock(&send_mutex);
+	return packet_get_send_buffer(PACKET_HANDLER);
+}
+
+static void send_buffer_end(unsigned int len) {
+	packet_send_packet(packet_get_send_buffer(PACKET_HANDLER), len, PACKET_HANDLER);
+	chMtxUnlock(&send_mutex);
+}
+
+#ifdef HW_UART_P_DEV
+static unsigned char *send_buffer_begin_p(void) {
+	if (!send_mutex_p_init_done) {
+		chMtxObjectInit(&send_mutex_p);
+		send_mutex_p_init_done = true;
+	}
+
+	chMtxLock(&send_mutex_p);
+	return packet_get_send_buffer(PACKET_HANDLER_P);
+}
+
+static void send_buffer_end_p(unsigned int len) {
+	packet_send_packet(packet_get_send_buffer(PACKET_HANDLER_P), len, PACKET_HANDLER_P);
+	chMtxUnlock(&send_mutex_p);
+}
+#endif
+
 void app_uartcomm_start(void) {
 	packet_init(send_packet, process_packet, PACKET_HANDLER);
+	commands_register_tx_buffer(app_uartcomm_send_packet, send_buffer_begin, send_buffer_end);
 
 	if (!thread_is_running) {
 		chThdCreateStatic(packet_process_thread_wa, sizeof(packet_process_thread_wa),
@@ -124,6 +161,7 @@ void app_uartcomm_start(void) {
 void app_uartcomm_start_permanent(void) {
 #ifdef HW_UART_P_DEV
 	packet_init(send_packet_p, process_packet_p, PACKET_HANDLER_P);
+	commands_register_tx_buffer(app_uartcomm_send_packet_p, send_buffer_begin_p, send_buffer_end_p);
 
 	if (!thread_is_running) {
 		chThdCreateStatic(packet_process_thread_wa, sizeof(packet_process_thread_wa),
@@ -223,6 +261,8 @@ static THD_FUNCTION(packet_process_thread, arg) {
 	chEvtRegisterMaskWithFlags(&HW_UART_P_DEV.event, &elp, EVENT_MASK(0), CHN_INPUT_AVAILABLE);
 #endif
 
+	uint8_t buffer[64];
+
 	for(;;) {
 		chEvtWaitAnyTimeout(ALL_EVENTS, ST2MS(10));
 
@@ -231,21 +271,21 @@ static THD_FUNCTION(packet_process_thread, arg) {
 			rx = false;
 
 			if (uart_is_running) {
-				msg_t res = sdGetTimeout(&HW_UART_DEV, TIME_IMMEDIATE);
-				if (res != MSG_TIMEOUT) {
+				size_t len = sdReadTimeout(&HW_UART_DEV, buffer, sizeof(buffer), TIME_IMMEDIATE);
+				if (len > 0) {
 #ifdef HW_UART_P_DEV
 					from_p_uart = false;
 #endif
-					packet_process_byte(res, PACKET_HANDLER);
+					packet_process_buffer(buffer, len, PACKET_HANDLER);
 					rx = true;
 				}
 			}
 
 #ifdef HW_UART_P_DEV
-			msg_t res = sdGetTimeout(&HW_UART_P_DEV, TIME_IMMEDIATE);
-			if (res != MSG_TIMEOUT) {
+			size_t len = sdReadTimeout(&HW_UART_P_DEV, buffer, sizeof(buffer), TIME_IMMEDIATE);
+			if (len > 0) {
 				from_p_uart = true;
-				packet_process_byte(res, PACKET_HANDLER_P);
+				packet_process_buffer(buffer, len, PACKET_HANDLER_P);
 				rx = true;
 			}
 #endif
@@ -112,6 +112,24 @@ void buffer_append_float32_auto(uint8_t* buffer, float number, int32_t *index) {
 	buffer_append_uint32(buffer, res, index);
 }
 
+/*
+ * Variable length signed integers. The number is zigzag encoded so that
+ * small negative numbers also become small, and then written 7 bits at a
+ * time starting with the least significant bits. The top bit of each byte
+ * is set when more bytes follow. This takes 1 byte for numbers in
+ * [-64, 63] and at most 5 bytes.
+ */
+void buffer_append_var_int32(uint8_t* buffer, int32_t number, int32_t *index) {
+	uint32_t zz = ((uint32_t)number << 1) ^ (uint32_t)(number >> 31);
+
+	while (zz >= 0x80) {
+		buffer[(*index)++] = (zz & 0x7F) | 0x80;
+		zz >>= 7;
+	}
+
+	buffer[(*index)++] = zz;
+}
+
 uint8_t buffer_get_uint8(const uint8_t *buffer, int32_t *index) {
 	uint8_t res = ((uint8_t) buffer[*index + 1]);
 	*index += 1;
@@ -177,3 +195,17 @@ float buffer_get_float32_auto(const uint8_t *buffer, int32_t *index) {
 
 	return ldexpf(sig, e);
 }
+
+int32_t buffer_get_var_int32(const uint8_t *buffer, int32_t *index) {
+	uint32_t zz = 0;
+	int shift = 0;
+	uint8_t b;
+
+	do {
+		b = buffer[(*index)++];
+		zz |= (uint32_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while ((b & 0x80) && shift < 35);
+
+	return (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+}
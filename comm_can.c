@@ -35,14 +35,56 @@
 #include "canard_driver.h"
 #include "encoder.h"
 #include "can_dict.h"
+#include "flash_helper.h"
+#include "nrf_driver.h"
+#include "shutdown.h"
 
 // Settings
 #define RX_FRAMES_SIZE	100
 #define RX_BUFFER_SIZE	PACKET_MAX_PL_LEN
+#define FW_CHUNK_FRAMES	40 // Frames per broadcast firmware chunk, one bit each in the acknowledgement
+#define FW_CHUNK_MAX	(FW_CHUNK_FRAMES * 7)
+#define FW_FRAME_BITS	6 // Bits for the frame index in firmware data frames, the rest is for the chunk sequence number
+#define FW_FRAME_MASK	((1 << FW_FRAME_BITS) - 1)
+#define FW_SEQ_MASK		(0xFF >> FW_FRAME_BITS)
+#define FW_NODES_MAX	32
+#define FW_ROUNDS_MAX	6 // Transmissions of a firmware chunk before a node is given up on
+#define FW_ACK_TIMEOUT	MS2ST(50)
+#define FW_DISCOVER_MS	100
+#define FILTERS_MAX		8
+#define TP_RX_SLOTS		4
+#define TP_RX_TIMEOUT	MS2ST(100) // Transfers without new frames for this long can be replaced
+#define TP_BLOCK_SIZE	16 // Frames between flow control frames, 0 for no flow control until the end
+#define TP_ST_MIN_MS	0 // Time the sender should leave between frames
+#define TP_TIMEOUT		MS2ST(20)
+#define TP_RETRIES		4
+#define TP_LEGACY_SENDS	100 // Buffers sent the old way to a node that did not answer before it is tried again
+
+#if (RX_BUFFER_SIZE + 6) / 7 > 255
+#error "Segmented transfers index frames with one byte"
+#endif
+#if FW_CHUNK_FRAMES > (1 << FW_FRAME_BITS) || FW_CHUNK_FRAMES > 40
+#error "Firmware chunk frames must fit in the frame index and in the acknowledgement bitmap"
+#endif
+#define STATUS_MSGS		5
+#define STATUS_CHANGE_MIN_MS	10 // Shortest time between status messages sent early because their content changed, and between checks for changes
+#define STATUS_SLEEP_MAX_MS		100 // Longest sleep of the status thread, so that configuration changes are picked up
+#define FILTER_CAN2_START	(STM32_CAN_MAX_FILTERS / 2)
+#define FILTER_IDE		(1 << 2) // IDE bit in the 32-bit filter registers
+
+// Firmware chunk acknowledgement status
+#define FW_ACK_MISSING	0
+#define FW_ACK_WRITTEN	1
+#define FW_ACK_FAILED	2
+
+// Segmented transfer flow control status
+#define TP_FLOW_CTS		0 // Continue from the given frame
+#define TP_FLOW_DONE	1 // Received and CRC checked
+#define TP_FLOW_ABORT	2 // Not accepted, the sender should use the fill rx buffer frames
 
 #if CAN_ENABLE
 // Threads
-static THD_WORKING_AREA(cancom_read_thread_wa, 512);
+static THD_WORKING_AREA(cancom_read_thread_wa, 1024);
 static THD_WORKING_AREA(cancom_process_thread_wa, 4096);
 static THD_WORKING_AREA(cancom_status_thread_wa, 1024);
 static THD_FUNCTION(cancom_read_thread, arg);
@@ -50,22 +92,91 @@ static THD_FUNCTION(cancom_status_thread, arg);
 static THD_FUNCTION(cancom_process_thread, arg);
 
 static mutex_t can_mtx;
-static mutex_t can_rx_mtx;
 static uint8_t rx_buffer[RX_BUFFER_SIZE];
 static unsigned int rx_buffer_last_id;
 static CANRxFrame rx_frames[RX_FRAMES_SIZE];
-static int rx_frame_read;
-static int rx_frame_write;
+static volatile int rx_frame_read;
+static volatile int rx_frame_write;
+static bool rx_frame_pending = false;
+static volatile uint32_t rx_frames_overrun = 0;
+static volatile int rx_frames_high_water = 0;
 static thread_t *process_tp = 0;
 static thread_t *ping_tp = 0;
+
+// Broadcast firmware update, sending side
+static thread_t *fw_tp = 0;
+static volatile bool fw_discover = false;
+static can_fw_node fw_nodes[FW_NODES_MAX];
+static volatile int fw_node_num = 0;
+static uint8_t fw_ack_seq[FW_NODES_MAX];
+static uint8_t fw_ack_status[FW_NODES_MAX];
+static uint64_t fw_ack_frames[FW_NODES_MAX];
+static bool fw_ack_seen[FW_NODES_MAX];
+static uint8_t fw_tx_seq = 0;
+
+// Broadcast firmware update, receiving side
+static uint8_t fw_rx_buffer[FW_CHUNK_MAX];
+static uint64_t fw_rx_frames;
+static uint8_t fw_rx_seq;
+static uint32_t fw_rx_offset;
+static unsigned int fw_rx_len;
+static uint16_t fw_rx_crc;
+static uint8_t fw_rx_status;
+
+// Segmented transfers, sending side
+typedef struct {
+	uint8_t status;
+	uint8_t next;
+	uint8_t block_size;
+	uint8_t st_min;
+} tp_flow;
+
+static mutex_t tp_tx_mtx;
+static binary_semaphore_t tp_flow_sem;
+static volatile bool tp_tx_active = false;
+static volatile uint8_t tp_tx_dest;
+static tp_flow tp_flow_last;
+static uint8_t tp_legacy[256]; // Sends left before a node that did not answer is tried again
+
+// Segmented transfers, receiving side
+typedef enum {
+	TP_RX_FREE = 0,
+	TP_RX_RECEIVING,
+	TP_RX_READY,
+	TP_RX_DONE
+} tp_rx_state;
+
+typedef struct {
+	volatile tp_rx_state state;
+	uint8_t src;
+	uint8_t send;
+	systime_t last_time;
+	unsigned int len;
+	uint16_t crc;
+	int frames;
+	int next;
+	int block_left;
+	bool nacked;
+	uint8_t data[RX_BUFFER_SIZE];
+} tp_rx_slot;
+
+static tp_rx_slot tp_rx_slots[TP_RX_SLOTS];
+static uint8_t tp_rx_evicted[256 / 8]; // Senders whose transfer in progress lost its slot
 #endif
 
+// Status messages from one node
+typedef struct {
+	can_status_msg msg;
+	can_status_msg_2 msg_2;
+	can_status_msg_3 msg_3;
+	can_status_msg_4 msg_4;
+	can_status_msg_5 msg_5;
+} can_status_node;
+
 // Variables
-static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_2 stat_msgs_2[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_3 stat_msgs_3[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_4 stat_msgs_4[CAN_STATUS_MSGS_TO_STORE];
-static can_status_msg_5 stat_msgs_5[CAN_STATUS_MSGS_TO_STORE];
+static can_status_node stat_nodes[CAN_STATUS_MSGS_TO_STORE];
+static volatile uint8_t stat_node_slot[256]; // Slot + 1 for each controller id, 0 if not stored
+static int stat_nodes_used = 0;
 static unsigned int detect_all_foc_res_index = 0;
 static int8_t detect_all_foc_res[50];
 
@@ -83,7 +194,23 @@ static CANConfig cancfg = {
 // Private functions
 #if CAN_ENABLE
 static void send_packet_wrapper(unsigned char *data, unsigned int len);
+static int fw_node_index(int id, bool add);
+static void fw_discover_nodes(void);
+static void fw_send_chunk(uint32_t offset, uint8_t *data, unsigned int len, bool first);
+static void fw_rx_frame(CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len);
+static void fw_rx_chunk_end(uint8_t master_id);
+static int status_msg_fill(int msg, const mc_motor_values *val, uint8_t *buffer, float *change);
+static void process_rx_buffer(uint8_t *data, unsigned int len, uint8_t send);
+static bool tp_send(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send);
+static bool tp_wait_flow(systime_t timeout, tp_flow *flow);
+static bool tp_rx_frame(const CANRxFrame *rxmsg);
+static tp_rx_slot *tp_rx_slot_get(uint8_t src, bool add);
+static void tp_send_flow(uint8_t dest, uint8_t status, int next);
+static void tp_rx_process(void);
 #endif
+static can_status_node *status_node_id(int id, bool add);
+static void set_filters(void);
+static void restart_can(void);
 static void set_timing(int brp, int ts1, int ts2);
 
 // Function pointers
@@ -92,10 +219,11 @@ static void(*eid_callback)(uint32_t id, uint8_t *data, uint8_t len) = 0;
 
 void comm_can_init(void) {
 	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		stat_msgs[i].id = -1;
-		stat_msgs_2[i].id = -1;
-		stat_msgs_3[i].id = -1;
-		stat_msgs_4[i].id = -1;
+		stat_nodes[i].msg.id = -1;
+		stat_nodes[i].msg_2.id = -1;
+		stat_nodes[i].msg_3.id = -1;
+		stat_nodes[i].msg_4.id = -1;
+		stat_nodes[i].msg_5.id = -1;
 	}
 
 #if CAN_ENABLE
@@ -103,7 +231,8 @@ void comm_can_init(void) {
 	rx_frame_write = 0;
 
 	chMtxObjectInit(&can_mtx);
-	chMtxObjectInit(&can_rx_mtx);
+	chMtxObjectInit(&tp_tx_mtx);
+	chBSemObjectInit(&tp_flow_sem, true);
 
 	palSetPadMode(HW_CANH_PORT, HW_CANH_PIN,
 			PAL_MODE_ALTERNATE(HW_CAN_GPIO_AF) |
@@ -196,7 +325,15 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
  * Pointer to the function.
  */
 void comm_can_set_sid_rx_callback(void (*p_func)(uint32_t id, uint8_t *data, uint8_t len)) {
-	sid_callback = p_func;
+	if (sid_callback != p_func) {
+		bool filters_changed = !sid_callback || !p_func;
+		sid_callback = p_func;
+
+		// Standard frames are only let through the filters when they are used
+		if (filters_changed) {
+			restart_can();
+		}
+	}
 }
 
 /**
@@ -215,6 +352,11 @@ void comm_can_set_eid_rx_callback(void (*p_func)(uint32_t id, uint8_t *data, uin
  * it will be sent in a single CAN frame, otherwise it will be split into
  * several frames.
  *
+ * Longer buffers to a single controller are sent as a segmented transfer with
+ * flow control, where frames that get lost are sent again. Controllers that do
+ * not answer it, and broadcasts, get the fill rx buffer frames instead. This
+ * blocks until the transfer is done.
+ *
  * @param controller_id
  * The controller id to send to.
  *
@@ -242,6 +384,12 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 		comm_can_transmit_eid(controller_id |
 				((uint32_t)CAN_PACKET_PROCESS_SHORT_BUFFER << 8), send_buffer, ind);
 	} else {
+#if CAN_ENABLE
+		if (controller_id != 255 && tp_send(controller_id, data, len, send)) {
+			return;
+		}
+#endif
+
 		unsigned int end_a = 0;
 		for (unsigned int i = 0;i < len;i += 7) {
 			if (i > 255) {
@@ -294,6 +442,90 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 	}
 }
 
+/**
+ * Write new app data to all VESCs on the CAN-bus. The data is broadcast in
+ * sequence numbered frames, and every node acknowledges each chunk with a
+ * bitmap of the frames it got. Only frames that some node is missing are
+ * sent again, so all nodes are updated in one pass over the bus. Nodes
+ * that never acknowledge, e.g. ones with older firmware, get the data with
+ * comm_can_send_buffer instead.
+ *
+ * The nodes are discovered with a broadcast ping when the offset is 0, and
+ * their progress can be read with comm_can_fw_node.
+ *
+ * @param cmd
+ * A complete COMM_WRITE_NEW_APP_DATA command: the command id, the offset
+ * and the data.
+ *
+ * @param len
+ * Length of the command.
+ */
+void comm_can_write_new_app_data_all(uint8_t *cmd, unsigned int len) {
+#if CAN_ENABLE
+	if (app_get_configuration()->can_mode != CAN_MODE_VESC || len <= 5) {
+		return;
+	}
+
+	int32_t ind = 1;
+	uint32_t offset = buffer_get_uint32(cmd, &ind);
+	bool first = offset == 0;
+
+	if (first) {
+		fw_discover_nodes();
+	}
+
+	for (unsigned int i = ind;i < len;i += FW_CHUNK_MAX) {
+		unsigned int chunk_len = len - i;
+		if (chunk_len > FW_CHUNK_MAX) {
+			chunk_len = FW_CHUNK_MAX;
+		}
+
+		fw_send_chunk(offset + i - ind, cmd + i, chunk_len, first);
+		first = false;
+	}
+
+	for (int i = 0;i < fw_node_num;i++) {
+		if (fw_nodes[i].legacy) {
+			comm_can_send_buffer(fw_nodes[i].id, cmd, len, 2);
+		}
+	}
+#else
+	(void)cmd;
+	(void)len;
+#endif
+}
+
+/**
+ * Get the number of nodes in the current broadcast firmware update.
+ */
+int comm_can_fw_node_num(void) {
+#if CAN_ENABLE
+	return fw_node_num;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Get the progress of a node in the current broadcast firmware update.
+ *
+ * @param index
+ * Index of the node, up to comm_can_fw_node_num.
+ *
+ * @return
+ * The node, or null if the index is out of range.
+ */
+can_fw_node *comm_can_fw_node(int index) {
+#if CAN_ENABLE
+	if (index >= 0 && index < fw_node_num) {
+		return &fw_nodes[index];
+	}
+#else
+	(void)index;
+#endif
+	return 0;
+}
+
 void comm_can_set_duty(uint8_t controller_id, float duty) {
 	int32_t send_index = 0;
 	uint8_t buffer[4];
@@ -561,7 +793,7 @@ void comm_can_detect_all_foc_res_clear(void) {
  */
 can_status_msg *comm_can_get_status_msg_index(int index) {
 	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs[index];
+		return &stat_nodes[index].msg;
 	} else {
 		return 0;
 	}
@@ -577,10 +809,9 @@ can_status_msg *comm_can_get_status_msg_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg *comm_can_get_status_msg_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs[i].id == id) {
-			return &stat_msgs[i];
-		}
+	can_status_node *node = status_node_id(id, false);
+	if (node && node->msg.id == id) {
+		return &node->msg;
 	}
 
 	return 0;
@@ -597,7 +828,7 @@ can_status_msg *comm_can_get_status_msg_id(int id) {
  */
 can_status_msg_2 *comm_can_get_status_msg_2_index(int index) {
 	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_2[index];
+		return &stat_nodes[index].msg_2;
 	} else {
 		return 0;
 	}
@@ -613,10 +844,9 @@ can_status_msg_2 *comm_can_get_status_msg_2_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_2 *comm_can_get_status_msg_2_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_2[i].id == id) {
-			return &stat_msgs_2[i];
-		}
+	can_status_node *node = status_node_id(id, false);
+	if (node && node->msg_2.id == id) {
+		return &node->msg_2;
 	}
 
 	return 0;
@@ -633,7 +863,7 @@ can_status_msg_2 *comm_can_get_status_msg_2_id(int id) {
  */
 can_status_msg_3 *comm_can_get_status_msg_3_index(int index) {
 	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_3[index];
+		return &stat_nodes[index].msg_3;
 	} else {
 		return 0;
 	}
@@ -649,10 +879,9 @@ can_status_msg_3 *comm_can_get_status_msg_3_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_3 *comm_can_get_status_msg_3_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_3[i].id == id) {
-			return &stat_msgs_3[i];
-		}
+	can_status_node *node = status_node_id(id, false);
+	if (node && node->msg_3.id == id) {
+		return &node->msg_3;
 	}
 
 	return 0;
@@ -669,7 +898,7 @@ can_status_msg_3 *comm_can_get_status_msg_3_id(int id) {
  */
 can_status_msg_4 *comm_can_get_status_msg_4_index(int index) {
 	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_4[index];
+		return &stat_nodes[index].msg_4;
 	} else {
 		return 0;
 	}
@@ -685,10 +914,9 @@ can_status_msg_4 *comm_can_get_status_msg_4_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_4 *comm_can_get_status_msg_4_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_4[i].id == id) {
-			return &stat_msgs_4[i];
-		}
+	can_status_node *node = status_node_id(id, false);
+	if (node && node->msg_4.id == id) {
+		return &node->msg_4;
 	}
 
 	return 0;
@@ -705,7 +933,7 @@ can_status_msg_4 *comm_can_get_status_msg_4_id(int id) {
  */
 can_status_msg_5 *comm_can_get_status_msg_5_index(int index) {
 	if (index < CAN_STATUS_MSGS_TO_STORE) {
-		return &stat_msgs_5[index];
+		return &stat_nodes[index].msg_5;
 	} else {
 		return 0;
 	}
@@ -721,36 +949,75 @@ can_status_msg_5 *comm_can_get_status_msg_5_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg_5 *comm_can_get_status_msg_5_id(int id) {
-	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs_5[i].id == id) {
-			return &stat_msgs_5[i];
-		}
+	can_status_node *node = status_node_id(id, false);
+	if (node && node->msg_5.id == id) {
+		return &node->msg_5;
 	}
 
 	return 0;
 }
 
+/**
+ * Get the next received frame. The frames are passed from the CAN read
+ * thread in a single producer, single consumer ring without locking, so only
+ * one thread may call this.
+ *
+ * @return
+ * The frame, or 0 if there are no more frames. The frame stays valid until
+ * the next call.
+ */
 CANRxFrame *comm_can_get_rx_frame(void) {
 #if CAN_ENABLE
-	chMtxLock(&can_rx_mtx);
-	if (rx_frame_read != rx_frame_write) {
-		CANRxFrame *res = &rx_frames[rx_frame_read++];
+	int read = rx_frame_read;
 
-		if (rx_frame_read == RX_FRAMES_SIZE) {
-			rx_frame_read = 0;
+	// Release the frame returned by the previous call
+	if (rx_frame_pending) {
+		read++;
+		if (read == RX_FRAMES_SIZE) {
+			read = 0;
 		}
 
-		chMtxUnlock(&can_rx_mtx);
-		return res;
-	} else {
-		chMtxUnlock(&can_rx_mtx);
+		__DMB();
+		rx_frame_read = read;
+		rx_frame_pending = false;
+	}
+
+	if (read == rx_frame_write) {
 		return 0;
 	}
+
+	__DMB();
+	rx_frame_pending = true;
+	return &rx_frames[read];
 #else
 	return 0;
 #endif
 }
 
+/**
+ * Get statistics of the CAN receive ring.
+ *
+ * @param overrun
+ * Frames dropped because the ring was full.
+ *
+ * @param high_water
+ * The largest number of frames that have been waiting in the ring.
+ *
+ * @param size
+ * The number of frames the ring can hold.
+ */
+void comm_can_get_rx_stats(uint32_t *overrun, int *high_water, int *size) {
+#if CAN_ENABLE
+	*overrun = rx_frames_overrun;
+	*high_water = rx_frames_high_water;
+	*size = RX_FRAMES_SIZE - 1;
+#else
+	*overrun = 0;
+	*high_water = 0;
+	*size = 0;
+#endif
+}
+
 #if CAN_ENABLE
 static THD_FUNCTION(cancom_read_thread, arg) {
 	(void)arg;
@@ -772,12 +1039,34 @@ static THD_FUNCTION(cancom_read_thread, arg) {
 		msg_t result = canReceive(&HW_CAN_DEV, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
 
 		while (result == MSG_OK) {
-			chMtxLock(&can_rx_mtx);
-			rx_frames[rx_frame_write++] = rxmsg;
-			if (rx_frame_write == RX_FRAMES_SIZE) {
-				rx_frame_write = 0;
+			// Segmented transfers are handled here and not in the process thread,
+			// as that thread might itself be waiting for flow control.
+			if (!tp_rx_frame(&rxmsg)) {
+				int write = rx_frame_write;
+				int write_next = write + 1;
+				if (write_next == RX_FRAMES_SIZE) {
+					write_next = 0;
+				}
+
+				// Drop the frame if the ring is full, the reader might be using
+				// the oldest one.
+				if (write_next == rx_frame_read) {
+					rx_frames_overrun++;
+				} else {
+					rx_frames[write] = rxmsg;
+					__DMB();
+					rx_frame_write = write_next;
+
+					int used = write_next - rx_frame_read;
+					if (used < 0) {
+						used += RX_FRAMES_SIZE;
+					}
+
+					if (used > rx_frames_high_water) {
+						rx_frames_high_water = used;
+					}
+				}
 			}
-			chMtxUnlock(&can_rx_mtx);
 
 			chEvtSignal(process_tp, (eventmask_t) 1);
 
@@ -827,8 +1116,17 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 			continue;
 		}
 
-		CANRxFrame *rxmsg_tmp;
-		while ((rxmsg_tmp = comm_can_get_rx_frame()) != 0) {
+		for (;;) {
+			// Completed segmented transfers go before the next frame. A sender
+			// that got an abort while its previous buffer waited here falls back
+			// to frames in the ring, which must not overtake that buffer.
+			tp_rx_process();
+
+			CANRxFrame *rxmsg_tmp = comm_can_get_rx_frame();
+			if (!rxmsg_tmp) {
+				break;
+			}
+
 			CANRxFrame rxmsg = *rxmsg_tmp;
 			if (rxmsg.IDE == CAN_IDE_EXT) {
 				uint8_t id = rxmsg.EID & 0xFF;
@@ -896,19 +1194,7 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 						if (crc16(rx_buffer, rxbuf_len)
 								== ((unsigned short) crc_high << 8
 										| (unsigned short) crc_low)) {
-							switch (commands_send) {
-								case 0:
-									commands_process_packet(rx_buffer, rxbuf_len, send_packet_wrapper);
-									break;
-								case 1:
-									commands_send_packet(rx_buffer, rxbuf_len);
-									break;
-								case 2:
-									commands_process_packet(rx_buffer, rxbuf_len, 0);
-									break;
-								default:
-									break;
-							}
+							process_rx_buffer(rx_buffer, rxbuf_len, commands_send);
 						}
 						break;
 
@@ -916,20 +1202,7 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 						ind = 0;
 						rx_buffer_last_id = rxmsg.data8[ind++];
 						commands_send = rxmsg.data8[ind++];
-
-						switch (commands_send) {
-						case 0:
-							commands_process_packet(rxmsg.data8 + ind, rxmsg.DLC - ind, send_packet_wrapper);
-							break;
-						case 1:
-							commands_send_packet(rxmsg.data8 + ind, rxmsg.DLC - ind);
-							break;
-						case 2:
-							commands_process_packet(rxmsg.data8 + ind, rxmsg.DLC - ind, 0);
-							break;
-						default:
-							break;
-						}
+						process_rx_buffer(rxmsg.data8 + ind, rxmsg.DLC - ind, commands_send);
 						break;
 
 					case CAN_PACKET_SET_CURRENT_REL:
@@ -968,6 +1241,17 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 						if (ping_tp) {
 							chEvtSignal(ping_tp, 1 << 29);
 						}
+
+						if (fw_discover) {
+							fw_node_index(rxmsg.data8[0], true);
+						}
+						break;
+
+					case CAN_PACKET_FW_CHUNK_BEGIN:
+					case CAN_PACKET_FW_DATA:
+					case CAN_PACKET_FW_CHUNK_END:
+					case CAN_PACKET_FW_ACK:
+						fw_rx_frame(cmd, rxmsg.data8, rxmsg.DLC);
 						break;
 
 					case CAN_PACKET_DETECT_APPLY_ALL_FOC: {
@@ -1102,78 +1386,69 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 				}
 
 				switch (cmd) {
-				case CAN_PACKET_STATUS:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg *stat_tmp = &stat_msgs[i];
-						if (stat_tmp->id == id || stat_tmp->id == -1) {
-							ind = 0;
-							stat_tmp->id = id;
-							stat_tmp->rx_time = chVTGetSystemTime();
-							stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
-							stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
-							break;
-						}
+				case CAN_PACKET_STATUS: {
+					can_status_node *node = status_node_id(id, true);
+					if (node) {
+						can_status_msg *stat_tmp = &node->msg;
+						ind = 0;
+						stat_tmp->rx_time = chVTGetSystemTime();
+						stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
+						stat_tmp->id = id;
 					}
-					break;
+				} break;
 
-				case CAN_PACKET_STATUS_2:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg_2 *stat_tmp_2 = &stat_msgs_2[i];
-						if (stat_tmp_2->id == id || stat_tmp_2->id == -1) {
-							ind = 0;
-							stat_tmp_2->id = id;
-							stat_tmp_2->rx_time = chVTGetSystemTime();
-							stat_tmp_2->amp_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
-							stat_tmp_2->amp_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
-							break;
-						}
+				case CAN_PACKET_STATUS_2: {
+					can_status_node *node = status_node_id(id, true);
+					if (node) {
+						can_status_msg_2 *stat_tmp_2 = &node->msg_2;
+						ind = 0;
+						stat_tmp_2->rx_time = chVTGetSystemTime();
+						stat_tmp_2->amp_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp_2->amp_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp_2->id = id;
 					}
-					break;
+				} break;
 
-				case CAN_PACKET_STATUS_3:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg_3 *stat_tmp_3 = &stat_msgs_3[i];
-						if (stat_tmp_3->id == id || stat_tmp_3->id == -1) {
-							ind = 0;
-							stat_tmp_3->id = id;
-							stat_tmp_3->rx_time = chVTGetSystemTime();
-							stat_tmp_3->watt_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
-							stat_tmp_3->watt_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
-							break;
-						}
+				case CAN_PACKET_STATUS_3: {
+					can_status_node *node = status_node_id(id, true);
+					if (node) {
+						can_status_msg_3 *stat_tmp_3 = &node->msg_3;
+						ind = 0;
+						stat_tmp_3->rx_time = chVTGetSystemTime();
+						stat_tmp_3->watt_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp_3->watt_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 1e4;
+						stat_tmp_3->id = id;
 					}
-					break;
+				} break;
 
-				case CAN_PACKET_STATUS_4:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg_4 *stat_tmp_4 = &stat_msgs_4[i];
-						if (stat_tmp_4->id == id || stat_tmp_4->id == -1) {
-							ind = 0;
-							stat_tmp_4->id = id;
-							stat_tmp_4->rx_time = chVTGetSystemTime();
-							stat_tmp_4->temp_fet = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp_4->temp_motor = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp_4->current_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp_4->pid_pos_now = (float)buffer_get_int16(rxmsg.data8, &ind) / 50.0;
-							break;
-						}
+				case CAN_PACKET_STATUS_4: {
+					can_status_node *node = status_node_id(id, true);
+					if (node) {
+						can_status_msg_4 *stat_tmp_4 = &node->msg_4;
+						ind = 0;
+						stat_tmp_4->rx_time = chVTGetSystemTime();
+						stat_tmp_4->temp_fet = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp_4->temp_motor = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp_4->current_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp_4->pid_pos_now = (float)buffer_get_int16(rxmsg.data8, &ind) / 50.0;
+						stat_tmp_4->id = id;
 					}
-					break;
+				} break;
 
-				case CAN_PACKET_STATUS_5:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg_5 *stat_tmp_5 = &stat_msgs_5[i];
-						if (stat_tmp_5->id == id || stat_tmp_5->id == -1) {
-							ind = 0;
-							stat_tmp_5->id = id;
-							stat_tmp_5->rx_time = chVTGetSystemTime();
-							stat_tmp_5->tacho_value = buffer_get_int32(rxmsg.data8, &ind);
-							stat_tmp_5->v_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 1e1;
-							break;
-						}
+				case CAN_PACKET_STATUS_5: {
+					can_status_node *node = status_node_id(id, true);
+					if (node) {
+						can_status_msg_5 *stat_tmp_5 = &node->msg_5;
+						ind = 0;
+						stat_tmp_5->rx_time = chVTGetSystemTime();
+						stat_tmp_5->tacho_value = buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp_5->v_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 1e1;
+						stat_tmp_5->id = id;
 					}
-					break;
+				} break;
+
 				default:
 					break;
 				}
@@ -1190,84 +1465,905 @@ static THD_FUNCTION(cancom_status_thread, arg) {
 	(void)arg;
 	chRegSetThreadName("CAN status");
 
+	static const CAN_PACKET_ID status_ids[STATUS_MSGS] = {
+			CAN_PACKET_STATUS, CAN_PACKET_STATUS_2, CAN_PACKET_STATUS_3,
+			CAN_PACKET_STATUS_4, CAN_PACKET_STATUS_5
+	};
+
+	// How much the change value of each message has to change for it to be
+	// sent early when send_can_status_on_change is set. A message with a rate
+	// of 0 is then only sent on change, and not at all without
+	// send_can_status_on_change.
+	static const float change_threshold[STATUS_MSGS] = {
+			1.0, // Motor current, A
+			0.01, // Amp hours used plus charged, Ah
+			0.1, // Watt hours used plus charged, Wh
+			1.0, // Highest of the FET and motor temperatures, degC
+			0.5 // Input voltage, V
+	};
+
+	const systime_t slot_time = MS2ST(CAN_STATUS_MSG_INT_MS);
+	float change_ref[STATUS_MSGS] = {0};
+	systime_t last_sent[STATUS_MSGS] = {0};
+	systime_t last_poll = 0;
+	uint32_t slot = 0;
+	systime_t time_next = chVTGetSystemTime();
+
 	for(;;) {
 		const app_configuration *conf = app_get_configuration();
 
-		if (conf->can_mode == CAN_MODE_VESC) {
-			if (conf->send_can_status == CAN_STATUS_1 ||
-					conf->send_can_status == CAN_STATUS_1_2 ||
-					conf->send_can_status == CAN_STATUS_1_2_3 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				int32_t send_index = 0;
-				uint8_t buffer[8];
-				buffer_append_int32(buffer, (int32_t)mc_interface_get_rpm(), &send_index);
-				buffer_append_int16(buffer, (int16_t)(mc_interface_get_tot_current_filtered() * 1e1), &send_index);
-				buffer_append_int16(buffer, (int16_t)(mc_interface_get_duty_cycle_now() * 1e3), &send_index);
-				comm_can_transmit_eid(conf->controller_id |
-						((uint32_t)CAN_PACKET_STATUS << 8), buffer, send_index);
+		if (conf->can_mode != CAN_MODE_VESC || conf->send_can_status == CAN_STATUS_DISABLED) {
+			chThdSleepMilliseconds(10);
+			time_next = chVTGetSystemTime();
+			continue;
+		}
+
+		const uint32_t rates[STATUS_MSGS] = {
+				conf->send_can_status_rate_hz,
+				conf->send_can_status_2_rate_hz,
+				conf->send_can_status_3_rate_hz,
+				conf->send_can_status_4_rate_hz,
+				conf->send_can_status_5_rate_hz
+		};
+
+		int msgs = conf->send_can_status;
+		if (msgs > STATUS_MSGS) {
+			msgs = STATUS_MSGS;
+		}
+
+		// Changes are checked at most every STATUS_CHANGE_MIN_MS, as reading
+		// the values is the expensive part.
+		bool poll = false;
+		if (conf->send_can_status_on_change &&
+				ST2MS(chVTTimeElapsedSinceX(last_poll)) >= STATUS_CHANGE_MIN_MS) {
+			poll = true;
+			last_poll = chVTGetSystemTimeX();
+		}
+
+		mc_motor_values val;
+		bool val_read = false;
+		uint32_t slots_next = STATUS_SLEEP_MAX_MS / CAN_STATUS_MSG_INT_MS;
+		if (conf->send_can_status_on_change) {
+			slots_next = STATUS_CHANGE_MIN_MS / CAN_STATUS_MSG_INT_MS;
+		}
+
+		// The time is divided into slots of CAN_STATUS_MSG_INT_MS, and message i
+		// is offset by i slots. Messages with the same rate are thus sent in
+		// different slots instead of in a burst. The period is rounded to the
+		// nearest number of slots, and rates above one message per slot are
+		// clamped to one message per slot. The thread only wakes up in slots
+		// where a message is due or changes are to be checked.
+		for (int i = 0;i < msgs;i++) {
+			bool send = false;
+			if (rates[i] > 0) {
+				const uint32_t slot_rate = 1000 / CAN_STATUS_MSG_INT_MS;
+				uint32_t period = (slot_rate + rates[i] / 2) / rates[i];
+				if (period == 0) {
+					period = 1;
+				}
+
+				const uint32_t phase = (slot + i) % period;
+				send = phase == 0;
+
+				const uint32_t slots_due = period - phase;
+				if (slots_due < slots_next) {
+					slots_next = slots_due;
+				}
 			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2 ||
-					conf->send_can_status == CAN_STATUS_1_2_3||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				int32_t send_index = 0;
-				uint8_t buffer[8];
-				buffer_append_int32(buffer, (int32_t)(mc_interface_get_amp_hours(false) * 1e4), &send_index);
-				buffer_append_int32(buffer, (int32_t)(mc_interface_get_amp_hours_charged(false) * 1e4), &send_index);
-				comm_can_transmit_eid(conf->controller_id |
-						((uint32_t)CAN_PACKET_STATUS_2 << 8), buffer, send_index);
+			if (!send && (!poll || change_threshold[i] <= 0.0)) {
+				continue;
 			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2_3 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				int32_t send_index = 0;
-				uint8_t buffer[8];
-				buffer_append_int32(buffer, (int32_t)(mc_interface_get_watt_hours(false) * 1e4), &send_index);
-				buffer_append_int32(buffer, (int32_t)(mc_interface_get_watt_hours_charged(false) * 1e4), &send_index);
-				comm_can_transmit_eid(conf->controller_id |
-						((uint32_t)CAN_PACKET_STATUS_3 << 8), buffer, send_index);
+			if (!val_read) {
+				mc_interface_get_values(&val);
+				val_read = true;
 			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2_3_4 ||
-					conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				int32_t send_index = 0;
-				uint8_t buffer[8];
-				buffer_append_int16(buffer, (int16_t)(mc_interface_temp_fet_filtered() * 1e1), &send_index);
-				buffer_append_int16(buffer, (int16_t)(mc_interface_temp_motor_filtered() * 1e1), &send_index);
-				buffer_append_int16(buffer, (int16_t)(mc_interface_get_tot_current_in_filtered() * 1e1), &send_index);
-				buffer_append_int16(buffer, (int16_t)(mc_interface_get_pid_pos_now() * 50.0), &send_index);
-				comm_can_transmit_eid(conf->controller_id |
-						((uint32_t)CAN_PACKET_STATUS_4 << 8), buffer, send_index);
+			uint8_t buffer[8];
+			float change = 0.0;
+			int len = status_msg_fill(i, &val, buffer, &change);
+
+			if (!send && fabsf(change - change_ref[i]) >= change_threshold[i] &&
+					ST2MS(chVTTimeElapsedSinceX(last_sent[i])) >= STATUS_CHANGE_MIN_MS) {
+				send = true;
 			}
 
-			if (conf->send_can_status == CAN_STATUS_1_2_3_4_5) {
-				int32_t send_index = 0;
-				uint8_t buffer[8];
-				buffer_append_int32(buffer, mc_interface_get_tachometer_value(false), &send_index);
-				buffer_append_int16(buffer, (int16_t)(GET_INPUT_VOLTAGE() * 1e1), &send_index);
-				buffer_append_int16(buffer, 0, &send_index); // Reserved for now
+			if (send) {
 				comm_can_transmit_eid(conf->controller_id |
-						((uint32_t)CAN_PACKET_STATUS_5 << 8), buffer, send_index);
+						((uint32_t)status_ids[i] << 8), buffer, len);
+				change_ref[i] = change;
+				last_sent[i] = chVTGetSystemTimeX();
 			}
 		}
 
-		systime_t sleep_time = CH_CFG_ST_FREQUENCY / conf->send_can_status_rate_hz;
-		if (sleep_time == 0) {
-			sleep_time = 1;
+		if (slots_next == 0) {
+			slots_next = 1;
+		}
+
+		slot += slots_next;
+		time_next += slots_next * slot_time;
+
+		// Skip the slots that were missed if this thread fell behind, sending
+		// them late would only cause a burst. The slot counter still advances
+		// by all of them, so that the messages keep their phase.
+		const systime_t now = chVTGetSystemTimeX();
+		systime_t wait = time_next - now;
+		if (wait == 0 || wait > slots_next * slot_time) {
+			const uint32_t missed = (now - time_next) / slot_time + 1;
+			slot += missed;
+			time_next += missed * slot_time;
+			wait = time_next - now;
 		}
 
-		chThdSleep(sleep_time);
+		chThdSleep(wait);
 	}
 }
 
 static void send_packet_wrapper(unsigned char *data, unsigned int len) {
 	comm_can_send_buffer(rx_buffer_last_id, data, len, 1);
 }
+
+/**
+ * Pass a received buffer on.
+ *
+ * @param send
+ * What to do with it, see comm_can_send_buffer.
+ */
+static void process_rx_buffer(uint8_t *data, unsigned int len, uint8_t send) {
+	switch (send) {
+	case 0:
+		commands_process_packet(data, len, send_packet_wrapper);
+		break;
+	case 1:
+		commands_send_packet(data, len);
+		break;
+	case 2:
+		commands_process_packet(data, len, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Send a buffer as a segmented transfer. The first frame carries the length
+ * and the CRC, and the receiver answers it and every block of frames with a
+ * flow control frame. A flow control frame that asks for an earlier frame than
+ * the sender is at works as a NACK, and the sender continues from there.
+ *
+ * @return
+ * true when the transfer is done. false if the buffer should be sent with the
+ * fill rx buffer frames instead, because the receiver does not support
+ * segmented transfers, did not accept this one or stopped answering.
+ */
+static bool tp_send(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send) {
+	if (len > RX_BUFFER_SIZE) {
+		return false;
+	}
+
+	chMtxLock(&tp_tx_mtx);
+
+	// A node that did not answer may have been rebooting or off the bus, so
+	// it is tried again after a while. Only once though, in case it really
+	// does not support segmented transfers.
+	int attempts = TP_RETRIES;
+	if (tp_legacy[controller_id] > 0) {
+		if (--tp_legacy[controller_id] > 0) {
+			chMtxUnlock(&tp_tx_mtx);
+			return false;
+		}
+
+		attempts = 1;
+	}
+
+	const uint32_t eid_base = controller_id |
+			((uint32_t)app_get_configuration()->controller_id << 16);
+	const int frames = (len + 6) / 7;
+	uint8_t buffer[8];
+	tp_flow flow;
+	bool res = true;
+
+	chBSemReset(&tp_flow_sem, true);
+	tp_tx_dest = controller_id;
+	tp_tx_active = true;
+
+	bool answered = false;
+	for (int i = 0;i < attempts && !answered;i++) {
+		int32_t ind = 0;
+		buffer[ind++] = send;
+		buffer_append_uint16(buffer, len, &ind);
+		buffer_append_uint16(buffer, crc16(data, len), &ind);
+		comm_can_transmit_eid(eid_base | ((uint32_t)CAN_PACKET_TP_FIRST << 8), buffer, ind);
+		answered = tp_wait_flow(TP_TIMEOUT, &flow);
+	}
+
+	if (!answered) {
+		tp_legacy[controller_id] = TP_LEGACY_SENDS;
+		res = false;
+	}
+
+	int acked = -1;
+	int retries = 0;
+
+	while (answered) {
+		if (flow.status == TP_FLOW_DONE) {
+			break;
+		} else if (flow.status != TP_FLOW_CTS) {
+			res = false;
+			break;
+		}
+
+		if (flow.next > acked) {
+			acked = flow.next;
+			retries = 0;
+		} else if (retries++ >= TP_RETRIES) {
+			res = false;
+			break;
+		}
+
+		int end = frames;
+		if (flow.block_size > 0 && flow.next + flow.block_size < end) {
+			end = flow.next + flow.block_size;
+		}
+
+		const int st_min = flow.st_min;
+		bool interrupted = false;
+
+		for (int i = flow.next;i < end;i++) {
+			unsigned int offset = i * 7;
+			unsigned int n = len - offset < 7 ? len - offset : 7;
+			buffer[0] = i;
+			memcpy(buffer + 1, data + offset, n);
+			comm_can_transmit_eid(eid_base | ((uint32_t)CAN_PACKET_TP_DATA << 8), buffer, n + 1);
+
+			// Start over right away on a NACK
+			if (tp_wait_flow(TIME_IMMEDIATE, &flow)) {
+				interrupted = true;
+				break;
+			}
+
+			if (st_min > 0 && (i + 1) < end) {
+				chThdSleepMilliseconds(st_min);
+			}
+		}
+
+		// If nothing comes back flow stays the same, so the block is sent
+		// again and counted as a retry above.
+		if (!interrupted) {
+			tp_wait_flow(TP_TIMEOUT, &flow);
+		}
+	}
+
+	tp_tx_active = false;
+	chMtxUnlock(&tp_tx_mtx);
+
+	return res;
+}
+
+/**
+ * Wait for a flow control frame from the receiver of the current segmented
+ * transfer.
+ *
+ * @return
+ * true if one was received and stored in flow.
+ */
+static bool tp_wait_flow(systime_t timeout, tp_flow *flow) {
+	if (chBSemWaitTimeout(&tp_flow_sem, timeout) != MSG_OK) {
+		return false;
+	}
+
+	chSysLock();
+	*flow = tp_flow_last;
+	chSysUnlock();
+
+	return true;
+}
+
+/**
+ * Handle a segmented transfer frame in the CAN read thread.
+ *
+ * @return
+ * true if the frame belongs to a segmented transfer and was consumed.
+ */
+static bool tp_rx_frame(const CANRxFrame *rxmsg) {
+	const app_configuration *conf = app_get_configuration();
+
+	if (conf->can_mode != CAN_MODE_VESC || rxmsg->IDE != CAN_IDE_EXT ||
+			(rxmsg->EID >> 24) != 0) {
+		return false;
+	}
+
+	const uint8_t cmd = (rxmsg->EID >> 8) & 0xFF;
+	if (cmd != CAN_PACKET_TP_FIRST && cmd != CAN_PACKET_TP_DATA && cmd != CAN_PACKET_TP_FLOW) {
+		return false;
+	}
+
+	const uint8_t src = (rxmsg->EID >> 16) & 0xFF;
+	if ((rxmsg->EID & 0xFF) != conf->controller_id) {
+		return true;
+	}
+
+	const uint8_t *d = rxmsg->data8;
+
+	switch (cmd) {
+	case CAN_PACKET_TP_FLOW:
+		if (tp_tx_active && src == tp_tx_dest && rxmsg->DLC >= 4) {
+			chSysLock();
+			tp_flow_last.status = d[0];
+			tp_flow_last.next = d[1];
+			tp_flow_last.block_size = d[2];
+			tp_flow_last.st_min = d[3];
+			chBSemSignalI(&tp_flow_sem);
+			chSchRescheduleS();
+			chSysUnlock();
+		}
+		break;
+
+	case CAN_PACKET_TP_FIRST: {
+		if (rxmsg->DLC < 5) {
+			break;
+		}
+
+		int32_t ind = 1;
+		unsigned int len = buffer_get_uint16(d, &ind);
+		tp_rx_slot *slot = tp_rx_slot_get(src, true);
+
+		if (!slot || slot->state == TP_RX_READY || len == 0 || len > RX_BUFFER_SIZE) {
+			tp_send_flow(src, TP_FLOW_ABORT, 0);
+			break;
+		}
+
+		if (slot->state == TP_RX_RECEIVING && slot->src != src) {
+			tp_rx_evicted[slot->src / 8] |= 1 << (slot->src % 8);
+		}
+		tp_rx_evicted[src / 8] &= ~(1 << (src % 8));
+
+		// The sender supports segmented transfers
+		tp_legacy[src] = 0;
+
+		slot->src = src;
+		slot->send = d[0];
+		slot->len = len;
+		slot->crc = buffer_get_uint16(d, &ind);
+		slot->frames = (len + 6) / 7;
+		slot->next = 0;
+		slot->block_left = TP_BLOCK_SIZE;
+		slot->nacked = false;
+		slot->last_time = chVTGetSystemTimeX();
+		slot->state = TP_RX_RECEIVING;
+		tp_send_flow(src, TP_FLOW_CTS, 0);
+	} break;
+
+	case CAN_PACKET_TP_DATA: {
+		if (rxmsg->DLC < 2) {
+			break;
+		}
+
+		tp_rx_slot *slot = tp_rx_slot_get(src, false);
+		if (!slot) {
+			// The transfer lost its slot to another sender while in progress,
+			// make the sender start over with the fill rx buffer frames. Frames
+			// from other senders, e.g. a repeat of a transfer that was
+			// completed and whose slot has been reused since, are ignored.
+			if (tp_rx_evicted[src / 8] & (1 << (src % 8))) {
+				tp_rx_evicted[src / 8] &= ~(1 << (src % 8));
+				tp_send_flow(src, TP_FLOW_ABORT, 0);
+			}
+			break;
+		}
+
+		const int index = d[0];
+
+		// The sender did not get the last flow control frame
+		if (slot->state == TP_RX_READY || slot->state == TP_RX_DONE) {
+			if (index == slot->frames - 1) {
+				tp_send_flow(src, TP_FLOW_DONE, slot->frames);
+			}
+			break;
+		}
+
+		if (slot->state != TP_RX_RECEIVING) {
+			break;
+		}
+
+		unsigned int offset = index * 7;
+		unsigned int n = slot->len - offset < 7 ? slot->len - offset : 7;
+
+		if (index == slot->next && (unsigned int)(rxmsg->DLC - 1) == n) {
+			memcpy(slot->data + offset, d + 1, n);
+			slot->next++;
+			slot->nacked = false;
+			slot->last_time = chVTGetSystemTimeX();
+
+			if (slot->next == slot->frames) {
+				if (crc16(slot->data, slot->len) == slot->crc) {
+					slot->state = TP_RX_READY;
+					tp_send_flow(src, TP_FLOW_DONE, slot->frames);
+				} else {
+					slot->state = TP_RX_FREE;
+					tp_send_flow(src, TP_FLOW_ABORT, 0);
+				}
+			} else if (TP_BLOCK_SIZE > 0 && --slot->block_left == 0) {
+				slot->block_left = TP_BLOCK_SIZE;
+				tp_send_flow(src, TP_FLOW_CTS, slot->next);
+			}
+		} else if (!slot->nacked) {
+			// Lost or repeated frame, ask for the missing one once
+			slot->nacked = true;
+			slot->block_left = TP_BLOCK_SIZE;
+			tp_send_flow(src, TP_FLOW_CTS, slot->next);
+		}
+	} break;
+
+	default:
+		break;
+	}
+
+	return true;
+}
+
+/**
+ * Get the reassembly slot of a sender. When a new slot is needed, a free slot
+ * is used first, then the least recently used of the finished transfers, then
+ * the least recently used of the transfers that timed out and finally the
+ * least recently used transfer in progress. Slots that wait to be processed
+ * are never taken.
+ *
+ * @param src
+ * Controller id of the sender.
+ *
+ * @param add
+ * Hand out a slot if the sender does not have one.
+ *
+ * @return
+ * The slot, or 0 if there is none.
+ */
+static tp_rx_slot *tp_rx_slot_get(uint8_t src, bool add) {
+	tp_rx_slot *best = 0;
+	int best_rank = 4;
+
+	for (int i = 0;i < TP_RX_SLOTS;i++) {
+		tp_rx_slot *slot = &tp_rx_slots[i];
+
+		if (slot->state != TP_RX_FREE && slot->src == src) {
+			return slot;
+		}
+
+		int rank;
+		switch (slot->state) {
+		case TP_RX_FREE: rank = 0; break;
+		case TP_RX_DONE: rank = 1; break;
+		case TP_RX_RECEIVING:
+			rank = chVTTimeElapsedSinceX(slot->last_time) > TP_RX_TIMEOUT ? 2 : 3;
+			break;
+		default: rank = 4; break;
+		}
+
+		if (rank < best_rank || (best && rank == best_rank && rank > 0 &&
+				chVTTimeElapsedSinceX(slot->last_time) > chVTTimeElapsedSinceX(best->last_time))) {
+			best = slot;
+			best_rank = rank;
+		}
+	}
+
+	return add ? best : 0;
+}
+
+static void tp_send_flow(uint8_t dest, uint8_t status, int next) {
+	uint8_t buffer[4];
+	buffer[0] = status;
+	buffer[1] = next;
+	buffer[2] = TP_BLOCK_SIZE;
+	buffer[3] = TP_ST_MIN_MS;
+	comm_can_transmit_eid(dest | ((uint32_t)CAN_PACKET_TP_FLOW << 8) |
+			((uint32_t)app_get_configuration()->controller_id << 16), buffer, 4);
+}
+
+/**
+ * Process the segmented transfers that have been received, in the CAN
+ * process thread.
+ */
+static void tp_rx_process(void) {
+	for (int i = 0;i < TP_RX_SLOTS;i++) {
+		tp_rx_slot *slot = &tp_rx_slots[i];
+
+		if (slot->state == TP_RX_READY) {
+			rx_buffer_last_id = slot->src;
+			process_rx_buffer(slot->data, slot->len, slot->send);
+			slot->last_time = chVTGetSystemTimeX();
+			slot->state = TP_RX_DONE;
+		}
+	}
+}
+
+static int fw_node_index(int id, bool add) {
+	for (int i = 0;i < fw_node_num;i++) {
+		if (fw_nodes[i].id == id) {
+			return i;
+		}
+	}
+
+	if (!add || fw_node_num >= FW_NODES_MAX) {
+		return -1;
+	}
+
+	int i = fw_node_num;
+	memset(&fw_nodes[i], 0, sizeof(can_fw_node));
+	fw_nodes[i].id = id;
+	fw_ack_seq[i] = fw_tx_seq;
+	fw_ack_seen[i] = false;
+	fw_node_num++;
+
+	return i;
+}
+
+static void fw_discover_nodes(void) {
+	fw_node_num = 0;
+	fw_discover = true;
+
+	uint8_t buffer[1];
+	buffer[0] = app_get_configuration()->controller_id;
+
+	for (int i = 0;i < FW_DISCOVER_MS / 10;i++) {
+		comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_PING << 8), buffer, 1);
+		chThdSleepMilliseconds(10);
+	}
+
+	fw_discover = false;
+}
+
+/**
+ * Broadcast a firmware chunk of up to FW_CHUNK_MAX bytes and retransmit the
+ * frames that nodes report missing until all of them have written it.
+ */
+static void fw_send_chunk(uint32_t offset, uint8_t *data, unsigned int len, bool first) {
+	const uint8_t seq = ++fw_tx_seq;
+	const unsigned int frames = (len + 6) / 7;
+	const uint64_t all = ((uint64_t)1 << frames) - 1;
+	uint64_t send = all;
+
+	uint8_t begin[8];
+	int32_t ind = 0;
+	begin[ind++] = seq;
+	begin[ind++] = offset >> 16;
+	begin[ind++] = offset >> 8;
+	begin[ind++] = offset;
+	buffer_append_uint16(begin, len, &ind);
+	buffer_append_uint16(begin, crc16(data, len), &ind);
+
+	fw_tp = chThdGetSelfX();
+
+	for (int round = 0;round < FW_ROUNDS_MAX && send;round++) {
+		uint8_t buffer[8];
+
+		comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_FW_CHUNK_BEGIN << 8), begin, ind);
+
+		for (unsigned int f = 0;f < frames;f++) {
+			if (send & ((uint64_t)1 << f)) {
+				unsigned int pos = f * 7;
+				unsigned int send_len = (len - pos) < 7 ? (len - pos) : 7;
+				buffer[0] = ((seq & FW_SEQ_MASK) << FW_FRAME_BITS) | f;
+				memcpy(buffer + 1, data + pos, send_len);
+				comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_FW_DATA << 8), buffer, send_len + 1);
+			}
+		}
+
+		chSysLock();
+		for (int i = 0;i < fw_node_num;i++) {
+			fw_ack_seen[i] = false;
+		}
+		chSysUnlock();
+		chEvtGetAndClearEvents((eventmask_t)1 << 28);
+
+		buffer[0] = seq;
+		buffer[1] = app_get_configuration()->controller_id;
+		comm_can_transmit_eid(255 | ((uint32_t)CAN_PACKET_FW_CHUNK_END << 8), buffer, 2);
+
+		// Wait until all nodes that are expected to answer have done so
+		systime_t start = chVTGetSystemTimeX();
+		for (;;) {
+			bool answered = true;
+
+			chSysLock();
+			for (int i = 0;i < fw_node_num;i++) {
+				if (!fw_nodes[i].legacy && !fw_nodes[i].failed && !fw_ack_seen[i]) {
+					answered = false;
+				}
+			}
+			chSysUnlock();
+
+			systime_t elapsed = chVTTimeElapsedSinceX(start);
+			if (answered || elapsed >= FW_ACK_TIMEOUT) {
+				break;
+			}
+
+			chEvtWaitAnyTimeout((eventmask_t)1 << 28, FW_ACK_TIMEOUT - elapsed);
+		}
+
+		// Send the frames that any node is missing again. Nodes that did not
+		// answer get everything.
+		send = 0;
+
+		chSysLock();
+		for (int i = 0;i < fw_node_num;i++) {
+			can_fw_node *node = &fw_nodes[i];
+
+			if (node->failed) {
+				continue;
+			}
+
+			if (fw_ack_seen[i] && fw_ack_seq[i] == seq) {
+				if (fw_ack_status[i] == FW_ACK_WRITTEN) {
+					node->bytes_written = offset + len;
+					node->legacy = false;
+				} else if (fw_ack_status[i] == FW_ACK_FAILED) {
+					node->failed = true;
+				} else {
+					uint64_t missing = ~fw_ack_frames[i] & all;
+					send |= missing;
+					node->frames_resent += __builtin_popcountll(missing);
+				}
+			} else if (!node->legacy) {
+				send = all;
+				node->frames_resent += frames;
+			}
+		}
+		chSysUnlock();
+	}
+
+	// Nodes that never answered the first chunk are assumed to lack support
+	// for the broadcast. Others that did not get the chunk have fallen out.
+	for (int i = 0;i < fw_node_num;i++) {
+		can_fw_node *node = &fw_nodes[i];
+
+		if (node->legacy || node->failed ||
+				(fw_ack_seq[i] == seq && fw_ack_status[i] == FW_ACK_WRITTEN)) {
+			continue;
+		}
+
+		if (first && fw_ack_seq[i] != seq) {
+			node->legacy = true;
+		} else {
+			node->failed = true;
+		}
+	}
+
+	fw_tp = 0;
+}
+
+/**
+ * Handle a broadcast firmware update frame, on the nodes that are updated as
+ * well as on the node that sends the update.
+ *
+ * Data frames carry the two lowest bits of the chunk sequence number next to
+ * the frame index. Frames cannot overtake each other on the bus, but a node
+ * can miss the begin frame of a chunk, e.g. when its frame ring overruns.
+ * Without the sequence bits it would then take the frames of that chunk as
+ * part of the previous one.
+ */
+static void fw_rx_frame(CAN_PACKET_ID cmd, const uint8_t *data, uint8_t len) {
+	int32_t ind = 0;
+
+	switch (cmd) {
+	case CAN_PACKET_FW_CHUNK_BEGIN: {
+		if (len < 8) {
+			break;
+		}
+
+		uint8_t seq = data[ind++];
+		uint32_t offset = (uint32_t)data[ind++] << 16;
+		offset |= (uint32_t)data[ind++] << 8;
+		offset |= (uint32_t)data[ind++];
+		unsigned int chunk_len = buffer_get_uint16(data, &ind);
+		uint16_t crc = buffer_get_uint16(data, &ind);
+
+		if (chunk_len > FW_CHUNK_MAX) {
+			break;
+		}
+
+		// The begin frame is repeated with every retransmission, keep
+		// what has been received of the chunk then.
+		if (seq != fw_rx_seq || offset != fw_rx_offset ||
+				chunk_len != fw_rx_len || crc != fw_rx_crc) {
+			fw_rx_seq = seq;
+			fw_rx_offset = offset;
+			fw_rx_len = chunk_len;
+			fw_rx_crc = crc;
+			fw_rx_frames = 0;
+			fw_rx_status = FW_ACK_MISSING;
+		}
+	} break;
+
+	case CAN_PACKET_FW_DATA: {
+		unsigned int frame = data[0] & FW_FRAME_MASK;
+		unsigned int pos = frame * 7;
+
+		if (len > 1 && (data[0] >> FW_FRAME_BITS) == (fw_rx_seq & FW_SEQ_MASK) &&
+				frame < FW_CHUNK_FRAMES && (pos + len - 1) <= fw_rx_len &&
+				fw_rx_status == FW_ACK_MISSING) {
+			memcpy(fw_rx_buffer + pos, data + 1, len - 1);
+			fw_rx_frames |= (uint64_t)1 << frame;
+		}
+	} break;
+
+	case CAN_PACKET_FW_CHUNK_END:
+		if (len >= 2 && data[0] == fw_rx_seq) {
+			fw_rx_chunk_end(data[1]);
+		}
+		break;
+
+	case CAN_PACKET_FW_ACK: {
+		if (len < 8) {
+			break;
+		}
+
+		int node = fw_node_index(data[0], true);
+		if (node < 0) {
+			break;
+		}
+
+		uint64_t frames = 0;
+		for (int i = 0;i < 5;i++) {
+			frames |= (uint64_t)data[3 + i] << (8 * i);
+		}
+
+		chSysLock();
+		fw_ack_seq[node] = data[1];
+		fw_ack_status[node] = data[2];
+		fw_ack_frames[node] = frames;
+		fw_ack_seen[node] = true;
+		chSysUnlock();
+
+		if (fw_tp) {
+			chEvtSignal(fw_tp, (eventmask_t)1 << 28);
+		}
+	} break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Handle the end of a broadcast firmware chunk. The chunk is written when all
+ * of its frames have arrived, and the master gets the status and the frames
+ * received so far.
+ */
+static void fw_rx_chunk_end(uint8_t master_id) {
+	const unsigned int frames = (fw_rx_len + 6) / 7;
+	const uint64_t all = ((uint64_t)1 << frames) - 1;
+
+	if (fw_rx_status == FW_ACK_MISSING && fw_rx_len > 0 && (fw_rx_frames & all) == all) {
+		if (crc16(fw_rx_buffer, fw_rx_len) == fw_rx_crc) {
+			if (nrf_driver_ext_nrf_running()) {
+				nrf_driver_pause(2000);
+			}
+
+			uint16_t res = flash_helper_write_new_app_data(fw_rx_offset, fw_rx_buffer, fw_rx_len);
+			fw_rx_status = res == FLASH_COMPLETE ? FW_ACK_WRITTEN : FW_ACK_FAILED;
+			SHUTDOWN_RESET();
+		} else {
+			fw_rx_frames = 0;
+		}
+	}
+
+	uint8_t buffer[8];
+	int32_t ind = 0;
+	buffer[ind++] = app_get_configuration()->controller_id;
+	buffer[ind++] = fw_rx_seq;
+	buffer[ind++] = fw_rx_status;
+	for (int i = 0;i < 5;i++) {
+		buffer[ind++] = fw_rx_frames >> (8 * i);
+	}
+
+	comm_can_transmit_eid(master_id | ((uint32_t)CAN_PACKET_FW_ACK << 8), buffer, ind);
+}
+
+/**
+ * Fill the payload of a status message.
+ *
+ * @param msg
+ * The message, 0 for CAN_PACKET_STATUS to 4 for CAN_PACKET_STATUS_5.
+ *
+ * @param val
+ * The current motor values.
+ *
+ * @param buffer
+ * Buffer for the payload, at least 8 bytes.
+ *
+ * @param change
+ * The value that can trigger sending the message early is stored here.
+ *
+ * @return
+ * The payload length.
+ */
+static int status_msg_fill(int msg, const mc_motor_values *val, uint8_t *buffer, float *change) {
+	int32_t ind = 0;
+
+	switch (msg) {
+	case 0:
+		buffer_append_int32(buffer, (int32_t)val->rpm, &ind);
+		buffer_append_int16(buffer, (int16_t)(val->current_filtered * 1e1), &ind);
+		buffer_append_int16(buffer, (int16_t)(val->duty_now * 1e3), &ind);
+		*change = val->current_filtered;
+		break;
+
+	case 1: {
+		float ah = mc_interface_get_amp_hours(false);
+		float ah_charged = mc_interface_get_amp_hours_charged(false);
+		buffer_append_int32(buffer, (int32_t)(ah * 1e4), &ind);
+		buffer_append_int32(buffer, (int32_t)(ah_charged * 1e4), &ind);
+		*change = ah + ah_charged;
+	} break;
+
+	case 2: {
+		float wh = mc_interface_get_watt_hours(false);
+		float wh_charged = mc_interface_get_watt_hours_charged(false);
+		buffer_append_int32(buffer, (int32_t)(wh * 1e4), &ind);
+		buffer_append_int32(buffer, (int32_t)(wh_charged * 1e4), &ind);
+		*change = wh + wh_charged;
+	} break;
+
+	case 3: {
+		float temp_fet = mc_interface_temp_fet_filtered();
+		float temp_motor = mc_interface_temp_motor_filtered();
+		buffer_append_int16(buffer, (int16_t)(temp_fet * 1e1), &ind);
+		buffer_append_int16(buffer, (int16_t)(temp_motor * 1e1), &ind);
+		buffer_append_int16(buffer, (int16_t)(val->current_in_filtered * 1e1), &ind);
+		buffer_append_int16(buffer, (int16_t)(val->pid_pos_now * 50.0), &ind);
+		*change = fmaxf(temp_fet, temp_motor);
+	} break;
+
+	case 4: {
+		float v_in = GET_INPUT_VOLTAGE();
+		buffer_append_int32(buffer, val->tachometer, &ind);
+		buffer_append_int16(buffer, (int16_t)(v_in * 1e1), &ind);
+		buffer_append_int16(buffer, 0, &ind); // Reserved for now
+		*change = v_in;
+	} break;
+
+	default:
+		break;
+	}
+
+	return ind;
+}
 #endif
 
+/**
+ * Look up the status messages of a node. The slot of each controller id is
+ * stored in a table indexed by the id, so no search is needed. Slots are
+ * handed out in the order the nodes are first seen and are never released.
+ *
+ * @param id
+ * Controller id of the node.
+ *
+ * @param add
+ * Give the node a slot if it does not have one. Only the CAN process thread
+ * may do this.
+ *
+ * @return
+ * The status messages of the node, or 0 if it does not have a slot.
+ */
+static can_status_node *status_node_id(int id, bool add) {
+	if (id < 0 || id > 255) {
+		return 0;
+	}
+
+	int slot = stat_node_slot[id];
+	if (slot > 0) {
+		return &stat_nodes[slot - 1];
+	}
+
+	if (!add || stat_nodes_used >= CAN_STATUS_MSGS_TO_STORE) {
+		return 0;
+	}
+
+	stat_node_slot[id] = ++stat_nodes_used;
+	return &stat_nodes[stat_nodes_used - 1];
+}
+
 /**
  * Set the CAN timing. The CAN is clocked at 42 MHz, and the baud rate can be
  * calculated with
@@ -1294,6 +2390,80 @@ static void set_timing(int brp, int ts1, int ts2) {
 	cancfg.btr = CAN_BTR_SJW(3) | CAN_BTR_TS2(ts2) |
 		CAN_BTR_TS1(ts1) | CAN_BTR_BRP(brp);
 
+	restart_can();
+}
+
+/**
+ * Program the acceptance filters from the CAN mode and the controller id, so
+ * that frames this controller does not use are dropped by the hardware. In
+ * VESC mode only commands to this controller, broadcast commands, status
+ * messages from other controllers and, if there is a callback for them,
+ * standard frames are received. The other modes receive everything.
+ *
+ * The CAN must be stopped when this is called.
+ */
+static void set_filters(void) {
+	static const CAN_PACKET_ID status_cmds[] = {
+			CAN_PACKET_STATUS, CAN_PACKET_STATUS_2, CAN_PACKET_STATUS_3,
+			CAN_PACKET_STATUS_4, CAN_PACKET_STATUS_5
+	};
+
+	const app_configuration *conf = app_get_configuration();
+	CANFilter filters[FILTERS_MAX];
+	int num = 0;
+
+	if (conf->can_mode == CAN_MODE_VESC) {
+		// 32-bit mask mode. The extended id is in bits 3 to 31 and the
+		// controller id is in the lowest 8 bits of it.
+		const uint8_t ids[] = {conf->controller_id, 255};
+		for (unsigned int i = 0;i < sizeof(ids);i++) {
+			filters[num].filter = num;
+			filters[num].mode = 0;
+			filters[num].scale = 1;
+			filters[num].assignment = 0;
+			filters[num].register1 = ((uint32_t)ids[i] << 3) | FILTER_IDE;
+			filters[num].register2 = (0xFFu << 3) | FILTER_IDE;
+			num++;
+		}
+
+		for (unsigned int i = 0;i < sizeof(status_cmds) / sizeof(status_cmds[0]);i++) {
+			filters[num].filter = num;
+			filters[num].mode = 0;
+			filters[num].scale = 1;
+			filters[num].assignment = 0;
+			filters[num].register1 = ((uint32_t)status_cmds[i] << 11) | FILTER_IDE;
+			filters[num].register2 = (0x1FFFFF00u << 3) | FILTER_IDE;
+			num++;
+		}
+
+		if (sid_callback) {
+			filters[num].filter = num;
+			filters[num].mode = 0;
+			filters[num].scale = 1;
+			filters[num].assignment = 0;
+			filters[num].register1 = 0;
+			filters[num].register2 = FILTER_IDE;
+			num++;
+		}
+	}
+
+	// No filters lets everything through
+	canSTM32SetFilters(FILTER_CAN2_START, num, filters);
+}
+
+/**
+ * Restart the CAN with the current timing and updated acceptance filters.
+ */
+static void restart_can(void) {
+#if CAN_ENABLE
+	chMtxLock(&can_mtx);
+#endif
+
 	canStop(&HW_CAN_DEV);
+	set_filters();
 	canStart(&HW_CAN_DEV, &cancfg);
+
+#if CAN_ENABLE
+	chMtxUnlock(&can_mtx);
+#endif
 }
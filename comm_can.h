@@ -35,6 +35,9 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len);
 void comm_can_set_sid_rx_callback(void (*p_func)(uint32_t id, uint8_t *data, uint8_t len));
 void comm_can_set_eid_rx_callback(void (*p_func)(uint32_t id, uint8_t *data, uint8_t len));
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send);
+void comm_can_write_new_app_data_all(uint8_t *cmd, unsigned int len);
+int comm_can_fw_node_num(void);
+can_fw_node *comm_can_fw_node(int index);
 void comm_can_set_duty(uint8_t controller_id, float duty);
 void comm_can_set_current(uint8_t controller_id, float current);
 void comm_can_set_current_brake(uint8_t controller_id, float current);
@@ -64,5 +67,6 @@ can_status_msg_4 *comm_can_get_status_msg_4_id(int id);
 can_status_msg_5 *comm_can_get_status_msg_5_index(int index);
 can_status_msg_5 *comm_can_get_status_msg_5_id(int id);
 CANRxFrame *comm_can_get_rx_frame(void);
+void comm_can_get_rx_stats(uint32_t *overrun, int *high_water, int *size);
 
 #endif /* COMM_CAN_H_ */
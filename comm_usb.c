@@ -42,6 +42,8 @@ static volatile bool was_timeout = false;
 // Private functions
 static void process_packet(unsigned char *data, unsigned int len);
 static void send_packet_raw(unsigned char *buffer, unsigned int len);
+static unsigned char *send_buffer_begin(void);
+static void send_buffer_end(unsigned int len);
 
 static THD_FUNCTION(serial_read_thread, arg) {
 	(void)arg;
@@ -82,7 +84,12 @@ static THD_FUNCTION(serial_process_thread, arg) {
 		chEvtWaitAny((eventmask_t) 1);
 
 		while (serial_rx_read_pos != serial_rx_write_pos) {
-			packet_process_byte(serial_rx_buffer[serial_rx_read_pos++], PACKET_HANDLER);
+			int write_pos = serial_rx_write_pos;
+			int end = write_pos > serial_rx_read_pos ? write_pos : SERIAL_RX_BUFFER_SIZE;
+
+			packet_process_buffer(serial_rx_buffer + serial_rx_read_pos,
+					end - serial_rx_read_pos, PACKET_HANDLER);
+			serial_rx_read_pos = end;
 
 			if (serial_rx_read_pos == SERIAL_RX_BUFFER_SIZE) {
 				serial_rx_read_pos = 0;
@@ -116,11 +123,22 @@ static void send_packet_raw(unsigned char *buffer, unsigned int len) {
 	}
 }
 
+static unsigned char *send_buffer_begin(void) {
+	chMtxLock(&send_mutex);
+	return packet_get_send_buffer(PACKET_HANDLER);
+}
+
+static void send_buffer_end(unsigned int len) {
+	packet_send_packet(packet_get_send_buffer(PACKET_HANDLER), len, PACKET_HANDLER);
+	chMtxUnlock(&send_mutex);
+}
+
 void comm_usb_init(void) {
 	comm_usb_serial_init();
 	packet_init(send_packet_raw, process_packet, PACKET_HANDLER);
 
 	chMtxObjectInit(&send_mutex);
+	commands_register_tx_buffer(comm_usb_send_packet, send_buffer_begin, send_buffer_end);
 
 	// Threads
 	chThdCreateStatic(serial_read_thread_wa, sizeof(serial_read_thread_wa), NORMALPRIO, serial_read_thread, NULL);
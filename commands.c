@@ -52,10 +52,36 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+// Settings
+#define STREAM_FIELDS				12 // Number of fields the values stream can send
+#define STREAM_RATE_MAX				5000 // Highest values stream sample rate in Hz
+#define STREAM_SAMPLES_MAX			100 // Most samples batched in one values stream packet
+#define TX_BUFFERS_MAX				4 // Transports that can provide their own send buffer
+#define UPLOAD_WINDOW				4 // Firmware chunks that can be queued for writing
+
+// Private types
+typedef struct {
+	void(*send_func)(unsigned char *data, unsigned int len);
+	unsigned char*(*begin_func)(void);
+	void(*end_func)(unsigned int len);
+} tx_buffer_t;
+
+typedef struct {
+	uint32_t offset;
+	unsigned int len;
+	void(*reply_func)(unsigned char *data, unsigned int len);
+	uint8_t data[PACKET_MAX_PL_LEN];
+} upload_chunk_t;
+
 // Threads
 static THD_FUNCTION(blocking_thread, arg);
 static THD_WORKING_AREA(blocking_thread_wa, 2048);
 static thread_t *blocking_tp;
+static THD_FUNCTION(stream_thread, arg);
+static THD_WORKING_AREA(stream_thread_wa, 1024);
+static thread_t *stream_tp;
+static THD_FUNCTION(upload_thread, arg);
+static THD_WORKING_AREA(upload_thread_wa, 1024);
 
 // Private variables
 static uint8_t send_buffer_global[PACKET_MAX_PL_LEN];
@@ -70,12 +96,44 @@ static disp_pos_mode display_position_mode;
 static mutex_t print_mutex;
 static mutex_t send_buffer_mutex;
 static mutex_t terminal_mutex;
+static volatile uint32_t stream_mask = 0;
+static volatile int stream_period = 0;
+static volatile int stream_samples = 1;
+static void(* volatile send_func_stream)(unsigned char *data, unsigned int len) = 0;
+static tx_buffer_t tx_buffers[TX_BUFFERS_MAX];
+static int tx_buffer_cnt = 0;
+static upload_chunk_t upload_chunks[UPLOAD_WINDOW];
+static msg_t upload_free_msgs[UPLOAD_WINDOW];
+static msg_t upload_queued_msgs[UPLOAD_WINDOW];
+static mailbox_t upload_free_mb;
+static mailbox_t upload_queued_mb;
+static volatile uint32_t upload_offset_queued = 0;
+static volatile uint32_t upload_offset_written = 0;
+static volatile bool upload_ok = true;
+
+// Private functions
+static void stream_sample(int32_t *val);
+static tx_buffer_t *tx_buffer_find(void(*func)(unsigned char *data, unsigned int len));
+static uint8_t *reply_begin(void(*func)(unsigned char *data, unsigned int len), tx_buffer_t **tx);
+static void reply_end(void(*func)(unsigned char *data, unsigned int len),
+		tx_buffer_t *tx, uint8_t *buffer, unsigned int len);
+static int upload_free_slots(void);
+static void upload_write(uint32_t offset, uint8_t *data, unsigned int len);
+static void upload_send_ack(void(*func)(unsigned char *data, unsigned int len));
 
 void commands_init(void) {
 	chMtxObjectInit(&print_mutex);
 	chMtxObjectInit(&send_buffer_mutex);
 	chMtxObjectInit(&terminal_mutex);
 	chThdCreateStatic(blocking_thread_wa, sizeof(blocking_thread_wa), NORMALPRIO, blocking_thread, NULL);
+	chThdCreateStatic(stream_thread_wa, sizeof(stream_thread_wa), NORMALPRIO - 1, stream_thread, NULL);
+
+	chMBObjectInit(&upload_free_mb, upload_free_msgs, UPLOAD_WINDOW);
+	chMBObjectInit(&upload_queued_mb, upload_queued_msgs, UPLOAD_WINDOW);
+	for (int i = 0;i < UPLOAD_WINDOW;i++) {
+		chMBPost(&upload_free_mb, i, TIME_IMMEDIATE);
+	}
+	chThdCreateStatic(upload_thread_wa, sizeof(upload_thread_wa), NORMALPRIO, upload_thread, NULL);
 }
 
 /**
@@ -128,6 +186,42 @@ void commands_send_packet_last_blocking(unsigned char *data, unsigned int len) {
 	}
 }
 
+/**
+ * Register the send buffer of a transport. Replies to that transport are then
+ * built directly in its packet buffer instead of in a shared buffer that is
+ * copied when sending.
+ *
+ * @param send_func
+ * The send function of the transport, as passed to commands_process_packet.
+ *
+ * @param begin_func
+ * Lock the transport and return space for PACKET_MAX_PL_LEN bytes.
+ *
+ * @param end_func
+ * Send len bytes from that space and unlock the transport.
+ */
+void commands_register_tx_buffer(void(*send_func)(unsigned char *data, unsigned int len),
+		unsigned char*(*begin_func)(void), void(*end_func)(unsigned int len)) {
+	int ind = 0;
+	for (ind = 0;ind < tx_buffer_cnt;ind++) {
+		if (tx_buffers[ind].send_func == send_func) {
+			break;
+		}
+	}
+
+	if (ind == TX_BUFFERS_MAX) {
+		return;
+	}
+
+	tx_buffers[ind].begin_func = begin_func;
+	tx_buffers[ind].end_func = end_func;
+	tx_buffers[ind].send_func = send_func;
+
+	if (ind == tx_buffer_cnt) {
+		tx_buffer_cnt++;
+	}
+}
+
 /**
  * Process a received buffer with commands and data.
  *
@@ -188,6 +282,47 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		reply_func(send_buffer, ind);
 	} break;
 
+	case COMM_WRITE_NEW_APP_DATA_WINDOW: {
+		// The chunk is queued and written by the upload thread, which
+		// acknowledges it. Chunks that are not next in line are not written,
+		// the acknowledgement tells the host where to continue from. A chunk
+		// without data can be used to ask for the state and the window size.
+		if (len < 4) {
+			break;
+		}
+
+		int32_t ind = 0;
+		uint32_t new_app_offset = buffer_get_uint32(data, &ind);
+		msg_t slot;
+
+		// The reply function of transports without a registered send buffer,
+		// such as CAN, sends to whichever node sent the last packet. Write
+		// their chunks here and acknowledge them right away instead.
+		if (!tx_buffer_find(reply_func)) {
+			if (upload_ok && new_app_offset == upload_offset_queued &&
+					upload_offset_queued == upload_offset_written && len > (unsigned int)ind) {
+				upload_offset_queued += len - ind;
+				upload_write(new_app_offset, data + ind, len - ind);
+			}
+
+			upload_send_ack(reply_func);
+			break;
+		}
+
+		if (upload_ok && new_app_offset == upload_offset_queued && len > (unsigned int)ind &&
+				chMBFetch(&upload_free_mb, &slot, TIME_IMMEDIATE) == MSG_OK) {
+			upload_chunk_t *chunk = &upload_chunks[slot];
+			chunk->offset = new_app_offset;
+			chunk->len = len - ind;
+			chunk->reply_func = reply_func;
+			memcpy(chunk->data, data + ind, chunk->len);
+			upload_offset_queued += chunk->len;
+			chMBPost(&upload_queued_mb, slot, TIME_IMMEDIATE);
+		} else {
+			upload_send_ack(reply_func);
+		}
+	} break;
+
 	case COMM_JUMP_TO_BOOTLOADER_ALL_CAN:
 		data[-1] = COMM_JUMP_TO_BOOTLOADER;
 		comm_can_send_buffer(255, data - 1, len + 1, 2);
@@ -214,8 +349,18 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		if (nrf_driver_ext_nrf_running()) {
 			nrf_driver_pause(6000);
 		}
+
+		// Let queued chunks of a previous windowed upload finish first
+		while (upload_free_slots() < UPLOAD_WINDOW) {
+			chThdSleepMilliseconds(1);
+		}
+
 		uint16_t flash_res = flash_helper_erase_new_app(buffer_get_uint32(data, &ind));
 
+		upload_offset_queued = 0;
+		upload_offset_written = 0;
+		upload_ok = flash_res == FLASH_COMPLETE;
+
 		ind = 0;
 		uint8_t send_buffer[50];
 		send_buffer[ind++] = COMM_ERASE_NEW_APP;
@@ -241,7 +386,7 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 
 		data[-1] = COMM_WRITE_NEW_APP_DATA;
 
-		comm_can_send_buffer(255, data - 1, len + 1, 2);
+		comm_can_write_new_app_data_all(data - 1, len + 1);
 		/* Falls through. */
 		/* no break */
 	case COMM_WRITE_NEW_APP_DATA_LZO:
@@ -264,6 +409,11 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		}
 		uint16_t flash_res = flash_helper_write_new_app_data(new_app_offset, data + ind, len - ind);
 
+		// Report a corrupted image as soon as its last chunk is written
+		if (flash_res == FLASH_COMPLETE && flash_helper_new_app_state() == NEW_APP_CRC_ERROR) {
+			flash_res = FLASH_ERROR_PROGRAM;
+		}
+
 		SHUTDOWN_RESET();
 
 		ind = 0;
@@ -275,9 +425,12 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 
 	case COMM_GET_VALUES:
 	case COMM_GET_VALUES_SELECTIVE: {
+		mc_motor_values val;
+		mc_interface_get_values(&val);
+
 		int32_t ind = 0;
-		chMtxLock(&send_buffer_mutex);
-		uint8_t *send_buffer = send_buffer_global;
+		tx_buffer_t *tx;
+		uint8_t *send_buffer = reply_begin(reply_func, &tx);
 		send_buffer[ind++] = packet_id;
 
 		uint32_t mask = 0xFFFFFFFF;
@@ -306,10 +459,10 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_iq(), 1e2, &ind);
 		}
 		if (mask & ((uint32_t)1 << 6)) {
-			buffer_append_float16(send_buffer, mc_interface_get_duty_cycle_now(), 1e3, &ind);
+			buffer_append_float16(send_buffer, val.duty_now, 1e3, &ind);
 		}
 		if (mask & ((uint32_t)1 << 7)) {
-			buffer_append_float32(send_buffer, mc_interface_get_rpm(), 1e0, &ind);
+			buffer_append_float32(send_buffer, val.rpm, 1e0, &ind);
 		}
 		if (mask & ((uint32_t)1 << 8)) {
 			buffer_append_float16(send_buffer, GET_INPUT_VOLTAGE(), 1e1, &ind);
@@ -327,16 +480,16 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, mc_interface_get_watt_hours_charged(false), 1e4, &ind);
 		}
 		if (mask & ((uint32_t)1 << 13)) {
-			buffer_append_int32(send_buffer, mc_interface_get_tachometer_value(false), &ind);
+			buffer_append_int32(send_buffer, val.tachometer, &ind);
 		}
 		if (mask & ((uint32_t)1 << 14)) {
-			buffer_append_int32(send_buffer, mc_interface_get_tachometer_abs_value(false), &ind);
+			buffer_append_int32(send_buffer, val.tachometer_abs, &ind);
 		}
 		if (mask & ((uint32_t)1 << 15)) {
 			send_buffer[ind++] = mc_interface_get_fault();
 		}
 		if (mask & ((uint32_t)1 << 16)) {
-			buffer_append_float32(send_buffer, mc_interface_get_pid_pos_now(), 1e6, &ind);
+			buffer_append_float32(send_buffer, val.pid_pos_now, 1e6, &ind);
 		}
 		if (mask & ((uint32_t)1 << 17)) {
 			send_buffer[ind++] = app_get_configuration()->controller_id;
@@ -353,8 +506,7 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, mc_interface_read_reset_avg_vq(), 1e3, &ind);
 		}
 
-		reply_func(send_buffer, ind);
-		chMtxUnlock(&send_buffer_mutex);
+		reply_end(reply_func, tx, send_buffer, ind);
 	} break;
 
 	case COMM_SET_DUTY: {
@@ -494,7 +646,18 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		mode = data[ind++];
 		sample_len = buffer_get_uint16(data, &ind);
 		decimation = data[ind++];
-		mc_interface_sample_print_data(mode, sample_len, decimation);
+
+		// Optional, not sent by older tools
+		bool compressed = false;
+		float threshold = 0.0;
+		if ((int32_t)len > ind) {
+			compressed = data[ind++];
+		}
+		if ((int32_t)len >= (ind + 4)) {
+			threshold = buffer_get_float32_auto(data, &ind);
+		}
+
+		mc_interface_sample_print_data(mode, sample_len, decimation, compressed, threshold);
 	} break;
 
 	case COMM_REBOOT:
@@ -659,8 +822,8 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		float battery_level = mc_interface_get_battery_level(&wh_batt_left);
 
 		int32_t ind = 0;
-		chMtxLock(&send_buffer_mutex);
-		uint8_t *send_buffer = send_buffer_global;
+		tx_buffer_t *tx;
+		uint8_t *send_buffer = reply_begin(reply_func, &tx);
 		send_buffer[ind++] = packet_id;
 
 		uint32_t mask = 0xFFFFFFFF;
@@ -731,8 +894,7 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			buffer_append_float32(send_buffer, wh_batt_left, 1e3, &ind);
 		}
 
-		reply_func(send_buffer, ind);
-		chMtxUnlock(&send_buffer_mutex);
+		reply_end(reply_func, tx, send_buffer, ind);
 	} break;
 
 	case COMM_SET_MCCONF_TEMP:
@@ -1012,6 +1174,82 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 		}
 	} break;
 
+	case COMM_GET_FOC_TIMING_HIST: {
+		if (len < 2) {
+			break;
+		}
+
+		int32_t ind = 0;
+		mc_foc_timing_hist hist = data[ind++];
+		bool reset = data[ind++];
+
+		uint32_t bins[MCPWM_FOC_TIMING_HIST_BINS];
+		float max;
+		mcpwm_foc_get_timing_hist(hist, bins, &max);
+
+		if (reset) {
+			mcpwm_foc_reset_timing_hist();
+		}
+
+		ind = 0;
+		uint8_t send_buffer[20 + 4 * MCPWM_FOC_TIMING_HIST_BINS];
+		send_buffer[ind++] = packet_id;
+		send_buffer[ind++] = hist;
+		buffer_append_float32_auto(send_buffer, MCPWM_FOC_TIMING_HIST_BIN_WIDTH, &ind);
+		buffer_append_float32_auto(send_buffer, max, &ind);
+		send_buffer[ind++] = MCPWM_FOC_TIMING_HIST_BINS;
+		for (int i = 0;i < MCPWM_FOC_TIMING_HIST_BINS;i++) {
+			buffer_append_uint32(send_buffer, bins[i], &ind);
+		}
+		reply_func(send_buffer, ind);
+	} break;
+
+	case COMM_SET_VALUES_STREAM: {
+		if (len < 7) {
+			break;
+		}
+
+		int32_t ind = 0;
+		uint32_t mask = buffer_get_uint32(data, &ind) & ((1 << STREAM_FIELDS) - 1);
+		int rate = buffer_get_uint16(data, &ind);
+		int samples = data[ind++];
+
+		utils_truncate_number_int(&rate, 0, STREAM_RATE_MAX);
+		utils_truncate_number_int(&samples, 1, STREAM_SAMPLES_MAX);
+
+		// The stream is sent from another thread later on, which only works
+		// with transports that always send to the same place. The reply
+		// function of e.g. CAN sends to whichever node sent the last buffer.
+		if (!tx_buffer_find(reply_func)) {
+			mask = 0;
+		}
+
+		// The samples are taken on system ticks, so round the rate to
+		// a whole number of ticks.
+		int period = 0;
+		if (rate > 0 && mask != 0) {
+			period = CH_CFG_ST_FREQUENCY / rate;
+			rate = CH_CFG_ST_FREQUENCY / period;
+		} else {
+			mask = 0;
+			rate = 0;
+		}
+
+		send_func_stream = reply_func;
+		stream_mask = mask;
+		stream_samples = samples;
+		stream_period = period;
+		chEvtSignal(stream_tp, (eventmask_t) 1);
+
+		ind = 0;
+		uint8_t send_buffer[10];
+		send_buffer[ind++] = packet_id;
+		buffer_append_uint32(send_buffer, mask, &ind);
+		buffer_append_uint16(send_buffer, rate, &ind);
+		send_buffer[ind++] = samples;
+		reply_func(send_buffer, ind);
+	} break;
+
 	// Blocking commands. Only one of them runs at any given time, in their
 	// own thread. If other blocking commands come before the previous one has
 	// finished, they are discarded.
@@ -1133,19 +1371,29 @@ void commands_send_gpd_buffer_notify(void) {
 }
 
 void commands_send_mcconf(COMM_PACKET_ID packet_id, mc_configuration *mcconf) {
-	chMtxLock(&send_buffer_mutex);
-	send_buffer_global[0] = packet_id;
-	int32_t len = confgenerator_serialize_mcconf(send_buffer_global + 1, mcconf);
-	commands_send_packet(send_buffer_global, len + 1);
-	chMtxUnlock(&send_buffer_mutex);
+	void(*func)(unsigned char *data, unsigned int len) = send_func;
+	if (!func) {
+		return;
+	}
+
+	tx_buffer_t *tx;
+	uint8_t *send_buffer = reply_begin(func, &tx);
+	send_buffer[0] = packet_id;
+	int32_t len = confgenerator_serialize_mcconf(send_buffer + 1, mcconf);
+	reply_end(func, tx, send_buffer, len + 1);
 }
 
 void commands_send_appconf(COMM_PACKET_ID packet_id, app_configuration *appconf) {
-	chMtxLock(&send_buffer_mutex);
-	send_buffer_global[0] = packet_id;
-	int32_t len = confgenerator_serialize_appconf(send_buffer_global + 1, appconf);
-	commands_send_packet(send_buffer_global, len + 1);
-	chMtxUnlock(&send_buffer_mutex);
+	void(*func)(unsigned char *data, unsigned int len) = send_func;
+	if (!func) {
+		return;
+	}
+
+	tx_buffer_t *tx;
+	uint8_t *send_buffer = reply_begin(func, &tx);
+	send_buffer[0] = packet_id;
+	int32_t len = confgenerator_serialize_appconf(send_buffer + 1, appconf);
+	reply_end(func, tx, send_buffer, len + 1);
 }
 
 void commands_apply_mcconf_hw_limits(mc_configuration *mcconf) {
@@ -1352,6 +1600,7 @@ static THD_FUNCTION(blocking_thread, arg) {
 				mcconf.foc_f_sw = 10000.0;
 				mcconf.foc_current_kp = 0.01;
 				mcconf.foc_current_ki = 10.0;
+				mcconf.foc_cc_bandwidth = 0.0;
 				mc_interface_set_configuration(&mcconf);
 
 				float offset = 0.0;
@@ -1394,6 +1643,7 @@ static THD_FUNCTION(blocking_thread, arg) {
 				mcconf.foc_f_sw = 10000.0;
 				mcconf.foc_current_kp = 0.01;
 				mcconf.foc_current_ki = 10.0;
+				mcconf.foc_cc_bandwidth = 0.0;
 				mc_interface_set_configuration(&mcconf);
 
 				uint8_t hall_tab[8];
@@ -1600,3 +1850,237 @@ static THD_FUNCTION(blocking_thread, arg) {
 		is_blocking = false;
 	}
 }
+
+/*
+ * Values stream, set up with COMM_SET_VALUES_STREAM. The host selects a field
+ * mask, a sample rate and how many samples to batch in each packet, and the
+ * samples are then pushed in COMM_VALUES_STREAM packets until the rate is set
+ * to 0. Fields, as integers with the given scaling:
+ *
+ * 0  rpm           * 1
+ * 1  duty          * 1e4
+ * 2  motor current * 1e2
+ * 3  input current * 1e2
+ * 4  id            * 1e2
+ * 5  iq            * 1e2
+ * 6  vd            * 1e3
+ * 7  vq            * 1e3
+ * 8  input voltage * 1e2
+ * 9  pid position  * 1e6
+ * 10 tachometer
+ * 11 tachometer abs
+ *
+ * Packet layout: [id][mask uint32][index of first sample uint32]
+ * [rate uint16][sample count uint8], followed by the first sample with one
+ * int32 for each field in the mask, and then by the remaining samples with
+ * the difference from the previous sample of each field as a var_int32.
+ * Differences wrap around like uint32. The sample index counts the samples
+ * since the stream was set up. If sending falls behind the sample rate the
+ * interval to the next sample is stretched instead of catching up in a burst.
+ * Only transports that register a send buffer can stream, others get a mask
+ * of 0 back.
+ */
+static void stream_sample(int32_t *val) {
+	mc_motor_values mv;
+	mc_interface_get_values(&mv);
+
+	val[0] = (int32_t)mv.rpm;
+	val[1] = (int32_t)(mv.duty_now * 1e4);
+	val[2] = (int32_t)(mv.current * 1e2);
+	val[3] = (int32_t)(mv.current_in * 1e2);
+	val[4] = (int32_t)(mv.id * 1e2);
+	val[5] = (int32_t)(mv.iq * 1e2);
+	val[6] = (int32_t)(mv.vd * 1e3);
+	val[7] = (int32_t)(mv.vq * 1e3);
+	val[8] = (int32_t)(GET_INPUT_VOLTAGE() * 1e2);
+	val[9] = (int32_t)(mv.pid_pos_now * 1e6);
+	val[10] = mv.tachometer;
+	val[11] = mv.tachometer_abs;
+}
+
+static THD_FUNCTION(stream_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("comm_stream");
+
+	stream_tp = chThdGetSelfX();
+
+	static uint8_t buffer[PACKET_MAX_PL_LEN];
+	int32_t last[STREAM_FIELDS];
+	int32_t ind = 0;
+	int32_t count_ind = 0;
+	int samples = 0;
+	uint32_t sample_index = 0;
+	systime_t time = chVTGetSystemTimeX();
+
+	for(;;) {
+		const uint32_t mask = stream_mask;
+		const int period = stream_period;
+
+		if (chEvtGetAndClearEvents((eventmask_t) 1) || period == 0) {
+			// Drop the batch in progress when the stream is changed
+			samples = 0;
+			sample_index = 0;
+			if (period == 0) {
+				chEvtWaitAny((eventmask_t) 1);
+				time = chVTGetSystemTimeX();
+				continue;
+			}
+		}
+
+		int32_t val[STREAM_FIELDS];
+		stream_sample(val);
+
+		if (samples == 0) {
+			ind = 0;
+			buffer[ind++] = COMM_VALUES_STREAM;
+			buffer_append_uint32(buffer, mask, &ind);
+			buffer_append_uint32(buffer, sample_index, &ind);
+			buffer_append_uint16(buffer, CH_CFG_ST_FREQUENCY / period, &ind);
+			count_ind = ind++;
+
+			for (int i = 0;i < STREAM_FIELDS;i++) {
+				if (mask & (1 << i)) {
+					buffer_append_int32(buffer, val[i], &ind);
+				}
+			}
+		} else {
+			for (int i = 0;i < STREAM_FIELDS;i++) {
+				if (mask & (1 << i)) {
+					buffer_append_var_int32(buffer, (int32_t)((uint32_t)val[i] - (uint32_t)last[i]), &ind);
+				}
+			}
+		}
+
+		memcpy(last, val, sizeof(last));
+		samples++;
+		sample_index++;
+
+		// Send when the batch is complete or the next sample might not fit
+		if (samples >= stream_samples || (ind + STREAM_FIELDS * 5) > PACKET_MAX_PL_LEN) {
+			buffer[count_ind] = samples;
+			if (send_func_stream) {
+				send_func_stream(buffer, ind);
+			}
+			samples = 0;
+		}
+
+		// Skip ahead instead of catching up if sending took too long
+		systime_t prev = time;
+		time += period;
+		if (!chVTIsSystemTimeWithinX(prev, time)) {
+			time = chVTGetSystemTimeX() + period;
+			prev = time - period;
+		}
+		chThdSleepUntilWindowed(prev, time);
+	}
+}
+
+static THD_FUNCTION(upload_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Upload");
+
+	for(;;) {
+		msg_t slot;
+		chMBFetch(&upload_queued_mb, &slot, TIME_INFINITE);
+		upload_chunk_t *chunk = &upload_chunks[slot];
+
+		upload_write(chunk->offset, chunk->data, chunk->len);
+
+		void(*func)(unsigned char *data, unsigned int len) = chunk->reply_func;
+		chMBPost(&upload_free_mb, slot, TIME_INFINITE);
+
+		SHUTDOWN_RESET();
+		upload_send_ack(func);
+	}
+}
+
+/**
+ * Find the send buffer a transport has registered for func.
+ *
+ * @return
+ * The registered buffer, or 0 if the transport of func has not registered one.
+ */
+static tx_buffer_t *tx_buffer_find(void(*func)(unsigned char *data, unsigned int len)) {
+	for (int i = 0;i < tx_buffer_cnt;i++) {
+		if (tx_buffers[i].send_func == func) {
+			return &tx_buffers[i];
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Get a buffer to build a reply to func in. This is the packet buffer of the
+ * transport when it has registered one, and the shared send buffer otherwise.
+ * The buffer is locked until reply_end is called.
+ */
+static uint8_t *reply_begin(void(*func)(unsigned char *data, unsigned int len), tx_buffer_t **tx) {
+	*tx = tx_buffer_find(func);
+	if (*tx) {
+		return (*tx)->begin_func();
+	}
+
+	chMtxLock(&send_buffer_mutex);
+	return send_buffer_global;
+}
+
+static void reply_end(void(*func)(unsigned char *data, unsigned int len),
+		tx_buffer_t *tx, uint8_t *buffer, unsigned int len) {
+	if (tx) {
+		tx->end_func(len);
+	} else {
+		func(buffer, len);
+		chMtxUnlock(&send_buffer_mutex);
+	}
+}
+
+static int upload_free_slots(void) {
+	chSysLock();
+	int res = chMBGetUsedCountI(&upload_free_mb);
+	chSysUnlock();
+	return res;
+}
+
+/**
+ * Write a windowed upload chunk and advance the written offset, or stop the
+ * upload if writing fails.
+ */
+static void upload_write(uint32_t offset, uint8_t *data, unsigned int len) {
+	if (nrf_driver_ext_nrf_running()) {
+		nrf_driver_pause(2000);
+	}
+
+	uint16_t flash_res = flash_helper_write_new_app_data(offset, data, len);
+
+	if (flash_res == FLASH_COMPLETE && flash_helper_new_app_state() == NEW_APP_CRC_ERROR) {
+		flash_res = FLASH_ERROR_PROGRAM;
+	}
+
+	if (flash_res == FLASH_COMPLETE) {
+		upload_offset_written = offset + len;
+	} else {
+		upload_ok = false;
+	}
+}
+
+/**
+ * Acknowledge windowed upload chunks with the offset up to which the new app
+ * has been written, and how many more chunks can be queued.
+ */
+static void upload_send_ack(void(*func)(unsigned char *data, unsigned int len)) {
+	int32_t ind = 0;
+	uint8_t send_buffer[10];
+	send_buffer[ind++] = COMM_WRITE_NEW_APP_DATA_WINDOW;
+	send_buffer[ind++] = upload_ok ? 1 : 0;
+	buffer_append_uint32(send_buffer, upload_offset_written, &ind);
+	// Chunks from transports without a registered send buffer are written
+	// one at a time, see COMM_WRITE_NEW_APP_DATA_WINDOW.
+	send_buffer[ind++] = tx_buffer_find(func) ? upload_free_slots() : 1;
+
+	if (func) {
+		func(send_buffer, ind);
+	}
+}
@@ -27,6 +27,8 @@ void commands_init(void);
 void commands_send_packet(unsigned char *data, unsigned int len);
 void commands_send_packet_nrf(unsigned char *data, unsigned int len);
 void commands_send_packet_last_blocking(unsigned char *data, unsigned int len);
+void commands_register_tx_buffer(void(*send_func)(unsigned char *data, unsigned int len),
+		unsigned char*(*begin_func)(void), void(*end_func)(unsigned int len));
 void commands_process_packet(unsigned char *data, unsigned int len,
 		void(*reply_func)(unsigned char *data, unsigned int len));
 void commands_printf(const char* format, ...);
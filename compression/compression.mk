@@ -1,3 +1,7 @@
 COMPRESSIONSRC = 	compression/minilzo.c
 
 COMPRESSIONINC = 	compression
+
+# Use a 4096 entry dictionary for compression instead of the default 16384,
+# so that the work memory fits next to the sample buffer.
+COMPRESSIONDEFS = 	-DD_BITS=12
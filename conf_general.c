@@ -752,6 +752,7 @@ bool conf_general_measure_flux_linkage_openloop(float current, float duty,
 	mcconf.foc_sensor_mode = FOC_SENSOR_MODE_SENSORLESS;
 	mcconf.foc_current_kp = 0.0005;
 	mcconf.foc_current_ki = 1.0;
+	mcconf.foc_cc_bandwidth = 0.0;
 	mc_interface_set_configuration(&mcconf);
 
 	// Wait maximum 5s for fault code to disappear
@@ -897,6 +898,7 @@ int conf_general_autodetect_apply_sensors_foc(float current,
 	mcconf.foc_sensor_mode = FOC_SENSOR_MODE_SENSORLESS;
 	mcconf.foc_current_kp = 0.0005;
 	mcconf.foc_current_ki = 1.0;
+	mcconf.foc_cc_bandwidth = 0.0;
 	mc_interface_set_configuration(&mcconf);
 
 	// Wait maximum 5s for fault code to disappear
@@ -1041,6 +1043,7 @@ int conf_general_detect_apply_all_foc(float max_power_loss,
 	mcconf.foc_f_sw = 10000.0; // Lower f_sw => less dead-time distortion
 	mcconf.foc_current_kp = 0.0005;
 	mcconf.foc_current_ki = 1.0;
+	mcconf.foc_cc_bandwidth = 0.0;
 	mcconf.l_current_max = MCCONF_L_CURRENT_MAX;
 	mcconf.l_current_min = MCCONF_L_CURRENT_MIN;
 	mcconf.l_current_max_scale = MCCONF_L_CURRENT_MAX_SCALE;
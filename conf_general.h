@@ -272,6 +272,24 @@
 #define FOC_CONTROL_LOOP_FREQ_DIVIDER	1
 #endif
 
+/*
+ *	Use interpolated lookup tables in CCM RAM for utils_fast_sincos_better and
+ *	utils_fast_atan2 instead of the polynomial approximations. The tables take
+ *	5 KB of CCM RAM and are more accurate. See tests/utils_trig for a comparison.
+ */
+#ifndef UTILS_TRIG_LUT
+#define UTILS_TRIG_LUT					0
+#endif
+
+/*
+ *	Build one variant of the FOC control loop per sensor mode and pick the right
+ *	one when the configuration changes. This removes the branches for the other
+ *	sensor modes from the ADC interrupt at the cost of more flash.
+ */
+#ifndef MCPWM_FOC_SPECIALISED_ISR
+#define MCPWM_FOC_SPECIALISED_ISR		0
+#endif
+
 // Global configuration variables
 extern bool conf_general_permanent_nrf_found;
 
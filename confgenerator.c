@@ -59,6 +59,7 @@ int32_t confgenerator_serialize_mcconf(uint8_t *buffer, const mc_configuration *
 	buffer_append_float32_auto(buffer, conf->foc_current_ki, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_f_sw, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_dt_us, &ind);
+	buffer_append_float32_auto(buffer, conf->foc_dt_comp_factor, &ind);
 	buffer[ind++] = conf->foc_encoder_inverted;
 	buffer_append_float32_auto(buffer, conf->foc_encoder_offset, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_encoder_ratio, &ind);
@@ -73,6 +74,7 @@ int32_t confgenerator_serialize_mcconf(uint8_t *buffer, const mc_configuration *
 	buffer_append_float32_auto(buffer, conf->foc_motor_l, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_motor_r, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_motor_flux_linkage, &ind);
+	buffer_append_float32_auto(buffer, conf->foc_motor_ld_lq_diff, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_observer_gain, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_observer_gain_slow, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_duty_dowmramp_kp, &ind);
@@ -98,6 +100,7 @@ int32_t confgenerator_serialize_mcconf(uint8_t *buffer, const mc_configuration *
 	buffer_append_float32_auto(buffer, conf->foc_temp_comp_base_temp, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_current_filter_const, &ind);
 	buffer[ind++] = conf->foc_cc_decoupling;
+	buffer_append_float32_auto(buffer, conf->foc_cc_bandwidth, &ind);
 	buffer[ind++] = conf->foc_observer_type;
 	buffer_append_float32_auto(buffer, conf->foc_hfi_voltage_start, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_hfi_voltage_run, &ind);
@@ -106,6 +109,10 @@ int32_t confgenerator_serialize_mcconf(uint8_t *buffer, const mc_configuration *
 	buffer_append_uint16(buffer, conf->foc_hfi_start_samples, &ind);
 	buffer_append_float32_auto(buffer, conf->foc_hfi_obs_ovr_sec, &ind);
 	buffer[ind++] = conf->foc_hfi_samples;
+	buffer_append_float32_auto(buffer, conf->foc_fw_current_max, &ind);
+	buffer_append_float32_auto(buffer, conf->foc_fw_duty_start, &ind);
+	buffer_append_float32_auto(buffer, conf->foc_fw_ramp_time, &ind);
+	buffer[ind++] = conf->foc_mtpa_enable;
 	buffer_append_int16(buffer, conf->gpd_buffer_notify_left, &ind);
 	buffer_append_int16(buffer, conf->gpd_buffer_interpol, &ind);
 	buffer_append_float32_auto(buffer, conf->gpd_current_filter_const, &ind);
@@ -161,6 +168,11 @@ int32_t confgenerator_serialize_appconf(uint8_t *buffer, const app_configuration
 	buffer_append_float32_auto(buffer, conf->timeout_brake_current, &ind);
 	buffer[ind++] = conf->send_can_status;
 	buffer_append_uint16(buffer, conf->send_can_status_rate_hz, &ind);
+	buffer_append_uint16(buffer, conf->send_can_status_2_rate_hz, &ind);
+	buffer_append_uint16(buffer, conf->send_can_status_3_rate_hz, &ind);
+	buffer_append_uint16(buffer, conf->send_can_status_4_rate_hz, &ind);
+	buffer_append_uint16(buffer, conf->send_can_status_5_rate_hz, &ind);
+	buffer[ind++] = conf->send_can_status_on_change;
 	buffer[ind++] = conf->can_baud_rate;
 	buffer[ind++] = conf->pairing_done;
 	buffer[ind++] = conf->permanent_uart_enabled;
@@ -344,6 +356,7 @@ bool confgenerator_deserialize_mcconf(const uint8_t *buffer, mc_configuration *c
 	conf->foc_current_ki = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_f_sw = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_dt_us = buffer_get_float32_auto(buffer, &ind);
+	conf->foc_dt_comp_factor = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_encoder_inverted = buffer[ind++];
 	conf->foc_encoder_offset = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_encoder_ratio = buffer_get_float32_auto(buffer, &ind);
@@ -358,6 +371,7 @@ bool confgenerator_deserialize_mcconf(const uint8_t *buffer, mc_configuration *c
 	conf->foc_motor_l = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_motor_r = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_motor_flux_linkage = buffer_get_float32_auto(buffer, &ind);
+	conf->foc_motor_ld_lq_diff = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_observer_gain = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_observer_gain_slow = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_duty_dowmramp_kp = buffer_get_float32_auto(buffer, &ind);
@@ -383,6 +397,7 @@ bool confgenerator_deserialize_mcconf(const uint8_t *buffer, mc_configuration *c
 	conf->foc_temp_comp_base_temp = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_current_filter_const = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_cc_decoupling = buffer[ind++];
+	conf->foc_cc_bandwidth = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_observer_type = buffer[ind++];
 	conf->foc_hfi_voltage_start = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_hfi_voltage_run = buffer_get_float32_auto(buffer, &ind);
@@ -391,6 +406,10 @@ bool confgenerator_deserialize_mcconf(const uint8_t *buffer, mc_configuration *c
 	conf->foc_hfi_start_samples = buffer_get_uint16(buffer, &ind);
 	conf->foc_hfi_obs_ovr_sec = buffer_get_float32_auto(buffer, &ind);
 	conf->foc_hfi_samples = buffer[ind++];
+	conf->foc_fw_current_max = buffer_get_float32_auto(buffer, &ind);
+	conf->foc_fw_duty_start = buffer_get_float32_auto(buffer, &ind);
+	conf->foc_fw_ramp_time = buffer_get_float32_auto(buffer, &ind);
+	conf->foc_mtpa_enable = buffer[ind++];
 	conf->gpd_buffer_notify_left = buffer_get_int16(buffer, &ind);
 	conf->gpd_buffer_interpol = buffer_get_int16(buffer, &ind);
 	conf->gpd_current_filter_const = buffer_get_float32_auto(buffer, &ind);
@@ -449,6 +468,11 @@ bool confgenerator_deserialize_appconf(const uint8_t *buffer, app_configuration
 	conf->timeout_brake_current = buffer_get_float32_auto(buffer, &ind);
 	conf->send_can_status = buffer[ind++];
 	conf->send_can_status_rate_hz = buffer_get_uint16(buffer, &ind);
+	conf->send_can_status_2_rate_hz = buffer_get_uint16(buffer, &ind);
+	conf->send_can_status_3_rate_hz = buffer_get_uint16(buffer, &ind);
+	conf->send_can_status_4_rate_hz = buffer_get_uint16(buffer, &ind);
+	conf->send_can_status_5_rate_hz = buffer_get_uint16(buffer, &ind);
+	conf->send_can_status_on_change = buffer[ind++];
 	conf->can_baud_rate = buffer[ind++];
 	conf->pairing_done = buffer[ind++];
 	conf->permanent_uart_enabled = buffer[ind++];
@@ -625,6 +649,7 @@ void confgenerator_set_defaults_mcconf(mc_configuration *conf) {
 	conf->foc_current_ki = MCCONF_FOC_CURRENT_KI;
 	conf->foc_f_sw = MCCONF_FOC_F_SW;
 	conf->foc_dt_us = MCCONF_FOC_DT_US;
+	conf->foc_dt_comp_factor = MCCONF_FOC_DT_COMP_FACTOR;
 	conf->foc_encoder_inverted = MCCONF_FOC_ENCODER_INVERTED;
 	conf->foc_encoder_offset = MCCONF_FOC_ENCODER_OFFSET;
 	conf->foc_encoder_ratio = MCCONF_FOC_ENCODER_RATIO;
@@ -639,6 +664,7 @@ void confgenerator_set_defaults_mcconf(mc_configuration *conf) {
 	conf->foc_motor_l = MCCONF_FOC_MOTOR_L;
 	conf->foc_motor_r = MCCONF_FOC_MOTOR_R;
 	conf->foc_motor_flux_linkage = MCCONF_FOC_MOTOR_FLUX_LINKAGE;
+	conf->foc_motor_ld_lq_diff = MCCONF_FOC_MOTOR_LD_LQ_DIFF;
 	conf->foc_observer_gain = MCCONF_FOC_OBSERVER_GAIN;
 	conf->foc_observer_gain_slow = MCCONF_FOC_OBSERVER_GAIN_SLOW;
 	conf->foc_duty_dowmramp_kp = MCCONF_FOC_DUTY_DOWNRAMP_KP;
@@ -664,6 +690,7 @@ void confgenerator_set_defaults_mcconf(mc_configuration *conf) {
 	conf->foc_temp_comp_base_temp = MCCONF_FOC_TEMP_COMP_BASE_TEMP;
 	conf->foc_current_filter_const = MCCONF_FOC_CURRENT_FILTER_CONST;
 	conf->foc_cc_decoupling = MCCONF_FOC_CC_DECOUPLING;
+	conf->foc_cc_bandwidth = MCCONF_FOC_CC_BANDWIDTH;
 	conf->foc_observer_type = MCCONF_FOC_OBSERVER_TYPE;
 	conf->foc_hfi_voltage_start = MCCONF_FOC_HFI_VOLTAGE_START;
 	conf->foc_hfi_voltage_run = MCCONF_FOC_HFI_VOLTAGE_RUN;
@@ -672,6 +699,10 @@ void confgenerator_set_defaults_mcconf(mc_configuration *conf) {
 	conf->foc_hfi_start_samples = MCCONF_FOC_HFI_START_SAMPLES;
 	conf->foc_hfi_obs_ovr_sec = MCCONF_FOC_HFI_OBS_OVR_SEC;
 	conf->foc_hfi_samples = MCCONF_FOC_HFI_SAMPLES;
+	conf->foc_fw_current_max = MCCONF_FOC_FW_CURRENT_MAX;
+	conf->foc_fw_duty_start = MCCONF_FOC_FW_DUTY_START;
+	conf->foc_fw_ramp_time = MCCONF_FOC_FW_RAMP_TIME;
+	conf->foc_mtpa_enable = MCCONF_FOC_MTPA_ENABLE;
 	conf->gpd_buffer_notify_left = MCCONF_GPD_BUFFER_NOTIFY_LEFT;
 	conf->gpd_buffer_interpol = MCCONF_GPD_BUFFER_INTERPOL;
 	conf->gpd_current_filter_const = MCCONF_GPD_CURRENT_FILTER_CONST;
@@ -721,6 +752,11 @@ void confgenerator_set_defaults_appconf(app_configuration *conf) {
 	conf->timeout_brake_current = APPCONF_TIMEOUT_BRAKE_CURRENT;
 	conf->send_can_status = APPCONF_SEND_CAN_STATUS;
 	conf->send_can_status_rate_hz = APPCONF_SEND_CAN_STATUS_RATE_HZ;
+	conf->send_can_status_2_rate_hz = APPCONF_SEND_CAN_STATUS_2_RATE_HZ;
+	conf->send_can_status_3_rate_hz = APPCONF_SEND_CAN_STATUS_3_RATE_HZ;
+	conf->send_can_status_4_rate_hz = APPCONF_SEND_CAN_STATUS_4_RATE_HZ;
+	conf->send_can_status_5_rate_hz = APPCONF_SEND_CAN_STATUS_5_RATE_HZ;
+	conf->send_can_status_on_change = APPCONF_SEND_CAN_STATUS_ON_CHANGE;
 	conf->can_baud_rate = APPCONF_CAN_BAUD_RATE;
 	conf->pairing_done = APPCONF_PAIRING_DONE;
 	conf->permanent_uart_enabled = APPCONF_PERMANENT_UART_ENABLED;
@@ -8,8 +8,8 @@
 #include <stdbool.h>
 
 // Constants
-#define MCCONF_SIGNATURE		3632471335
-#define APPCONF_SIGNATURE		1232755601
+#define MCCONF_SIGNATURE		1180946273
+#define APPCONF_SIGNATURE		2245182509
 
 // Functions
 int32_t confgenerator_serialize_mcconf(uint8_t *buffer, const mc_configuration *conf);
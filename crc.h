@@ -22,10 +22,21 @@
 
 #include <stdint.h>
 
+/*
+ * Types
+ */
+typedef struct {
+	unsigned short crc;
+	uint32_t len;
+} crc16_ctx_t;
+
 /*
  * Functions
  */
 unsigned short crc16(unsigned char *buf, unsigned int len);
+void crc16_init(crc16_ctx_t *ctx);
+void crc16_update(crc16_ctx_t *ctx, unsigned char *buf, unsigned int len);
+unsigned short crc16_final(crc16_ctx_t *ctx);
 uint32_t crc32(uint32_t *buf, uint32_t len);
 void crc32_reset(void);
 
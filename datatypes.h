@@ -93,14 +93,25 @@ typedef enum {
 	FOC_CC_DECOUPLING_DISABLED = 0,
 	FOC_CC_DECOUPLING_CROSS,
 	FOC_CC_DECOUPLING_BEMF,
-	FOC_CC_DECOUPLING_CROSS_BEMF
+	FOC_CC_DECOUPLING_CROSS_BEMF,
+	FOC_CC_DECOUPLING_FEED_FORWARD
 } mc_foc_cc_decoupling_mode;
 
 typedef enum {
 	FOC_OBSERVER_ORTEGA_ORIGINAL = 0,
-	FOC_OBSERVER_ORTEGA_ITERATIVE
+	FOC_OBSERVER_ORTEGA_ITERATIVE,
+	FOC_OBSERVER_ORTEGA_ADAPTIVE
 } mc_foc_observer_type;
 
+// Timing histograms of the FOC control loop
+typedef enum {
+	FOC_TIMING_HIST_ISR_DURATION = 0,
+	FOC_TIMING_HIST_SAMPLE_TO_PWM,
+	FOC_TIMING_HIST_TIMER_THD_JITTER,
+	FOC_TIMING_HIST_HFI_THD_JITTER,
+	FOC_TIMING_HIST_NUM
+} mc_foc_timing_hist;
+
 typedef enum {
 	FAULT_CODE_NONE = 0,
 	FAULT_CODE_OVER_VOLTAGE,
@@ -186,7 +197,9 @@ typedef enum {
 	DEBUG_SAMPLING_TRIGGER_FAULT,
 	DEBUG_SAMPLING_TRIGGER_START_NOSEND,
 	DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND,
-	DEBUG_SAMPLING_SEND_LAST_SAMPLES
+	DEBUG_SAMPLING_SEND_LAST_SAMPLES,
+	DEBUG_SAMPLING_TRIGGER_CURRENT,
+	DEBUG_SAMPLING_TRIGGER_CURRENT_NOSEND
 } debug_sampling_mode;
 
 typedef enum {
@@ -268,6 +281,7 @@ typedef struct {
 	float foc_current_ki;
 	float foc_f_sw;
 	float foc_dt_us;
+	float foc_dt_comp_factor;
 	float foc_encoder_offset;
 	bool foc_encoder_inverted;
 	float foc_encoder_ratio;
@@ -279,6 +293,7 @@ typedef struct {
 	float foc_motor_l;
 	float foc_motor_r;
 	float foc_motor_flux_linkage;
+	float foc_motor_ld_lq_diff;
 	float foc_observer_gain;
 	float foc_observer_gain_slow;
 	float foc_pll_kp;
@@ -300,6 +315,7 @@ typedef struct {
 	float foc_temp_comp_base_temp;
 	float foc_current_filter_const;
 	mc_foc_cc_decoupling_mode foc_cc_decoupling;
+	float foc_cc_bandwidth;
 	mc_foc_observer_type foc_observer_type;
 	float foc_hfi_voltage_start;
 	float foc_hfi_voltage_run;
@@ -308,6 +324,10 @@ typedef struct {
 	uint16_t foc_hfi_start_samples;
 	float foc_hfi_obs_ovr_sec;
 	foc_hfi_samples foc_hfi_samples;
+	float foc_fw_current_max;
+	float foc_fw_duty_start;
+	float foc_fw_ramp_time;
+	bool foc_mtpa_enable;
 	// GPDrive
 	int gpd_buffer_notify_left;
 	int gpd_buffer_interpol;
@@ -636,6 +656,11 @@ typedef struct {
 	float timeout_brake_current;
 	CAN_STATUS_MODE send_can_status;
 	uint32_t send_can_status_rate_hz;
+	uint32_t send_can_status_2_rate_hz;
+	uint32_t send_can_status_3_rate_hz;
+	uint32_t send_can_status_4_rate_hz;
+	uint32_t send_can_status_5_rate_hz;
+	bool send_can_status_on_change;
 	CAN_BAUD can_baud_rate;
 	bool pairing_done;
 	bool permanent_uart_enabled;
@@ -761,7 +786,12 @@ typedef enum {
 	COMM_SET_BATTERY_CUT,
 	COMM_SET_BLE_NAME,
 	COMM_SET_BLE_PIN,
-	COMM_SET_CAN_MODE
+	COMM_SET_CAN_MODE,
+	COMM_GET_FOC_TIMING_HIST,
+	COMM_SET_VALUES_STREAM,
+	COMM_VALUES_STREAM,
+	COMM_SAMPLE_PRINT_LZO,
+	COMM_WRITE_NEW_APP_DATA_WINDOW
 } COMM_PACKET_ID;
 
 // CAN commands
@@ -795,6 +825,13 @@ typedef enum {
 	CAN_PACKET_CONF_STORE_FOC_ERPMS,
 	CAN_PACKET_STATUS_5,
 	CAN_PACKET_POLL_TS5700N8501_STATUS,
+	CAN_PACKET_FW_CHUNK_BEGIN,
+	CAN_PACKET_FW_DATA,
+	CAN_PACKET_FW_CHUNK_END,
+	CAN_PACKET_FW_ACK,
+	CAN_PACKET_TP_FIRST, // Segmented transfers carry the sender id in bits 16 to 23 of the EID
+	CAN_PACKET_TP_DATA,
+	CAN_PACKET_TP_FLOW,
 	// Gouach custom commands
 	CAN_PACKET_MOTOR_LOCK       = 0x40,
 	CAN_PACKET_DICTIONARY_READ  = 0x41,
@@ -884,6 +921,14 @@ typedef struct {
 	int32_t tacho_value;
 } can_status_msg_5;
 
+typedef struct {
+	int id;
+	bool legacy; // No broadcast support, the firmware is sent to this node separately
+	bool failed;
+	uint32_t bytes_written;
+	uint32_t frames_resent;
+} can_fw_node;
+
 typedef struct {
 	uint8_t js_x;
 	uint8_t js_y;
@@ -967,4 +1012,22 @@ typedef struct {
 	uint8_t num_vescs;
 } setup_values;
 
+// Coherent set of motor values, published once per control cycle
+typedef struct {
+	float rpm;
+	float duty_now;
+	float current;
+	float current_filtered;
+	float current_directional_filtered;
+	float current_in;
+	float current_in_filtered;
+	float id;
+	float iq;
+	float vd;
+	float vq;
+	float pid_pos_now;
+	int tachometer;
+	int tachometer_abs;
+} mc_motor_values;
+
 #endif /* DATATYPES_H_ */
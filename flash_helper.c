@@ -37,6 +37,7 @@
 #define NEW_APP_BASE							8
 #define NEW_APP_SECTORS							3
 #define APP_MAX_SIZE							(393216 - 8) // Note that the bootloader needs 8 extra bytes
+#define NEW_APP_HEADER_LEN						6 // Image size (uint32) and crc16 (uint16) in front of the image
 
 // Base address of the Flash sectors
 #define ADDR_FLASH_SECTOR_0    					((uint32_t)0x08000000) // Base @ of Sector 0, 16 Kbytes
@@ -101,6 +102,16 @@ static const uint16_t flash_sector[FLASH_SECTORS] = {
 		FLASH_Sector_11
 };
 
+// Private variables
+static crc16_ctx_t new_app_crc;
+static uint32_t new_app_written = 0;
+static uint32_t new_app_last_offset = 0;
+static bool new_app_in_order = false;
+
+// Private functions
+static void new_app_crc_update(uint32_t offset, uint8_t *data, uint32_t len);
+static uint32_t new_app_size(void);
+
 uint16_t flash_helper_erase_new_app(uint32_t new_app_size) {
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
@@ -131,6 +142,11 @@ uint16_t flash_helper_erase_new_app(uint32_t new_app_size) {
 	timeout_configure_IWDT();
 	utils_sys_unlock_cnt();
 
+	crc16_init(&new_app_crc);
+	new_app_written = 0;
+	new_app_last_offset = 0;
+	new_app_in_order = true;
+
 	return FLASH_COMPLETE;
 }
 
@@ -176,6 +192,8 @@ uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_
 	}
 	FLASH_Lock();
 
+	new_app_crc_update(offset, data, len);
+
 	timeout_configure_IWDT();
 
 	utils_sys_unlock_cnt();
@@ -183,6 +201,31 @@ uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_
 	return FLASH_COMPLETE;
 }
 
+/**
+ * Check the new app image against the crc16 in its header. The CRC is
+ * updated as the data is written, so this is known as soon as the last
+ * chunk is written, without reading back the image.
+ *
+ * @return
+ * NEW_APP_INCOMPLETE until the whole image is written, then NEW_APP_CRC_OK
+ * or NEW_APP_CRC_ERROR. NEW_APP_UNKNOWN if the data was not written in
+ * order after erasing.
+ */
+new_app_state flash_helper_new_app_state(void) {
+	if (!new_app_in_order) {
+		return NEW_APP_UNKNOWN;
+	}
+
+	if (new_app_written < NEW_APP_HEADER_LEN || new_app_crc.len < new_app_size()) {
+		return NEW_APP_INCOMPLETE;
+	}
+
+	uint8_t *header = (uint8_t*)flash_addr[NEW_APP_BASE];
+	uint16_t crc = (uint16_t)header[4] << 8 | (uint16_t)header[5];
+
+	return crc16_final(&new_app_crc) == crc ? NEW_APP_CRC_OK : NEW_APP_CRC_ERROR;
+}
+
 /**
  * Stop the system and jump to the bootloader.
  */
@@ -339,3 +382,47 @@ uint32_t flash_helper_verify_flash_memory_chunk(void) {
 
 	return res;
 }
+
+static void new_app_crc_update(uint32_t offset, uint8_t *data, uint32_t len) {
+	if (!new_app_in_order) {
+		return;
+	}
+
+	// A retransmission of the last chunk does not change the image
+	if (offset == new_app_last_offset && (offset + len) == new_app_written) {
+		return;
+	}
+
+	if (offset != new_app_written) {
+		new_app_in_order = false;
+		return;
+	}
+
+	new_app_last_offset = offset;
+	new_app_written += len;
+
+	// Skip the header
+	if (offset < NEW_APP_HEADER_LEN) {
+		uint32_t skip = NEW_APP_HEADER_LEN - offset;
+		if (skip >= len) {
+			return;
+		}
+
+		data += skip;
+		len -= skip;
+	}
+
+	// Padding after the image is not part of the CRC
+	uint32_t size = new_app_size();
+	if (new_app_crc.len + len > size) {
+		len = size > new_app_crc.len ? size - new_app_crc.len : 0;
+	}
+
+	crc16_update(&new_app_crc, data, len);
+}
+
+static uint32_t new_app_size(void) {
+	uint8_t *header = (uint8_t*)flash_addr[NEW_APP_BASE];
+	return (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 |
+			(uint32_t)header[2] << 8 | (uint32_t)header[3];
+}
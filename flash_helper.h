@@ -22,10 +22,19 @@
 
 #include "conf_general.h"
 
+// Types
+typedef enum {
+	NEW_APP_INCOMPLETE = 0,
+	NEW_APP_CRC_OK,
+	NEW_APP_CRC_ERROR,
+	NEW_APP_UNKNOWN
+} new_app_state;
+
 // Functions
 uint16_t flash_helper_erase_new_app(uint32_t new_app_size);
 uint16_t flash_helper_erase_bootloader(void);
 uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_t len);
+new_app_state flash_helper_new_app_state(void);
 void flash_helper_jump_to_bootloader(void);
 uint8_t* flash_helper_get_sector_address(uint32_t fsector);
 uint32_t flash_helper_verify_flash_memory(void);
@@ -207,6 +207,9 @@ int main(void) {
 	LED_GREEN_OFF();
 
 	timer_init();
+#if UTILS_TRIG_LUT
+	utils_trig_lut_init();
+#endif
 	conf_general_init();
 
 	if( flash_helper_verify_flash_memory() == FAULT_CODE_FLASH_CORRUPTION )	{
@@ -39,9 +39,12 @@
 #include "shutdown.h"
 #include "app.h"
 #include "utils.h"
+#include "packet.h"
+#include "minilzo.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Macros
 #define DIR_MULT		(m_conf.m_invert_direction ? -1.0 : 1.0)
@@ -82,16 +85,27 @@ static volatile float m_motor_current_unbalance_error_rate;
 
 // Sampling variables
 #define ADC_SAMPLE_MAX_LEN		2000
-__attribute__((section(".ram4"))) static volatile int16_t m_curr0_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_curr1_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_ph1_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_ph2_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_ph3_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_vzero_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile uint8_t m_status_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_curr_fir_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int16_t m_f_sw_samples[ADC_SAMPLE_MAX_LEN];
-__attribute__((section(".ram4"))) static volatile int8_t m_phase_samples[ADC_SAMPLE_MAX_LEN];
+#define ADC_SAMPLE_FIELDS		10
+#define ADC_SAMPLE_CHUNK_MAX	150 // Most samples compressed into one COMM_SAMPLE_PRINT_LZO packet
+#define ADC_SAMPLE_LZO_HDR		24 // Room for the header before the compressed data in COMM_SAMPLE_PRINT_LZO
+#define ADC_SAMPLE_LZO_WRKMEM	((1 << D_BITS) * sizeof(lzo_bytep)) // LZO dictionary, D_BITS is set in compression.mk
+
+typedef struct {
+	int16_t curr0;
+	int16_t curr1;
+	int16_t ph1;
+	int16_t ph2;
+	int16_t ph3;
+	int16_t vzero;
+	int16_t curr_fir;
+	int16_t f_sw;
+	uint8_t status;
+	uint8_t phase;
+} adc_sample_t;
+
+__attribute__((section(".ram4"))) static volatile adc_sample_t m_samples[ADC_SAMPLE_MAX_LEN];
+__attribute__((section(".ram4"))) static lzo_align_t m_sample_lzo_wrkmem[
+		(ADC_SAMPLE_LZO_WRKMEM + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
 
 static volatile int m_sample_len;
 static volatile int m_sample_int;
@@ -99,6 +113,8 @@ static volatile debug_sampling_mode m_sample_mode;
 static volatile debug_sampling_mode m_sample_mode_last;
 static volatile int m_sample_now;
 static volatile int m_sample_trigger;
+static volatile bool m_sample_compressed;
+static volatile float m_sample_threshold;
 static volatile float m_last_adc_duration_sample;
 
 #if !WS2811_ENABLE
@@ -107,6 +123,9 @@ static app_configuration m_tmp_appconf;
 
 // Private functions
 static void update_override_limits(volatile mc_configuration *conf);
+static int sample_index(int ind);
+static void send_samples(int offset, int len);
+static void send_samples_compressed(int offset, int len);
 
 // Function pointers
 static void(*pwn_done_func)(void) = 0;
@@ -153,6 +172,8 @@ void mc_interface_init(mc_configuration *configuration) {
 	m_sample_int = 1;
 	m_sample_now = 0;
 	m_sample_trigger = 0;
+	m_sample_compressed = false;
+	m_sample_threshold = 0.0;
 	m_sample_mode = DEBUG_SAMPLING_OFF;
 	m_sample_mode_last = DEBUG_SAMPLING_OFF;
 
@@ -1196,11 +1217,35 @@ float mc_interface_get_last_sample_adc_isr_duration(void) {
 	return m_last_adc_duration_sample;
 }
 
-void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation) {
+/**
+ * Start sampling ADC values, or send the last samples.
+ *
+ * @param mode
+ * The sampling mode. The trigger modes sample continuously into a ring buffer
+ * and keep len samples from before the trigger and the rest of the buffer
+ * from after it.
+ *
+ * @param len
+ * Number of samples, or number of samples before the trigger.
+ *
+ * @param decimation
+ * Take every decimation:th sample.
+ *
+ * @param compressed
+ * Send the samples in COMM_SAMPLE_PRINT_LZO packets instead of one
+ * COMM_SAMPLE_PRINT packet per sample.
+ *
+ * @param threshold
+ * Motor current magnitude for DEBUG_SAMPLING_TRIGGER_CURRENT.
+ */
+void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation,
+		bool compressed, float threshold) {
 	if (len > ADC_SAMPLE_MAX_LEN) {
 		len = ADC_SAMPLE_MAX_LEN;
 	}
 
+	m_sample_compressed = compressed;
+
 	if (mode == DEBUG_SAMPLING_SEND_LAST_SAMPLES) {
 		chEvtSignal(sample_send_tp, (eventmask_t) 1);
 	} else {
@@ -1208,6 +1253,7 @@ void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint
 		m_sample_now = 0;
 		m_sample_len = len;
 		m_sample_int = decimation;
+		m_sample_threshold = threshold;
 		m_sample_mode = mode;
 	}
 }
@@ -1363,6 +1409,49 @@ setup_values mc_interface_get_setup_values(void) {
 	return val;
 }
 
+/**
+ * Get a coherent set of motor values. With FOC all values come from the same
+ * control cycle, so this should be preferred over calling the individual
+ * getters when several of them are needed together.
+ *
+ * @param val
+ * The values are stored here. The same direction conventions as for the
+ * individual getters apply.
+ */
+void mc_interface_get_values(mc_motor_values *val) {
+	memset(val, 0, sizeof(mc_motor_values));
+
+	switch (m_conf.motor_type) {
+	case MOTOR_TYPE_BLDC:
+	case MOTOR_TYPE_DC:
+		val->rpm = mcpwm_get_rpm();
+		val->duty_now = mcpwm_get_duty_cycle_now();
+		val->current = mcpwm_get_tot_current();
+		val->current_filtered = mcpwm_get_tot_current_filtered();
+		val->current_directional_filtered = mcpwm_get_tot_current_directional_filtered();
+		val->current_in = mcpwm_get_tot_current_in();
+		val->current_in_filtered = mcpwm_get_tot_current_in_filtered();
+		val->pid_pos_now = encoder_read_deg();
+		val->tachometer = mcpwm_get_tachometer_value(false);
+		val->tachometer_abs = mcpwm_get_tachometer_abs_value(false);
+		break;
+
+	case MOTOR_TYPE_FOC:
+		mcpwm_foc_get_values(val);
+		break;
+
+	default:
+		break;
+	}
+
+	val->rpm *= DIR_MULT;
+	val->duty_now *= DIR_MULT;
+	val->current_directional_filtered *= DIR_MULT;
+	val->pid_pos_now *= DIR_MULT;
+	utils_norm_angle(&val->pid_pos_now);
+	val->tachometer *= DIR_MULT;
+}
+
 float mc_interface_get_power(void) {
 	return mc_interface_get_tot_current_in_filtered() * GET_INPUT_VOLTAGE();
 }
@@ -1675,7 +1764,9 @@ void mc_interface_mc_timer_isr(void) {
 	} break;
 
 	case DEBUG_SAMPLING_TRIGGER_FAULT:
-	case DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND: {
+	case DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND:
+	case DEBUG_SAMPLING_TRIGGER_CURRENT:
+	case DEBUG_SAMPLING_TRIGGER_CURRENT_NOSEND: {
 		sample = true;
 
 		int sample_last = -1;
@@ -1690,7 +1781,8 @@ void mc_interface_mc_timer_isr(void) {
 			m_sample_mode_last = m_sample_mode;
 			sample = false;
 
-			if (m_sample_mode == DEBUG_SAMPLING_TRIGGER_FAULT) {
+			if (m_sample_mode == DEBUG_SAMPLING_TRIGGER_FAULT ||
+					m_sample_mode == DEBUG_SAMPLING_TRIGGER_CURRENT) {
 				chSysLockFromISR();
 				chEvtSignalI(sample_send_tp, (eventmask_t) 1);
 				chSysUnlockFromISR();
@@ -1699,7 +1791,15 @@ void mc_interface_mc_timer_isr(void) {
 			m_sample_mode = DEBUG_SAMPLING_OFF;
 		}
 
-		if (m_fault_now != FAULT_CODE_NONE && m_sample_trigger < 0) {
+		bool trigger = false;
+		if (m_sample_mode == DEBUG_SAMPLING_TRIGGER_CURRENT ||
+				m_sample_mode == DEBUG_SAMPLING_TRIGGER_CURRENT_NOSEND) {
+			trigger = fabsf(mc_interface_get_tot_current()) > m_sample_threshold;
+		} else {
+			trigger = m_fault_now != FAULT_CODE_NONE;
+		}
+
+		if (trigger && m_sample_trigger < 0) {
 			m_sample_trigger = m_sample_now;
 		}
 	} break;
@@ -1719,38 +1819,40 @@ void mc_interface_mc_timer_isr(void) {
 				m_sample_now = 0;
 			}
 
+			volatile adc_sample_t *s = &m_samples[m_sample_now];
+
 			int16_t zero;
 			if (m_conf.motor_type == MOTOR_TYPE_FOC) {
 				zero = (ADC_V_L1 + ADC_V_L2 + ADC_V_L3) / 3;
-				m_phase_samples[m_sample_now] = (uint8_t)(mcpwm_foc_get_phase() / 360.0 * 250.0);
-//				m_phase_samples[m_sample_now] = (uint8_t)(mcpwm_foc_get_phase_observer() / 360.0 * 250.0);
+				s->phase = (uint8_t)(mcpwm_foc_get_phase() / 360.0 * 250.0);
+//				s->phase = (uint8_t)(mcpwm_foc_get_phase_observer() / 360.0 * 250.0);
 //				float ang = utils_angle_difference(mcpwm_foc_get_phase_observer(), mcpwm_foc_get_phase_encoder()) + 180.0;
-//				m_phase_samples[m_sample_now] = (uint8_t)(ang / 360.0 * 250.0);
+//				s->phase = (uint8_t)(ang / 360.0 * 250.0);
 			} else {
 				zero = mcpwm_vzero;
-				m_phase_samples[m_sample_now] = 0;
+				s->phase = 0;
 			}
 
 			if (mc_interface_get_state() == MC_STATE_DETECTING) {
-				m_curr0_samples[m_sample_now] = (int16_t)mcpwm_detect_currents[mcpwm_get_comm_step() - 1];
-				m_curr1_samples[m_sample_now] = (int16_t)mcpwm_detect_currents_diff[mcpwm_get_comm_step() - 1];
+				s->curr0 = (int16_t)mcpwm_detect_currents[mcpwm_get_comm_step() - 1];
+				s->curr1 = (int16_t)mcpwm_detect_currents_diff[mcpwm_get_comm_step() - 1];
 
-				m_ph1_samples[m_sample_now] = (int16_t)mcpwm_detect_voltages[0];
-				m_ph2_samples[m_sample_now] = (int16_t)mcpwm_detect_voltages[1];
-				m_ph3_samples[m_sample_now] = (int16_t)mcpwm_detect_voltages[2];
+				s->ph1 = (int16_t)mcpwm_detect_voltages[0];
+				s->ph2 = (int16_t)mcpwm_detect_voltages[1];
+				s->ph3 = (int16_t)mcpwm_detect_voltages[2];
 			} else {
-				m_curr0_samples[m_sample_now] = ADC_curr_norm_value[0];
-				m_curr1_samples[m_sample_now] = ADC_curr_norm_value[1];
+				s->curr0 = ADC_curr_norm_value[0];
+				s->curr1 = ADC_curr_norm_value[1];
 
-				m_ph1_samples[m_sample_now] = ADC_V_L1 - zero;
-				m_ph2_samples[m_sample_now] = ADC_V_L2 - zero;
-				m_ph3_samples[m_sample_now] = ADC_V_L3 - zero;
+				s->ph1 = ADC_V_L1 - zero;
+				s->ph2 = ADC_V_L2 - zero;
+				s->ph3 = ADC_V_L3 - zero;
 			}
 
-			m_vzero_samples[m_sample_now] = zero;
-			m_curr_fir_samples[m_sample_now] = (int16_t)(mc_interface_get_tot_current() * (8.0 / FAC_CURRENT));
-			m_f_sw_samples[m_sample_now] = (int16_t)(f_samp / 10.0);
-			m_status_samples[m_sample_now] = mcpwm_get_comm_step() | (mcpwm_read_hall_phase() << 3);
+			s->vzero = zero;
+			s->curr_fir = (int16_t)(mc_interface_get_tot_current() * (8.0 / FAC_CURRENT));
+			s->f_sw = (int16_t)(f_samp / 10.0);
+			s->status = mcpwm_get_comm_step() | (mcpwm_read_hall_phase() << 3);
 
 			m_sample_now++;
 
@@ -2114,6 +2216,8 @@ static THD_FUNCTION(sample_send_thread, arg) {
 		case DEBUG_SAMPLING_TRIGGER_FAULT:
 		case DEBUG_SAMPLING_TRIGGER_START_NOSEND:
 		case DEBUG_SAMPLING_TRIGGER_FAULT_NOSEND:
+		case DEBUG_SAMPLING_TRIGGER_CURRENT:
+		case DEBUG_SAMPLING_TRIGGER_CURRENT_NOSEND:
 			len = ADC_SAMPLE_MAX_LEN;
 			offset = m_sample_trigger - m_sample_len;
 			break;
@@ -2122,32 +2226,130 @@ static THD_FUNCTION(sample_send_thread, arg) {
 			break;
 		}
 
-		for (int i = 0;i < len;i++) {
-			uint8_t buffer[40];
-			int32_t index = 0;
-			int ind_samp = i + offset;
+		if (m_sample_compressed) {
+			send_samples_compressed(offset, len);
+		} else {
+			send_samples(offset, len);
+		}
+	}
+}
 
-			while (ind_samp >= ADC_SAMPLE_MAX_LEN) {
-				ind_samp -= ADC_SAMPLE_MAX_LEN;
-			}
+static int sample_index(int ind) {
+	while (ind >= ADC_SAMPLE_MAX_LEN) {
+		ind -= ADC_SAMPLE_MAX_LEN;
+	}
+
+	while (ind < 0) {
+		ind += ADC_SAMPLE_MAX_LEN;
+	}
+
+	return ind;
+}
+
+static void send_samples(int offset, int len) {
+	for (int i = 0;i < len;i++) {
+		uint8_t buffer[40];
+		int32_t index = 0;
+		volatile adc_sample_t *s = &m_samples[sample_index(i + offset)];
+
+		buffer[index++] = COMM_SAMPLE_PRINT;
+		buffer_append_float32_auto(buffer, (float)s->curr0 * FAC_CURRENT, &index);
+		buffer_append_float32_auto(buffer, (float)s->curr1 * FAC_CURRENT, &index);
+		buffer_append_float32_auto(buffer, ((float)s->ph1 / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)s->ph2 / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)s->ph3 / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, ((float)s->vzero / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
+		buffer_append_float32_auto(buffer, (float)s->curr_fir / (8.0 / FAC_CURRENT), &index);
+		buffer_append_float32_auto(buffer, (float)s->f_sw * 10.0, &index);
+		buffer[index++] = s->status;
+		buffer[index++] = s->phase;
+
+		commands_send_packet(buffer, index);
+	}
+}
 
-			while (ind_samp < 0) {
-				ind_samp += ADC_SAMPLE_MAX_LEN;
+/*
+ * Send the samples in as few COMM_SAMPLE_PRINT_LZO packets as possible. Each
+ * packet carries:
+ *
+ * [id][first sample uint16][total samples uint16][samples in packet uint8]
+ * [current scale float32_auto][voltage scale float32_auto]
+ * [filtered current scale float32_auto][f_sw scale float32_auto]
+ * [decompressed length uint16][LZO data]
+ *
+ * The scales convert the raw values to the units of COMM_SAMPLE_PRINT. The
+ * decompressed data has the fields curr0, curr1, ph1, ph2, ph3, vzero,
+ * curr_fir, f_sw, status and phase one after another. Each field is stored as
+ * the int16 differences between consecutive samples, starting from 0, first
+ * the high bytes of all samples and then the low bytes. Noisy ADC samples
+ * compress poorly as they are, but their differences mostly have the same
+ * high byte.
+ */
+static void send_samples_compressed(int offset, int len) {
+	static uint8_t raw[ADC_SAMPLE_CHUNK_MAX * ADC_SAMPLE_FIELDS * 2];
+	static uint8_t buffer[ADC_SAMPLE_LZO_HDR + sizeof(raw) + sizeof(raw) / 16 + 64 + 3];
+
+	const float v_scale = (V_REG / 4096.0) * ((VIN_R1 + VIN_R2) / VIN_R2);
+
+	int first = 0;
+	int samples = ADC_SAMPLE_CHUNK_MAX;
+
+	while (first < len) {
+		if (samples > (len - first)) {
+			samples = len - first;
+		}
+
+		int32_t raw_len = 0;
+		for (int f = 0;f < ADC_SAMPLE_FIELDS;f++) {
+			int16_t prev = 0;
+			for (int i = 0;i < samples;i++) {
+				volatile adc_sample_t *s = &m_samples[sample_index(first + i + offset)];
+				int16_t val = 0;
+
+				switch (f) {
+				case 0: val = s->curr0; break;
+				case 1: val = s->curr1; break;
+				case 2: val = s->ph1; break;
+				case 3: val = s->ph2; break;
+				case 4: val = s->ph3; break;
+				case 5: val = s->vzero; break;
+				case 6: val = s->curr_fir; break;
+				case 7: val = s->f_sw; break;
+				case 8: val = s->status; break;
+				default: val = s->phase; break;
+				}
+
+				const uint16_t diff = (uint16_t)val - (uint16_t)prev;
+				prev = val;
+				raw[raw_len + i] = diff >> 8;
+				raw[raw_len + samples + i] = diff;
 			}
+			raw_len += 2 * samples;
+		}
 
-			buffer[index++] = COMM_SAMPLE_PRINT;
-			buffer_append_float32_auto(buffer, (float)m_curr0_samples[ind_samp] * FAC_CURRENT, &index);
-			buffer_append_float32_auto(buffer, (float)m_curr1_samples[ind_samp] * FAC_CURRENT, &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph1_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph2_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_ph3_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, ((float)m_vzero_samples[ind_samp] / 4096.0 * V_REG) * ((VIN_R1 + VIN_R2) / VIN_R2), &index);
-			buffer_append_float32_auto(buffer, (float)m_curr_fir_samples[ind_samp] / (8.0 / FAC_CURRENT), &index);
-			buffer_append_float32_auto(buffer, (float)m_f_sw_samples[ind_samp] * 10.0, &index);
-			buffer[index++] = m_status_samples[ind_samp];
-			buffer[index++] = m_phase_samples[ind_samp];
-
-			commands_send_packet(buffer, index);
+		int32_t index = 0;
+		buffer[index++] = COMM_SAMPLE_PRINT_LZO;
+		buffer_append_uint16(buffer, first, &index);
+		buffer_append_uint16(buffer, len, &index);
+		buffer[index++] = samples;
+		buffer_append_float32_auto(buffer, FAC_CURRENT, &index);
+		buffer_append_float32_auto(buffer, v_scale, &index);
+		buffer_append_float32_auto(buffer, FAC_CURRENT / 8.0, &index);
+		buffer_append_float32_auto(buffer, 10.0, &index);
+		buffer_append_uint16(buffer, raw_len, &index);
+
+		lzo_uint lzo_len;
+		lzo1x_1_compress(raw, raw_len, buffer + index, &lzo_len, m_sample_lzo_wrkmem);
+
+		// Try again with fewer samples if the result does not fit in a packet
+		if ((int)(index + lzo_len) > PACKET_MAX_PL_LEN && samples > 1) {
+			samples = (samples * 3) / 4;
+			continue;
 		}
+
+		commands_send_packet(buffer, index + lzo_len);
+
+		first += samples;
+		samples = ADC_SAMPLE_CHUNK_MAX;
 	}
 }
@@ -74,7 +74,8 @@ float mc_interface_read_reset_avg_vq(void);
 float mc_interface_get_pid_pos_set(void);
 float mc_interface_get_pid_pos_now(void);
 float mc_interface_get_last_sample_adc_isr_duration(void);
-void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation);
+void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation,
+		bool compressed, float threshold);
 float mc_interface_temp_fet_filtered(void);
 float mc_interface_temp_motor_filtered(void);
 float mc_interface_get_battery_level(float *wh_left);
@@ -83,6 +84,7 @@ float mc_interface_get_distance(void);
 float mc_interface_get_distance_abs(void);
 float mc_interface_get_power(void);
 setup_values mc_interface_get_setup_values(void);
+void mc_interface_get_values(mc_motor_values *val);
 
 // MC implementation functions
 void mc_interface_fault_stop(mc_fault_code fault);
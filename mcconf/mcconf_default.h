@@ -230,6 +230,9 @@
 #ifndef MCCONF_FOC_DT_US
 #define MCCONF_FOC_DT_US				0.12 // Microseconds for dead time compensation
 #endif
+#ifndef MCCONF_FOC_DT_COMP_FACTOR
+#define MCCONF_FOC_DT_COMP_FACTOR		0.0 // Fraction of the hardware dead time to compensate for in the PWM output
+#endif
 #ifndef MCCONF_FOC_ENCODER_INVERTED
 #define MCCONF_FOC_ENCODER_INVERTED		false
 #endif
@@ -257,6 +260,9 @@
 #ifndef MCCONF_FOC_MOTOR_FLUX_LINKAGE
 #define MCCONF_FOC_MOTOR_FLUX_LINKAGE	0.00245
 #endif
+#ifndef MCCONF_FOC_MOTOR_LD_LQ_DIFF
+#define MCCONF_FOC_MOTOR_LD_LQ_DIFF		0.0 // Lq - Ld, for salient motors
+#endif
 #ifndef MCCONF_FOC_OBSERVER_GAIN
 #define MCCONF_FOC_OBSERVER_GAIN		9e7		// Can be something like 600 / L
 #endif
@@ -332,6 +338,9 @@
 #ifndef MCCONF_FOC_CC_DECOUPLING
 #define MCCONF_FOC_CC_DECOUPLING		FOC_CC_DECOUPLING_BEMF // Current controller decoupling
 #endif
+#ifndef MCCONF_FOC_CC_BANDWIDTH
+#define MCCONF_FOC_CC_BANDWIDTH			0.0 // Current controller bandwidth in rad/s for gains from the motor parameters. 0 = use kp and ki
+#endif
 #ifndef MCCONF_FOC_OBSERVER_TYPE
 #define MCCONF_FOC_OBSERVER_TYPE		FOC_OBSERVER_ORTEGA_ORIGINAL // Position observer type for FOC
 #endif
@@ -356,6 +365,18 @@
 #ifndef MCCONF_FOC_HFI_SAMPLES
 #define MCCONF_FOC_HFI_SAMPLES			HFI_SAMPLES_16 // Samples per motor revolution for HFI
 #endif
+#ifndef MCCONF_FOC_FW_CURRENT_MAX
+#define MCCONF_FOC_FW_CURRENT_MAX		0.0 // Maximum field weakening current. 0 = disabled
+#endif
+#ifndef MCCONF_FOC_FW_DUTY_START
+#define MCCONF_FOC_FW_DUTY_START		0.9 // Keep the voltage vector at this fraction of max duty using field weakening
+#endif
+#ifndef MCCONF_FOC_FW_RAMP_TIME
+#define MCCONF_FOC_FW_RAMP_TIME			0.2 // Shortest time to ramp from 0 to the maximum field weakening current
+#endif
+#ifndef MCCONF_FOC_MTPA_ENABLE
+#define MCCONF_FOC_MTPA_ENABLE			false // Use maximum torque per amp d axis current with salient motors
+#endif
 
 // GPD
 #ifndef MCCONF_GPD_BUFFER_NOTIFY_LEFT
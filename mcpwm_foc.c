@@ -85,6 +85,8 @@ typedef struct {
 	int table_fact;
 	float buffer[32];
 	float buffer_current[32];
+	float bins[4]; // Real and imag of bin 1 and 2 of buffer, see utils_sdft_bin12_step
+	float bins_acc[4];
 	bool ready;
 	int ind;
 	bool is_samp_n;
@@ -94,6 +96,11 @@ typedef struct {
 	float observer_zero_time;
 } hfi_state_t;
 
+typedef struct {
+	uint32_t bins[MCPWM_FOC_TIMING_HIST_BINS];
+	float max;
+} timing_hist_t;
+
 // Private variables
 static volatile mc_configuration *m_conf;
 static volatile mc_state m_state;
@@ -105,6 +112,9 @@ static volatile float m_phase_now_override;
 static volatile float m_duty_cycle_set;
 static volatile float m_id_set;
 static volatile float m_iq_set;
+static volatile float m_i_fw_set;
+static float m_mtpa_table[MCPWM_FOC_MTPA_TABLE_SIZE];
+static float m_mtpa_current_step;
 static volatile float m_openloop_speed;
 static volatile float m_openloop_phase;
 static volatile bool m_dccal_done;
@@ -124,6 +134,7 @@ static volatile mc_sample_t m_samples;
 static volatile int m_tachometer;
 static volatile int m_tachometer_abs;
 static volatile float m_last_adc_isr_duration;
+static volatile int m_observer_iterations_max;
 static volatile float m_pos_pid_now;
 static volatile bool m_init_done = false;
 static volatile float m_gamma_now;
@@ -137,14 +148,31 @@ static volatile bool m_duty_next_set;
 static volatile hfi_state_t m_hfi;
 static volatile int m_hfi_plot_en;
 static volatile float m_hfi_plot_sample;
+static volatile timing_hist_t m_timing_hist[FOC_TIMING_HIST_NUM];
+static volatile mc_motor_values m_values;
+static volatile uint32_t m_values_seq;
+
+// Inline the control loop into the specialised variants
+#if MCPWM_FOC_SPECIALISED_ISR
+#define ISR_INLINE					inline __attribute__((always_inline))
+#else
+#define ISR_INLINE
+#endif
 
 // Private functions
 static void do_dc_cal(void);
+static void timing_hist_add(mc_foc_timing_hist hist, float seconds);
+static ISR_INLINE void publish_values(void);
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase);
 static void pll_run(float phase, float dt, volatile float *phase_var,
 		volatile float *speed_var);
-static void control_current(volatile motor_state_t *state_m, float dt);
+static ISR_INLINE void adc_int_handler(mc_foc_sensor_mode sensor_mode);
+static ISR_INLINE void control_current(volatile motor_state_t *state_m, float dt,
+		mc_foc_sensor_mode sensor_mode);
+static void update_adc_int_handler(void);
+static void update_mtpa_table(void);
+static float mtpa_id(float current);
 static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
 		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector);
 static void run_pid_control_pos(float angle_now, float angle_set, float dt);
@@ -182,6 +210,13 @@ static volatile bool hfi_thd_stop;
 		TIM1->CR1 &= ~TIM_CR1_UDIS;
 #endif
 
+// Hooks for timing the stages of the control loop in the host build
+// (tests/foc_sil). They compile to nothing on the hardware.
+#ifndef FOC_PROFILE_START
+#define FOC_PROFILE_START(stage)
+#define FOC_PROFILE_END(stage)
+#endif
+
 #define TIMER_UPDATE_SAMP(samp) \
 		TIM8->CCR1 = samp;
 
@@ -248,6 +283,60 @@ static void update_hfi_samples(foc_hfi_samples samples) {
 	utils_sys_unlock_cnt();
 }
 
+/**
+ * Tabulate the maximum torque per amp d axis current over the current range
+ * from the motor parameters. Must be called every time the motor parameters
+ * or current limits change.
+ */
+static void update_mtpa_table(void) {
+	const float i_max = fabsf(utils_max_abs(m_conf->l_current_max, m_conf->l_current_min));
+	const float lambda = m_conf->foc_motor_flux_linkage;
+	const float ld_lq_diff = (3.0 / 2.0) * m_conf->foc_motor_ld_lq_diff;
+	float table[MCPWM_FOC_MTPA_TABLE_SIZE];
+
+	const float step = i_max / (float)(MCPWM_FOC_MTPA_TABLE_SIZE - 1);
+	for (int i = 0;i < MCPWM_FOC_MTPA_TABLE_SIZE;i++) {
+		// The d axis current that maximizes the reluctance plus magnet torque for
+		// a given current magnitude. Zero when the motor is not salient.
+		float id = 0.0;
+		if (ld_lq_diff > 0.0) {
+			const float i_abs = step * (float)i;
+			id = (lambda - sqrtf(SQ(lambda) + 8.0 * SQ(ld_lq_diff * i_abs))) / (4.0 * ld_lq_diff);
+		}
+		table[i] = id;
+	}
+
+	utils_sys_lock_cnt();
+	memcpy(m_mtpa_table, table, sizeof(m_mtpa_table));
+	m_mtpa_current_step = step;
+	utils_sys_unlock_cnt();
+}
+
+/**
+ * Look up the maximum torque per amp d axis current.
+ *
+ * @param current
+ * The magnitude of the current vector.
+ *
+ * @return
+ * The d axis current, which is zero or negative.
+ */
+static float mtpa_id(float current) {
+	if (m_mtpa_current_step <= 0.0) {
+		return 0.0;
+	}
+
+	const float pos = fabsf(current) / m_mtpa_current_step;
+	const int ind = (int)pos;
+
+	if (ind >= (MCPWM_FOC_MTPA_TABLE_SIZE - 1)) {
+		return m_mtpa_table[MCPWM_FOC_MTPA_TABLE_SIZE - 1];
+	}
+
+	const float frac = pos - (float)ind;
+	return m_mtpa_table[ind] + frac * (m_mtpa_table[ind + 1] - m_mtpa_table[ind]);
+}
+
 void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	utils_sys_lock_cnt();
 
@@ -258,6 +347,8 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	TIM_BDTRInitTypeDef TIM_BDTRInitStructure;
 
 	m_conf = configuration;
+	update_adc_int_handler();
+	update_mtpa_table();
 
 	// Initialize variables
 	mcpwm_foc_set_state(MC_STATE_OFF, false);
@@ -270,6 +361,7 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	m_duty_cycle_set = 0.0;
 	m_id_set = 0.0;
 	m_iq_set = 0.0;
+	m_i_fw_set = 0.0;
 	m_openloop_speed = 0.0;
 	m_openloop_phase = 0.0;
 	m_output_on = false;
@@ -287,10 +379,14 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	m_tachometer = 0;
 	m_tachometer_abs = 0;
 	m_last_adc_isr_duration = 0;
+	m_observer_iterations_max = MCPWM_FOC_OBSERVER_ITERATIONS_MAX;
+	memset((void*)m_timing_hist, 0, sizeof(m_timing_hist));
 	m_pos_pid_now = 0.0;
 	m_gamma_now = 0.0;
 	m_using_encoder = false;
 	memset((void*)&m_motor_state, 0, sizeof(motor_state_t));
+	memset((void*)&m_values, 0, sizeof(m_values));
+	m_values_seq = 0;
 	memset((void*)&m_samples, 0, sizeof(mc_sample_t));
 	m_duty1_next = 0;
 	m_duty2_next = 0;
@@ -544,6 +640,8 @@ bool mcpwm_foc_init_done(void) {
 
 void mcpwm_foc_set_configuration(volatile mc_configuration *configuration) {
 	m_conf = configuration;
+	update_adc_int_handler();
+	update_mtpa_table();
 
 	// Below we check if anything in the configuration changed that requires stopping the motor.
 
@@ -1139,6 +1237,23 @@ float mcpwm_foc_get_vq(void) {
 	return m_motor_state.vq;
 }
 
+/**
+ * Get a coherent copy of the motor values from the last control cycle. Unlike
+ * the individual getters, all values are guaranteed to come from the same
+ * cycle, even if the ADC interrupt runs while they are copied.
+ *
+ * @param val
+ * The values are copied here.
+ */
+void mcpwm_foc_get_values(mc_motor_values *val) {
+	uint32_t seq;
+
+	do {
+		seq = m_values_seq;
+		*val = m_values;
+	} while ((seq & 1) || seq != m_values_seq);
+}
+
 /**
  * Get current offsets,
  * this is used by the virtual motor to save the current offsets,
@@ -1491,6 +1606,7 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *
 	stop_pwm_hw();
 
 	m_conf->foc_sensor_mode = FOC_SENSOR_MODE_HFI;
+	update_adc_int_handler();
 	m_conf->foc_f_sw = 15000;
 	m_conf->foc_hfi_voltage_start = duty * GET_INPUT_VOLTAGE() * (2.0 / 3.0);
 	m_conf->foc_hfi_voltage_run = duty * GET_INPUT_VOLTAGE() * (2.0 / 3.0);
@@ -1550,6 +1666,7 @@ float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *
 	mcpwm_foc_set_current(0.0);
 
 	m_conf->foc_sensor_mode = sensor_mode_old;
+	update_adc_int_handler();
 	m_conf->foc_f_sw = f_sw_old;
 	m_conf->foc_hfi_voltage_start = hfi_voltage_start_old;
 	m_conf->foc_hfi_voltage_run = hfi_voltage_run_old;
@@ -1634,11 +1751,13 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	const float f_sw_old = m_conf->foc_f_sw;
 	const float kp_old = m_conf->foc_current_kp;
 	const float ki_old = m_conf->foc_current_ki;
+	const float bw_old = m_conf->foc_cc_bandwidth;
 	const float res_old = m_conf->foc_motor_r;
 
 	m_conf->foc_f_sw = 10000.0;
 	m_conf->foc_current_kp = 0.001;
 	m_conf->foc_current_ki = 1.0;
+	m_conf->foc_cc_bandwidth = 0.0;
 
 	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
 	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
@@ -1666,6 +1785,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	m_conf->foc_f_sw = f_sw_old;
 	m_conf->foc_current_kp = kp_old;
 	m_conf->foc_current_ki = ki_old;
+	m_conf->foc_cc_bandwidth = bw_old;
 	m_conf->foc_motor_r = res_old;
 
 	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
@@ -1785,6 +1905,7 @@ void mcpwm_foc_print_state(void) {
 	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
 	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
 	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
+	commands_printf("i_fw:         %.2f", (double)m_i_fw_set);
 	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
 	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
 	commands_printf("Obs_x1:       %.2f", (double)m_observer_x1);
@@ -1797,6 +1918,39 @@ float mcpwm_foc_get_last_adc_isr_duration(void) {
 	return m_last_adc_isr_duration;
 }
 
+/**
+ * Get a timing histogram of the control loop. Bin n counts the events that
+ * took between n and n + 1 times MCPWM_FOC_TIMING_HIST_BIN_WIDTH, except the
+ * last bin which counts everything above that.
+ *
+ * @param hist
+ * The histogram to get.
+ *
+ * @param bins
+ * Array with MCPWM_FOC_TIMING_HIST_BINS elements to store the bins in.
+ *
+ * @param max
+ * Pointer to store the largest value seen in seconds.
+ */
+void mcpwm_foc_get_timing_hist(mc_foc_timing_hist hist, uint32_t *bins, float *max) {
+	if (hist >= FOC_TIMING_HIST_NUM) {
+		memset(bins, 0, sizeof(uint32_t) * MCPWM_FOC_TIMING_HIST_BINS);
+		*max = 0.0;
+		return;
+	}
+
+	for (int i = 0;i < MCPWM_FOC_TIMING_HIST_BINS;i++) {
+		bins[i] = m_timing_hist[hist].bins[i];
+	}
+	*max = m_timing_hist[hist].max;
+}
+
+void mcpwm_foc_reset_timing_hist(void) {
+	utils_sys_lock_cnt();
+	memset((void*)m_timing_hist, 0, sizeof(m_timing_hist));
+	utils_sys_unlock_cnt();
+}
+
 void mcpwm_foc_tim_sample_int_handler(void) {
 	if (m_init_done) {
 		// Generate COM event here for synchronization
@@ -1806,10 +1960,55 @@ void mcpwm_foc_tim_sample_int_handler(void) {
 	}
 }
 
+#if MCPWM_FOC_SPECIALISED_ISR
+// One variant of the control loop per sensor mode, so that the compiler can
+// remove the branches for the other modes.
+static void adc_int_handler_sensorless(void) {
+	adc_int_handler(FOC_SENSOR_MODE_SENSORLESS);
+}
+
+static void adc_int_handler_encoder(void) {
+	adc_int_handler(FOC_SENSOR_MODE_ENCODER);
+}
+
+static void adc_int_handler_hall(void) {
+	adc_int_handler(FOC_SENSOR_MODE_HALL);
+}
+
+static void adc_int_handler_hfi(void) {
+	adc_int_handler(FOC_SENSOR_MODE_HFI);
+}
+
+static void(* volatile m_adc_int_handler)(void) = adc_int_handler_sensorless;
+#endif
+
 void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	(void)p;
 	(void)flags;
 
+#if MCPWM_FOC_SPECIALISED_ISR
+	m_adc_int_handler();
+#else
+	adc_int_handler(m_conf->foc_sensor_mode);
+#endif
+}
+
+/**
+ * Select the control loop variant for the sensor mode in the configuration.
+ * Must be called every time foc_sensor_mode changes.
+ */
+static void update_adc_int_handler(void) {
+#if MCPWM_FOC_SPECIALISED_ISR
+	switch (m_conf->foc_sensor_mode) {
+	case FOC_SENSOR_MODE_ENCODER: m_adc_int_handler = adc_int_handler_encoder; break;
+	case FOC_SENSOR_MODE_HALL: m_adc_int_handler = adc_int_handler_hall; break;
+	case FOC_SENSOR_MODE_HFI: m_adc_int_handler = adc_int_handler_hfi; break;
+	default: m_adc_int_handler = adc_int_handler_sensorless; break;
+	}
+#endif
+}
+
+static ISR_INLINE void adc_int_handler(mc_foc_sensor_mode sensor_mode) {
 	static int skip = 0;
 	if (++skip == FOC_CONTROL_LOOP_FREQ_DIVIDER) {
 		skip = 0;
@@ -1836,6 +2035,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	}
 #endif
 
+	FOC_PROFILE_START(ISR);
+
 	// Reset the watchdog
 	timeout_feed_WDT(THREAD_MCPWM);
 
@@ -1979,8 +2180,10 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 	if (m_state == MC_STATE_RUNNING) {
 		// Clarke transform assuming balanced currents
+		FOC_PROFILE_START(CLARKE_PARK);
 		m_motor_state.i_alpha = ia;
 		m_motor_state.i_beta = ONE_BY_SQRT3 * ia + TWO_BY_SQRT3 * ib;
+		FOC_PROFILE_END(CLARKE_PARK);
 
 		// Full Clarke transform in case there are current offsets
 //		m_motor_state.i_alpha = (2.0 / 3.0) * ia - (1.0 / 3.0) * ib - (1.0 / 3.0) * ic;
@@ -2028,7 +2231,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		if (!control_duty && was_control_duty) {
 			m_motor_state.vq_int = m_motor_state.vq;
 			if (m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_BEMF ||
-					m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF) {
+					m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF ||
+					m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_FEED_FORWARD) {
 				m_motor_state.vq_int -= m_motor_state.speed_rad_s * m_conf->foc_motor_flux_linkage;
 			}
 		}
@@ -2082,14 +2286,16 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 		// Run observer
 		if (!m_phase_override) {
+			FOC_PROFILE_START(OBSERVER);
 			observer_update(m_motor_state.v_alpha, m_motor_state.v_beta,
 					m_motor_state.i_alpha, m_motor_state.i_beta, dt,
 					&m_observer_x1, &m_observer_x2, &m_phase_now_observer);
 			m_phase_now_observer += m_pll_speed * dt * 0.5;
 			utils_norm_angle_rad((float*)&m_phase_now_observer);
+			FOC_PROFILE_END(OBSERVER);
 		}
 
-		switch (m_conf->foc_sensor_mode) {
+		switch (sensor_mode) {
 		case FOC_SENSOR_MODE_ENCODER:
 			if (encoder_index_found()) {
 				m_motor_state.phase = correct_encoder(
@@ -2191,13 +2397,31 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			utils_truncate_number(&iq_set_tmp, -m_conf->lo_current_max, -m_conf->lo_current_min);
 		}
 
-		utils_saturate_vector_2d(&id_set_tmp, &iq_set_tmp,
-				utils_max_abs(m_conf->lo_current_max, m_conf->lo_current_min));
+		const float i_max = fabsf(utils_max_abs(m_conf->lo_current_max, m_conf->lo_current_min));
+
+		// Maximum torque per amp. Split the requested current between the axes,
+		// keeping its magnitude, so that salient motors also make reluctance
+		// torque.
+		if (m_conf->foc_mtpa_enable && m_control_mode < CONTROL_MODE_HANDBRAKE &&
+				!m_phase_override) {
+			const float id_mtpa = mtpa_id(iq_set_tmp);
+			id_set_tmp += id_mtpa;
+			iq_set_tmp = SIGN(iq_set_tmp) * sqrtf(fmaxf(SQ(iq_set_tmp) - SQ(id_mtpa), 0.0));
+		}
+
+		// Field weakening current, which has priority over the q axis current
+		if (m_i_fw_set > 0.0) {
+			id_set_tmp -= m_i_fw_set;
+			utils_truncate_number_abs(&id_set_tmp, i_max);
+			utils_truncate_number_abs(&iq_set_tmp, sqrtf(SQ(i_max) - SQ(id_set_tmp)));
+		}
+
+		utils_saturate_vector_2d(&id_set_tmp, &iq_set_tmp, i_max);
 
 		m_motor_state.id_target = id_set_tmp;
 		m_motor_state.iq_target = iq_set_tmp;
 
-		control_current(&m_motor_state, dt);
+		control_current(&m_motor_state, dt, sensor_mode);
 	} else {
 		// The current is 0 when the motor is undriven
 		m_motor_state.i_alpha = 0.0;
@@ -2209,6 +2433,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.i_bus = 0.0;
 		m_motor_state.i_abs = 0.0;
 		m_motor_state.i_abs_filter = 0.0;
+		m_i_fw_set = 0.0;
 
 		// Track back emf
 #ifdef HW_HAS_3_SHUNTS
@@ -2249,7 +2474,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		x1_prev = m_observer_x1;
 		x2_prev = m_observer_x2;
 
-		switch (m_conf->foc_sensor_mode) {
+		switch (sensor_mode) {
 		case FOC_SENSOR_MODE_ENCODER:
 			m_motor_state.phase = correct_encoder(
 					m_phase_now_observer,
@@ -2278,6 +2503,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_hfi.ready = false;
 		m_hfi.is_samp_n = false;
 		m_hfi.prev_sample = 0.0;
+		memset((void*)m_hfi.bins_acc, 0, sizeof(m_hfi.bins_acc));
 		m_hfi.angle = m_motor_state.phase;
 
 		float c, s;
@@ -2300,7 +2526,8 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.vq_int = m_motor_state.vq;
 
 		if (m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_BEMF ||
-				m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF) {
+				m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_CROSS_BEMF ||
+				m_conf->foc_cc_decoupling == FOC_CC_DECOUPLING_FEED_FORWARD) {
 			m_motor_state.vq_int -= m_motor_state.speed_rad_s * m_conf->foc_motor_flux_linkage;
 		}
 
@@ -2315,8 +2542,10 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			/ SQRT3_BY_2;
 
 	// Run PLL for speed estimation
+	FOC_PROFILE_START(PLL);
 	pll_run(m_motor_state.phase, dt, &m_pll_phase, &m_pll_speed);
 	m_motor_state.speed_rad_s = m_pll_speed;
+	FOC_PROFILE_END(PLL);
 
 	// Low latency speed estimation, for e.g. HFI.
 	{
@@ -2384,9 +2613,26 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 	palSetPad(AD2S1205_SAMPLE_GPIO, AD2S1205_SAMPLE_PIN);
 #endif
 
+	publish_values();
+
 	mc_interface_mc_timer_isr();
 
 	m_last_adc_isr_duration = timer_seconds_elapsed_since(t_start);
+	timing_hist_add(FOC_TIMING_HIST_ISR_DURATION, m_last_adc_isr_duration);
+
+	// Give the adaptive observer fewer iterations when the ISR is close to
+	// overrunning, and more back when there is time left.
+	if (m_last_adc_isr_duration > (dt * MCPWM_FOC_OBSERVER_ISR_BUDGET)) {
+		if (m_observer_iterations_max > 1) {
+			m_observer_iterations_max--;
+		}
+	} else if (m_last_adc_isr_duration < (dt * MCPWM_FOC_OBSERVER_ISR_BUDGET * 0.8)) {
+		if (m_observer_iterations_max < MCPWM_FOC_OBSERVER_ITERATIONS_MAX) {
+			m_observer_iterations_max++;
+		}
+	}
+
+	FOC_PROFILE_END(ISR);
 }
 
 // Private functions
@@ -2396,6 +2642,8 @@ static THD_FUNCTION(timer_thread, arg) {
 
 	chRegSetThreadName("foc timer");
 
+	uint32_t time_last = timer_time_now();
+
 	for(;;) {
 		const float dt = 0.001;
 
@@ -2404,6 +2652,9 @@ static THD_FUNCTION(timer_thread, arg) {
 			return;
 		}
 
+		timing_hist_add(FOC_TIMING_HIST_TIMER_THD_JITTER, fabsf(timer_seconds_elapsed_since(time_last) - dt));
+		time_last = timer_time_now();
+
 		float openloop_rpm = utils_map(fabsf(m_motor_state.iq_target),
 				0.0, m_conf->l_current_max,
 				0.0, m_conf->foc_openloop_rpm);
@@ -2492,12 +2743,17 @@ static THD_FUNCTION(hfi_thread, arg) {
 
 	chRegSetThreadName("foc hfi");
 
+	uint32_t time_last = timer_time_now();
+
 	for(;;) {
 		if (hfi_thd_stop) {
 			hfi_thd_stop = false;
 			return;
 		}
 
+		timing_hist_add(FOC_TIMING_HIST_HFI_THD_JITTER, fabsf(timer_seconds_elapsed_since(time_last) - 500e-6));
+		time_last = timer_time_now();
+
 		float rpm_abs = fabsf(m_speed_est_fast * (60.0 / (2.0 * M_PI)));
 
 		if (rpm_abs > m_conf->foc_sl_erpm_hfi) {
@@ -2505,9 +2761,11 @@ static THD_FUNCTION(hfi_thread, arg) {
 		}
 
 		if (m_hfi.ready) {
-			float real_bin1, imag_bin1, real_bin2, imag_bin2;
-			m_hfi.fft_bin1_func((float*)m_hfi.buffer, &real_bin1, &imag_bin1);
-			m_hfi.fft_bin2_func((float*)m_hfi.buffer, &real_bin2, &imag_bin2);
+			// Bin 1 and 2 are kept up to date by the ISR
+			float real_bin1 = m_hfi.bins[0];
+			float imag_bin1 = m_hfi.bins[1];
+			float real_bin2 = m_hfi.bins[2];
+			float imag_bin2 = m_hfi.bins[3];
 
 			float mag_bin_1 = sqrtf(SQ(imag_bin1) + SQ(real_bin1));
 			float angle_bin_1 = -utils_fast_atan2(imag_bin1, real_bin1);
@@ -2615,6 +2873,46 @@ static THD_FUNCTION(hfi_thread, arg) {
 	}
 }
 
+static void timing_hist_add(mc_foc_timing_hist hist, float seconds) {
+	volatile timing_hist_t *h = &m_timing_hist[hist];
+
+	int bin = (int)(seconds * (1.0 / MCPWM_FOC_TIMING_HIST_BIN_WIDTH));
+	utils_truncate_number_int(&bin, 0, MCPWM_FOC_TIMING_HIST_BINS - 1);
+	h->bins[bin]++;
+
+	if (seconds > h->max) {
+		h->max = seconds;
+	}
+}
+
+/**
+ * Publish the motor values for mcpwm_foc_get_values. The sequence number is
+ * odd while the values are written, so that a reader that was interrupted
+ * in the middle of its copy sees that it changed and copies again. All
+ * accesses are volatile, so the compiler keeps them in order, and the ISR
+ * itself is never interrupted by a reader.
+ */
+static ISR_INLINE void publish_values(void) {
+	m_values_seq++;
+
+	m_values.rpm = m_motor_state.speed_rad_s / ((2.0 * M_PI) / 60.0);
+	m_values.duty_now = m_motor_state.duty_now;
+	m_values.current = SIGN(m_motor_state.vq) * m_motor_state.iq;
+	m_values.current_filtered = SIGN(m_motor_state.vq) * m_motor_state.iq_filter;
+	m_values.current_directional_filtered = m_motor_state.iq_filter;
+	m_values.current_in = m_motor_state.i_bus;
+	m_values.current_in_filtered = m_motor_state.i_bus;
+	m_values.id = m_motor_state.id;
+	m_values.iq = m_motor_state.iq;
+	m_values.vd = m_motor_state.vd;
+	m_values.vq = m_motor_state.vq;
+	m_values.pid_pos_now = m_pos_pid_now;
+	m_values.tachometer = m_tachometer;
+	m_values.tachometer_abs = m_tachometer_abs;
+
+	m_values_seq++;
+}
+
 static void do_dc_cal(void) {
 	DCCAL_ON();
 
@@ -2646,7 +2944,15 @@ static void do_dc_cal(void) {
 void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 		float dt, volatile float *x1, volatile float *x2, volatile float *phase) {
 
-	const float L = (3.0 / 2.0) * m_conf->foc_motor_l;
+	// Use Lq on salient motors with MTPA, where the d axis current is large.
+	// Then the estimated flux stays aligned with the d axis regardless of the
+	// current, its magnitude just changes with the reluctance flux, which the
+	// radial correction below tolerates.
+	float L = m_conf->foc_motor_l;
+	if (m_conf->foc_mtpa_enable) {
+		L += 0.5 * m_conf->foc_motor_ld_lq_diff;
+	}
+	L *= (3.0 / 2.0);
 	float R = (3.0 / 2.0) * m_conf->foc_motor_r;
 
 	// Saturation compensation
@@ -2675,9 +2981,18 @@ void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
 			*x2 += x2_dot * dt;
 		} break;
 
-		case FOC_OBSERVER_ORTEGA_ITERATIVE: {
+		case FOC_OBSERVER_ORTEGA_ITERATIVE:
+		case FOC_OBSERVER_ORTEGA_ADAPTIVE: {
 			// Iterative with some trial and error
-			const int iterations = 6;
+			int iterations = MCPWM_FOC_OBSERVER_ITERATIONS_MAX;
+
+			// Only iterate as much as needed to keep the angle step per iteration
+			// small, and as much as the ISR time budget allows.
+			if (m_conf->foc_observer_type == FOC_OBSERVER_ORTEGA_ADAPTIVE) {
+				iterations = (int)ceilf(fabsf(m_pll_speed) * dt / MCPWM_FOC_OBSERVER_ITERATION_ANGLE);
+				utils_truncate_number_int(&iterations, 1, m_observer_iterations_max);
+			}
+
 			const float dt_iteration = dt / (float)iterations;
 			for (int i = 0;i < iterations;i++) {
 				float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
@@ -2764,14 +3079,17 @@ static void pll_run(float phase, float dt, volatile float *phase_var,
  * @param dt
  * The time step in seconds.
  */
-static void control_current(volatile motor_state_t *state_m, float dt) {
+static ISR_INLINE void control_current(volatile motor_state_t *state_m, float dt,
+		mc_foc_sensor_mode sensor_mode) {
+	FOC_PROFILE_START(CLARKE_PARK);
 	float c,s;
 	utils_fast_sincos_better(state_m->phase, &s, &c);
+	FOC_PROFILE_END(CLARKE_PARK);
 
 	float abs_rpm = fabsf(m_speed_est_fast * 60 / (2 * M_PI));
 
 	static bool was_hfi = false;
-	bool do_hfi = m_conf->foc_sensor_mode == FOC_SENSOR_MODE_HFI &&
+	bool do_hfi = sensor_mode == FOC_SENSOR_MODE_HFI &&
 			!m_phase_override &&
 			abs_rpm < (m_conf->foc_sl_erpm_hfi * (was_hfi ? 1.8 : 1.5));
 	was_hfi = do_hfi;
@@ -2785,24 +3103,41 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	float max_duty = fabsf(state_m->max_duty);
 	utils_truncate_number(&max_duty, 0.0, m_conf->l_max_duty);
 
+	FOC_PROFILE_START(CLARKE_PARK);
 	state_m->id = c * state_m->i_alpha + s * state_m->i_beta;
 	state_m->iq = c * state_m->i_beta  - s * state_m->i_alpha;
+	FOC_PROFILE_END(CLARKE_PARK);
 	UTILS_LP_FAST(state_m->id_filter, state_m->id, m_conf->foc_current_filter_const);
 	UTILS_LP_FAST(state_m->iq_filter, state_m->iq, m_conf->foc_current_filter_const);
 
 	float Ierr_d = state_m->id_target - state_m->id;
 	float Ierr_q = state_m->iq_target - state_m->iq;
 
-	state_m->vd = state_m->vd_int + Ierr_d * m_conf->foc_current_kp;
-	state_m->vq = state_m->vq_int + Ierr_q * m_conf->foc_current_kp;
+	// Motor inductance, scaled the same way as in the observer
+	const float L = (3.0 / 2.0) * m_conf->foc_motor_l;
+	float kp = m_conf->foc_current_kp;
+	float ki = m_conf->foc_current_ki;
+
+	// Gain scheduling. Place the zero of the PI controller on the pole of the
+	// motor so that the closed loop becomes first order with the configured
+	// bandwidth. The bandwidth is limited relative to the sample rate, as the
+	// one sample delay of the PWM update eats phase margin.
+	if (m_conf->foc_cc_bandwidth > 0.0) {
+		float bw = m_conf->foc_cc_bandwidth;
+		utils_truncate_number(&bw, 0.0, MCPWM_FOC_CC_BANDWIDTH_MAX / dt);
+		kp = L * bw;
+		ki = (3.0 / 2.0) * m_conf->foc_motor_r * bw;
+	}
 
 	// Temperature compensation
 	const float t = mc_interface_temp_motor_filtered();
-	float ki = m_conf->foc_current_ki;
 	if (m_conf->foc_temp_comp && t > -5.0) {
 		ki += ki * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
 	}
 
+	state_m->vd = state_m->vd_int + Ierr_d * kp;
+	state_m->vq = state_m->vq_int + Ierr_q * kp;
+
 	state_m->vd_int += Ierr_d * (ki * dt);
 	state_m->vq_int += Ierr_q * (ki * dt);
 
@@ -2828,6 +3163,17 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 				dec_bemf = state_m->speed_rad_s * m_conf->foc_motor_flux_linkage;
 				break;
 
+			case FOC_CC_DECOUPLING_FEED_FORWARD:
+				// Speed dependent voltages of the motor model at the targets.
+				// Using the targets instead of the measured currents keeps the
+				// noise out and lets the voltage step together with the reference.
+				// The resistive drop is left to the integrator, as a resistive
+				// feed-forward term would add a zero to the scheduled loop.
+				dec_vd = state_m->iq_target * state_m->speed_rad_s * L;
+				dec_vq = state_m->id_target * state_m->speed_rad_s * L;
+				dec_bemf = state_m->speed_rad_s * m_conf->foc_motor_flux_linkage;
+				break;
+
 			default:
 				break;
 		}
@@ -2838,6 +3184,38 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 
 	float max_v_mag = (2.0 / 3.0) * max_duty * SQRT3_BY_2 * state_m->v_bus;
 
+	// Field weakening. Keep the magnitude of the requested voltage vector at
+	// foc_fw_duty_start of the available voltage by injecting negative d axis
+	// current, so that the current controller keeps some headroom at speeds
+	// where the back emf would otherwise saturate the modulation. The
+	// current is applied from the next sample. Beyond the characteristic
+	// current, flux linkage / L, more d axis current increases the voltage
+	// again, so the injected current is limited to that as well.
+	if (m_conf->foc_fw_current_max > 0.0 && m_control_mode < CONTROL_MODE_HANDBRAKE &&
+			m_control_mode != CONTROL_MODE_DUTY && !m_phase_override && max_v_mag > 0.0) {
+		float duty_start = m_conf->foc_fw_duty_start;
+		utils_truncate_number(&duty_start, 0.0, 0.99);
+		const float headroom = 1.0 - duty_start;
+		const float ramp = m_conf->foc_fw_current_max /
+				fmaxf(m_conf->foc_fw_ramp_time, dt);
+
+		float i_fw_max = m_conf->foc_fw_current_max;
+		if (L > 0.0) {
+			i_fw_max = fminf(i_fw_max, m_conf->foc_motor_flux_linkage / L);
+		}
+
+		float fw_err = sqrtf(SQ(state_m->vd) + SQ(state_m->vq)) / max_v_mag - duty_start;
+		utils_truncate_number_abs(&fw_err, headroom);
+
+		m_i_fw_set += (fw_err / headroom) * ramp * dt;
+		utils_truncate_number((float*)&m_i_fw_set, 0.0, i_fw_max);
+	} else if (m_conf->foc_fw_current_max > 0.0) {
+		utils_step_towards((float*)&m_i_fw_set, 0.0,
+				m_conf->foc_fw_current_max / fmaxf(m_conf->foc_fw_ramp_time, dt) * dt);
+	} else {
+		m_i_fw_set = 0.0;
+	}
+
 	// Saturation
 	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq, max_v_mag);
 	state_m->mod_d = state_m->vd / ((2.0 / 3.0) * state_m->v_bus);
@@ -2878,7 +3256,12 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	float mod_alpha = c * state_m->mod_d - s * state_m->mod_q;
 	float mod_beta  = c * state_m->mod_q + s * state_m->mod_d;
 
-	// Deadtime compensation
+	// Deadtime compensation. The voltage lost to the dead time is modelled
+	// with foc_dt_us and removed from the voltage estimate that the observer
+	// uses. In addition, foc_dt_comp_factor of the hardware dead time is added
+	// to the output, in the direction of the current in each phase. The output
+	// compensation fades out towards zero current to avoid glitches at zero
+	// crossings and when the current is zero.
 	const float i_alpha_filter = c * state_m->id_target - s * state_m->iq_target;
 	const float i_beta_filter = c * state_m->iq_target + s * state_m->id_target;
 	const float ia_filter = i_alpha_filter;
@@ -2890,6 +3273,20 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 	const float mod_alpha_comp = mod_alpha_filter_sgn * mod_comp_fact;
 	const float mod_beta_comp = mod_beta_filter_sgn * mod_comp_fact;
 
+	if (m_conf->foc_dt_comp_factor > 0.0) {
+		float ia_lin = ia_filter / MCPWM_FOC_DT_COMP_CURRENT_LINEAR;
+		float ib_lin = ib_filter / MCPWM_FOC_DT_COMP_CURRENT_LINEAR;
+		float ic_lin = ic_filter / MCPWM_FOC_DT_COMP_CURRENT_LINEAR;
+		utils_truncate_number_abs(&ia_lin, 1.0);
+		utils_truncate_number_abs(&ib_lin, 1.0);
+		utils_truncate_number_abs(&ic_lin, 1.0);
+
+		const float mod_out_fact = m_conf->foc_dt_comp_factor * HW_DEAD_TIME_NSEC * 1e-9 * m_conf->foc_f_sw;
+		mod_alpha += ((2.0 / 3.0) * ia_lin - (1.0 / 3.0) * ib_lin - (1.0 / 3.0) * ic_lin) * mod_out_fact;
+		mod_beta += (ONE_BY_SQRT3 * ib_lin - ONE_BY_SQRT3 * ic_lin) * mod_out_fact;
+		utils_saturate_vector_2d(&mod_alpha, &mod_beta, SQRT3_BY_2);
+	}
+
 	// Apply compensation here so that 0 duty cycle has no glitches.
 	state_m->v_alpha = (mod_alpha - mod_alpha_comp) * (2.0 / 3.0) * state_m->v_bus;
 	state_m->v_beta = (mod_beta - mod_beta_comp) * (2.0 / 3.0) * state_m->v_bus;
@@ -2920,11 +3317,15 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 
 			m_hfi.buffer_current[m_hfi.ind] = current_sample;
 
+			float sample = m_hfi.buffer[m_hfi.ind];
 			if (current_sample > 0.01) {
-				m_hfi.buffer[m_hfi.ind] = ((hfi_voltage / 2.0 - m_conf->foc_motor_r *
+				sample = ((hfi_voltage / 2.0 - m_conf->foc_motor_r *
 						current_sample) / (m_conf->foc_f_sw * current_sample));
 			}
 
+			utils_sdft_bin12_step((float*)m_hfi.buffer, m_hfi.ind, sample, m_hfi.samples,
+					m_hfi.table_fact, (float*)m_hfi.bins, (float*)m_hfi.bins_acc);
+
 			m_hfi.ind++;
 			if (m_hfi.ind == m_hfi.samples) {
 				m_hfi.ind = 0;
@@ -2962,14 +3363,21 @@ static void control_current(volatile motor_state_t *state_m, float dt) {
 		m_hfi.ready = false;
 		m_hfi.is_samp_n = false;
 		m_hfi.prev_sample = 0.0;
+		memset((void*)m_hfi.bins_acc, 0, sizeof(m_hfi.bins_acc));
 	}
 
 	// Set output (HW Dependent)
 	uint32_t duty1, duty2, duty3, top;
 	top = TIM1->ARR;
+	FOC_PROFILE_START(SVM);
 	svm(-mod_alpha, -mod_beta, top, &duty1, &duty2, &duty3, (uint32_t*)&state_m->svm_sector);
+	FOC_PROFILE_END(SVM);
 	TIMER_UPDATE_DUTY(duty1, duty2, duty3);
 
+	// Time since the current sample at the top (V0) or bottom (V7) of TIM1
+	uint32_t samp_ticks = (TIM1->CR1 & TIM_CR1_DIR) ? (top - TIM1->CNT) : TIM1->CNT;
+	timing_hist_add(FOC_TIMING_HIST_SAMPLE_TO_PWM, (float)samp_ticks / (float)SYSTEM_CORE_CLOCK);
+
 	// do not allow to turn on PWM outputs if virtual motor is used
 	if(virtual_motor_is_connected() == false) {
 		if (!m_output_on) {
@@ -71,6 +71,7 @@ float mcpwm_foc_get_phase_observer(void);
 float mcpwm_foc_get_phase_encoder(void);
 float mcpwm_foc_get_vd(void);
 float mcpwm_foc_get_vq(void);
+void mcpwm_foc_get_values(mc_motor_values *val);
 void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *ratio, bool *inverted);
 float mcpwm_foc_measure_resistance(float current, int samples);
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr, float *ld_lq_diff);
@@ -79,6 +80,8 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind);
 bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table);
 void mcpwm_foc_print_state(void);
 float mcpwm_foc_get_last_adc_isr_duration(void);
+void mcpwm_foc_get_timing_hist(mc_foc_timing_hist hist, uint32_t *bins, float *max);
+void mcpwm_foc_reset_timing_hist(void);
 void mcpwm_foc_get_current_offsets(volatile int *curr0_offset, volatile int *curr1_offset, volatile int *curr2_offset);
 void mcpwm_foc_set_current_offsets(volatile int curr0_offset, volatile int curr1_offset, volatile int curr2_offset);
 float mcpwm_foc_get_ts(void);
@@ -90,5 +93,13 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
 
 // Defines
 #define MCPWM_FOC_CURRENT_SAMP_OFFSET				(2) // Offset from timer top for injected ADC samples
+#define MCPWM_FOC_OBSERVER_ITERATIONS_MAX			(6) // Observer iterations per sample in iterative mode
+#define MCPWM_FOC_OBSERVER_ITERATION_ANGLE			(0.07) // Target electrical angle step per observer iteration (rad)
+#define MCPWM_FOC_TIMING_HIST_BINS					(32) // Number of bins in the timing histograms, the last one collects the rest
+#define MCPWM_FOC_TIMING_HIST_BIN_WIDTH				(1e-6) // Width of each timing histogram bin in seconds
+#define MCPWM_FOC_OBSERVER_ISR_BUDGET				(0.75) // Fraction of the sample time the adaptive observer lets the ISR use
+#define MCPWM_FOC_MTPA_TABLE_SIZE					(32) // Entries in the MTPA d axis current table, spread over the current range
+#define MCPWM_FOC_DT_COMP_CURRENT_LINEAR			(1.0) // Phase current below which the output dead time compensation fades out
+#define MCPWM_FOC_CC_BANDWIDTH_MAX					(0.3) // Max scheduled current controller bandwidth times the sample time
 
 #endif /* MCPWM_FOC_H_ */
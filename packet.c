@@ -24,10 +24,29 @@
 /**
  * The latest update aims at achieving optimal re-synchronization in the
  * case if lost data, at the cost of some performance.
+ *
+ * Received bytes go into a ring buffer that is written twice, once at
+ * its position and once RX_LEN further on. Any RX_LEN bytes starting inside
+ * the ring are then contiguous, so complete packets are handed to the
+ * process function in place. The process function may write outside of the
+ * payload, so a packet that is followed by bytes of further packets is
+ * copied to a separate buffer first. The header of the packet at the read position
+ * is only parsed once, after which further bytes are stored until the
+ * packet is complete. The CRC of the payload is updated as the bytes come
+ * in, so completing a packet only checks the last bytes. If a packet turns
+ * out to be invalid, decoding starts over one byte after its start byte,
+ * like before.
+ *
+ * Compared to a plain receive buffer this costs RX_LEN bytes for the second
+ * copy of the ring and BUFFER_LEN bytes for rx_packet, which is about 1 KB
+ * per handler with the default PACKET_MAX_PL_LEN.
  */
 
 // Defines
 #define BUFFER_LEN				(PACKET_MAX_PL_LEN + 8)
+#define RX_LEN					BUFFER_LEN
+#define TX_HEADER_LEN			4 // Room for the largest header in front of the payload
+#define CRC_BLOCK_LEN			16 // Received bytes per CRC update in packet_process_byte
 
 // Private types
 typedef struct {
@@ -35,9 +54,12 @@ typedef struct {
 	void(*send_func)(unsigned char *data, unsigned int len);
 	void(*process_func)(unsigned char *data, unsigned int len);
 	unsigned int rx_read_ptr;
-	unsigned int rx_write_ptr;
-	int bytes_left;
-	unsigned char rx_buffer[BUFFER_LEN];
+	unsigned int rx_count;
+	unsigned int rx_packet_len;
+	unsigned int rx_data_start;
+	crc16_ctx_t rx_crc;
+	unsigned char rx_buffer[2 * RX_LEN];
+	unsigned char rx_packet[BUFFER_LEN];
 	unsigned char tx_buffer[BUFFER_LEN];
 } PACKET_STATE_t;
 
@@ -45,8 +67,10 @@ typedef struct {
 static PACKET_STATE_t m_handler_states[PACKET_HANDLERS];
 
 // Private functions
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left);
+static void decode_packets(PACKET_STATE_t *handler);
+static void drop_bytes(PACKET_STATE_t *handler, unsigned int bytes);
+static void append_bytes(PACKET_STATE_t *handler, const unsigned char *data, unsigned int len);
+static void update_crc(PACKET_STATE_t *handler);
 
 void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 		void (*p_func)(unsigned char *data, unsigned int len), int handler_num) {
@@ -57,8 +81,24 @@ void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 
 void packet_reset(int handler_num) {
 	m_handler_states[handler_num].rx_read_ptr = 0;
-	m_handler_states[handler_num].rx_write_ptr = 0;
-	m_handler_states[handler_num].bytes_left = 0;
+	m_handler_states[handler_num].rx_count = 0;
+	m_handler_states[handler_num].rx_packet_len = 0;
+}
+
+/**
+ * Get the payload part of the transmit buffer of a handler. A reply that is
+ * written here and then sent with packet_send_packet is not copied, as the
+ * header and CRC are added around it in place. The caller must hold the
+ * same lock as for packet_send_packet until the packet is sent.
+ *
+ * @param handler_num
+ * The handler.
+ *
+ * @return
+ * Space for PACKET_MAX_PL_LEN bytes of payload.
+ */
+unsigned char *packet_get_send_buffer(int handler_num) {
+	return m_handler_states[handler_num].tx_buffer + TX_HEADER_LEN;
 }
 
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num) {
@@ -66,33 +106,39 @@ void packet_send_packet(unsigned char *data, unsigned int len, int handler_num)
 		return;
 	}
 
-	int b_ind = 0;
 	PACKET_STATE_t *handler = &m_handler_states[handler_num];
+	unsigned char *payload = handler->tx_buffer + TX_HEADER_LEN;
+
+	if (data != payload) {
+		memcpy(payload, data, len);
+	}
+
+	int b_ind = TX_HEADER_LEN;
 
 	if (len <= 255) {
-		handler->tx_buffer[b_ind++] = 2;
-		handler->tx_buffer[b_ind++] = len;
+		handler->tx_buffer[--b_ind] = len;
+		handler->tx_buffer[--b_ind] = 2;
 	} else if (len <= 65535) {
-		handler->tx_buffer[b_ind++] = 3;
-		handler->tx_buffer[b_ind++] = len >> 8;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		handler->tx_buffer[--b_ind] = len & 0xFF;
+		handler->tx_buffer[--b_ind] = len >> 8;
+		handler->tx_buffer[--b_ind] = 3;
 	} else {
-		handler->tx_buffer[b_ind++] = 4;
-		handler->tx_buffer[b_ind++] = len >> 16;
-		handler->tx_buffer[b_ind++] = (len >> 8) & 0x0F;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		handler->tx_buffer[--b_ind] = len & 0xFF;
+		handler->tx_buffer[--b_ind] = (len >> 8) & 0x0F;
+		handler->tx_buffer[--b_ind] = len >> 16;
+		handler->tx_buffer[--b_ind] = 4;
 	}
 
-	memcpy(handler->tx_buffer + b_ind, data, len);
-	b_ind += len;
+	const int start = b_ind;
+	b_ind = TX_HEADER_LEN + len;
 
-	unsigned short crc = crc16(data, len);
+	unsigned short crc = crc16(payload, len);
 	handler->tx_buffer[b_ind++] = (uint8_t)(crc >> 8);
 	handler->tx_buffer[b_ind++] = (uint8_t)(crc & 0xFF);
 	handler->tx_buffer[b_ind++] = 3;
 
 	if (handler->send_func) {
-		handler->send_func(handler->tx_buffer, b_ind);
+		handler->send_func(handler->tx_buffer + start, b_ind - start);
 	}
 }
 
@@ -115,174 +161,233 @@ void packet_process_byte(uint8_t rx_data, int handler_num) {
 
 	handler->rx_timeout = PACKET_RX_TIMEOUT;
 
-	unsigned int data_len = handler->rx_write_ptr - handler->rx_read_ptr;
-
-	// Out of space (should not happen)
-	if (data_len >= BUFFER_LEN) {
-		handler->rx_write_ptr = 0;
-		handler->rx_read_ptr = 0;
-		handler->bytes_left = 0;
-		handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
-		return;
+	// Out of space, drop the oldest byte. This only happens when the
+	// packet at the read position cannot be valid.
+	if (handler->rx_count >= RX_LEN) {
+		drop_bytes(handler, 1);
 	}
 
-	// Everything has to be aligned, so shift buffer if we are out of space.
-	// (as opposed to using a circular buffer)
-	if (handler->rx_write_ptr >= BUFFER_LEN) {
-		memmove(handler->rx_buffer,
-				handler->rx_buffer + handler->rx_read_ptr,
-				data_len);
-
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = data_len;
+	unsigned int write_ptr = handler->rx_read_ptr + handler->rx_count;
+	if (write_ptr >= RX_LEN) {
+		write_ptr -= RX_LEN;
 	}
 
-	handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
-	data_len++;
+	handler->rx_buffer[write_ptr] = rx_data;
+	handler->rx_buffer[write_ptr + RX_LEN] = rx_data;
+	handler->rx_count++;
 
-	if (handler->bytes_left > 1) {
-		handler->bytes_left--;
+	// Waiting for the rest of a packet. The CRC is updated every
+	// CRC_BLOCK_LEN bytes, as one call per byte costs more than the
+	// table lookup itself.
+	if (handler->rx_packet_len > handler->rx_count) {
+		if ((handler->rx_count % CRC_BLOCK_LEN) == 0) {
+			update_crc(handler);
+		}
 		return;
 	}
 
-	// Try decoding the packet at various offsets until it succeeds, or
-	// until we run out of data.
-	for (;;) {
-		int res = try_decode_packet(handler->rx_buffer + handler->rx_read_ptr,
-				data_len, handler->process_func, &handler->bytes_left);
+	decode_packets(handler);
+}
 
-		// More data is needed
-		if (res == -2) {
-			break;
-		}
+/**
+ * Process a chunk of received bytes, e.g. what a USB or DMA transfer returned.
+ * This gives the same result as calling packet_process_byte for every byte,
+ * but the bytes are copied into the receive buffer in blocks and bytes
+ * between packets are skipped in one go.
+ *
+ * @param data
+ * The received bytes.
+ *
+ * @param len
+ * The number of bytes.
+ *
+ * @param handler_num
+ * The handler.
+ */
+void packet_process_buffer(const unsigned char *data, unsigned int len, int handler_num) {
+	PACKET_STATE_t *handler = &m_handler_states[handler_num];
 
-		if (res > 0) {
-			data_len -= res;
-			handler->rx_read_ptr += res;
-		} else if (res == -1) {
-			// Something went wrong. Move pointer forward and try again.
-			handler->rx_read_ptr++;
-			data_len--;
+	handler->rx_timeout = PACKET_RX_TIMEOUT;
+
+	while (len > 0) {
+		unsigned int space = RX_LEN - handler->rx_count;
+		if (space == 0) {
+			drop_bytes(handler, 1);
+			space = 1;
 		}
-	}
 
-	// Nothing left, move pointers to avoid memmove
-	if (data_len == 0) {
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = 0;
+		unsigned int bytes = len < space ? len : space;
+		append_bytes(handler, data, bytes);
+		data += bytes;
+		len -= bytes;
+
+		if (handler->rx_packet_len <= handler->rx_count) {
+			decode_packets(handler);
+		} else {
+			update_crc(handler);
+		}
 	}
 }
 
 /**
- * Try if it is possible to decode a packet from a buffer.
- *
- * @param buffer
- * The buffer to try from
- *
- * @param in_len
- * The length of the buffer
- *
- * @param process_func
- * Call this function with the decoded packet on success. Set to null
- * to disable.
- *
- * @param bytes_left
- * This many additional bytes are required to tell more about the packet.
- *
- * @return
- * >0: Success, number of bytes decoded from buffer (not payload length)
- * -1: Invalid structure
- * -2: OK so far, but not enough data
+ * Decode as many packets as possible from the start of the receive buffer.
+ * Bytes that cannot start a valid packet are dropped one at a time.
  */
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left) {
-	*bytes_left = 0;
+static void decode_packets(PACKET_STATE_t *handler) {
+	for (;;) {
+		unsigned char *buffer = handler->rx_buffer + handler->rx_read_ptr;
+		const unsigned int in_len = handler->rx_count;
 
-	if (in_len == 0) {
-		*bytes_left = 1;
-		return -2;
-	}
+		if (handler->rx_packet_len == 0) {
+			if (in_len == 0) {
+				return;
+			}
 
-	bool is_len_8b = buffer[0] == 2;
-	unsigned int data_start = buffer[0];
+			bool is_len_8b = buffer[0] == 2;
+			unsigned int data_start = buffer[0];
 
 #if PACKET_MAX_PL_LEN > 255
-	bool is_len_16b = buffer[0] == 3;
+			bool is_len_16b = buffer[0] == 3;
 #else
 #define is_len_16b false
 #endif
 
 #if PACKET_MAX_PL_LEN > 65535
-	bool is_len_24b = buffer[0] == 4;
+			bool is_len_24b = buffer[0] == 4;
 #else
 #define is_len_24b false
 #endif
 
-	// No valid start byte
-	if (!is_len_8b && !is_len_16b && !is_len_24b) {
-		return -1;
-	}
-
-	// Not enough data to determine length
-	if (in_len < data_start) {
-		*bytes_left = data_start - in_len;
-		return -2;
-	}
+			// No valid start byte, skip to the next candidate
+			if (!is_len_8b && !is_len_16b && !is_len_24b) {
+				unsigned int skip = 1;
+				while (skip < in_len && (buffer[skip] < 2 || buffer[skip] > 4)) {
+					skip++;
+				}
+
+				drop_bytes(handler, skip);
+				continue;
+			}
+
+			// Not enough data to determine length
+			if (in_len < data_start) {
+				return;
+			}
+
+			unsigned int len = 0;
+			bool len_ok = true;
+
+			if (is_len_8b) {
+				len = (unsigned int)buffer[1];
+
+				// No support for zero length packets
+				len_ok = len >= 1;
+			} else if (is_len_16b) {
+				len = (unsigned int)buffer[1] << 8 | (unsigned int)buffer[2];
+
+				// A shorter packet should use less length bytes
+				len_ok = len >= 255;
+			} else if (is_len_24b) {
+				len = (unsigned int)buffer[1] << 16 |
+						(unsigned int)buffer[2] << 8 |
+						(unsigned int)buffer[3];
+
+				// A shorter packet should use less length bytes
+				len_ok = len >= 65535;
+			}
+
+			// Too long packet
+			if (!len_ok || len > PACKET_MAX_PL_LEN) {
+				drop_bytes(handler, 1);
+				continue;
+			}
+
+			handler->rx_data_start = data_start;
+			handler->rx_packet_len = len + data_start + 3;
+			crc16_init(&handler->rx_crc);
+		}
 
-	unsigned int len = 0;
+		// Need more data for the rest of the packet
+		if (in_len < handler->rx_packet_len) {
+			return;
+		}
 
-	if (is_len_8b) {
-		len = (unsigned int)buffer[1];
+		const unsigned int data_start = handler->rx_data_start;
+		const unsigned int len = handler->rx_packet_len - data_start - 3;
 
-		// No support for zero length packets
-		if (len < 1) {
-			return -1;
+		// Invalid stop byte
+		if (buffer[data_start + len + 2] != 3) {
+			drop_bytes(handler, 1);
+			continue;
 		}
-	} else if (is_len_16b) {
-		len = (unsigned int)buffer[1] << 8 | (unsigned int)buffer[2];
 
-		// A shorter packet should use less length bytes
-		if (len < 255) {
-			return -1;
+		update_crc(handler);
+		unsigned short crc_calc = crc16_final(&handler->rx_crc);
+		unsigned short crc_rx = (unsigned short)buffer[data_start + len] << 8
+								| (unsigned short)buffer[data_start + len + 1];
+
+		if (crc_calc != crc_rx) {
+			drop_bytes(handler, 1);
+			continue;
 		}
-	} else if (is_len_24b) {
-		len = (unsigned int)buffer[1] << 16 |
-				(unsigned int)buffer[2] << 8 |
-				(unsigned int)buffer[3];
-
-		// A shorter packet should use less length bytes
-		if (len < 65535) {
-			return -1;
+
+		drop_bytes(handler, handler->rx_packet_len);
+
+		if (handler->process_func) {
+			// Writes past the payload would destroy the bytes that follow
+			if (handler->rx_count > 0) {
+				memcpy(handler->rx_packet, buffer, data_start + len);
+				buffer = handler->rx_packet;
+			}
+
+			handler->process_func(buffer + data_start, len);
 		}
 	}
+}
 
-	// Too long packet
-	if (len > PACKET_MAX_PL_LEN) {
-		return -1;
+static void drop_bytes(PACKET_STATE_t *handler, unsigned int bytes) {
+	handler->rx_read_ptr += bytes;
+	if (handler->rx_read_ptr >= RX_LEN) {
+		handler->rx_read_ptr -= RX_LEN;
 	}
 
-	// Need more data to determine rest of packet
-	if (in_len < (len + data_start + 3)) {
-		*bytes_left = (len + data_start + 3) - in_len;
-		return -2;
+	handler->rx_count -= bytes;
+	handler->rx_packet_len = 0;
+}
+
+static void append_bytes(PACKET_STATE_t *handler, const unsigned char *data, unsigned int len) {
+	unsigned int write_ptr = handler->rx_read_ptr + handler->rx_count;
+	if (write_ptr >= RX_LEN) {
+		write_ptr -= RX_LEN;
 	}
 
-	// Invalid stop byte
-	if (buffer[data_start + len + 2] != 3) {
-		return -1;
+	unsigned int first = RX_LEN - write_ptr;
+	if (first > len) {
+		first = len;
 	}
 
-	unsigned short crc_calc = crc16(buffer + data_start, len);
-	unsigned short crc_rx = (unsigned short)buffer[data_start + len] << 8
-							| (unsigned short)buffer[data_start + len + 1];
+	memcpy(handler->rx_buffer + write_ptr, data, first);
+	memcpy(handler->rx_buffer + write_ptr + RX_LEN, data, first);
+	memcpy(handler->rx_buffer, data + first, len - first);
+	memcpy(handler->rx_buffer + RX_LEN, data + first, len - first);
 
-	if (crc_calc == crc_rx) {
-		if (process_func) {
-			process_func(buffer + data_start, len);
-		}
+	handler->rx_count += len;
+}
 
-		return len + data_start + 3;
-	} else {
-		return -1;
+/**
+ * Add the payload bytes of the packet at the read position that have been
+ * received since the last call to its CRC. Must only be called after the
+ * header of that packet has been parsed.
+ */
+static void update_crc(PACKET_STATE_t *handler) {
+	const unsigned int len = handler->rx_packet_len - handler->rx_data_start - 3;
+	unsigned int avail = handler->rx_count - handler->rx_data_start;
+	if (avail > len) {
+		avail = len;
+	}
+
+	if (avail > handler->rx_crc.len) {
+		crc16_update(&handler->rx_crc, handler->rx_buffer + handler->rx_read_ptr +
+				handler->rx_data_start + handler->rx_crc.len, avail - handler->rx_crc.len);
 	}
 }
@@ -41,7 +41,9 @@ void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
 		void (*p_func)(unsigned char *data, unsigned int len), int handler_num);
 void packet_reset(int handler_num);
 void packet_process_byte(uint8_t rx_data, int handler_num);
+void packet_process_buffer(const unsigned char *data, unsigned int len, int handler_num);
 void packet_timerfunc(void);
+unsigned char *packet_get_send_buffer(int handler_num);
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num);
 
 #endif /* PACKET_H_ */
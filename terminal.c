@@ -634,6 +634,29 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("No CAN devices found\n");
 		}
+	} else if (strcmp(argv[0], "can_rx_stats") == 0) {
+		uint32_t overrun;
+		int high_water, size;
+		comm_can_get_rx_stats(&overrun, &high_water, &size);
+		commands_printf("Dropped frames  : %u", (unsigned int)overrun);
+		commands_printf("Most queued     : %d of %d\n", high_water, size);
+	} else if (strcmp(argv[0], "can_fw_status") == 0) {
+		int num = comm_can_fw_node_num();
+
+		if (num == 0) {
+			commands_printf("No CAN firmware update since boot\n");
+		}
+
+		for (int i = 0;i < num;i++) {
+			can_fw_node *node = comm_can_fw_node(i);
+			commands_printf("ID: %3d  Written: %6u B  Resent frames: %5u  %s",
+					node->id, (unsigned int)node->bytes_written, (unsigned int)node->frames_resent,
+					node->failed ? "Failed" : (node->legacy ? "Legacy transfer" : "OK"));
+		}
+
+		if (num > 0) {
+			commands_printf(" ");
+		}
 	} else if (strcmp(argv[0], "foc_detect_apply_all_can") == 0) {
 		if (argc == 2) {
 			float max_power_loss = -1.0;
@@ -838,6 +861,12 @@ void terminal_process_string(char *str) {
 		commands_printf("can_scan");
 		commands_printf("  Scan CAN-bus using ping commands, and print all devices that are found.");
 
+		commands_printf("can_rx_stats");
+		commands_printf("  Print how many received CAN frames have been dropped, and the most that have been queued.");
+
+		commands_printf("can_fw_status");
+		commands_printf("  Print the progress of each node in the last firmware update to all CAN devices.");
+
 		commands_printf("foc_detect_apply_all_can [max_power_loss_W]");
 		commands_printf("  Detect and apply all motor settings, based on maximum resistive motor power losses. Also");
 		commands_printf("  initiates detection in all VESCs found on the CAN-bus.");
@@ -0,0 +1,521 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Segmented transfers and broadcast firmware updates in comm_can.c between
+ * two nodes on a simulated bus, with frames that get lost, corrupted or
+ * repeated on the way. Also checks how often the status thread wakes up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "datatypes.h"
+#include "packet.h"
+#include "crc.h"
+#include "app.h"
+
+// Settings
+#define TP_RETRIES			4 // As in comm_can.c
+#define TP_LEGACY_SENDS		100 // As in comm_can.c
+#define TP_FLOW_DONE		1 // As in comm_can.c
+#define SOAK_TRANSFERS		500
+#define SOAK_LOSS_PERCENT	5
+#define FW_CHUNK_FRAMES		40 // As in comm_can.c
+#define FW_CHUNK_MAX		(FW_CHUNK_FRAMES * 7)
+#define FW_ROUNDS_MAX		6 // As in comm_can.c
+#define FW_CHUNKS			3
+#define FW_LEN				(FW_CHUNKS * FW_CHUNK_MAX)
+#define STATUS_CHANGE_MIN_MS	10 // As in comm_can.c
+
+static uint8_t m_data[2][PACKET_MAX_PL_LEN];
+static uint8_t m_fw[FW_LEN];
+
+// Filter state
+static uint64_t m_drop_frames = 0;
+static int m_corrupt_frame = -1;
+static bool m_drop_done = false;
+static int m_flows_left = -1;
+static bool m_drop_first = false;
+static int m_loss_percent = 0;
+static uint64_t m_fw_drop_frames = 0;
+static bool m_fw_repeat = false;
+static int m_fw_acks_pass = -1; // Acks let through before the next ones are dropped
+static int m_fw_acks_drop = -1; // Acks dropped then, -1 for all
+
+static uint8_t frame_cmd(const CANRxFrame *frame) {
+	return (frame->EID >> 8) & 0xFF;
+}
+
+/*
+ * Drop or corrupt frames as set up in the filter state. Dropping and
+ * corrupting a data frame is only done the first time it is sent.
+ */
+static bool filter(int from, CANRxFrame *frame) {
+	const uint8_t cmd = frame_cmd(frame);
+
+	if (m_loss_percent > 0 && (rand() % 100) < m_loss_percent) {
+		return false;
+	}
+
+	if (cmd == CAN_PACKET_TP_DATA) {
+		const int index = frame->data8[0];
+
+		if (index < 64 && (m_drop_frames & ((uint64_t)1 << index))) {
+			m_drop_frames &= ~((uint64_t)1 << index);
+			return false;
+		}
+
+		if (index == m_corrupt_frame) {
+			frame->data8[1] ^= 0x01;
+			m_corrupt_frame = -1;
+		}
+	}
+
+	if (cmd == CAN_PACKET_FW_DATA) {
+		const int index = frame->data8[0] & 0x3F;
+
+		if (m_fw_drop_frames & ((uint64_t)1 << index)) {
+			m_fw_drop_frames &= ~((uint64_t)1 << index);
+			return false;
+		}
+	}
+
+	if (m_fw_repeat && (cmd == CAN_PACKET_FW_CHUNK_BEGIN || cmd == CAN_PACKET_FW_CHUNK_END)) {
+		sim_deliver(from, frame);
+	}
+
+	if (cmd == CAN_PACKET_FW_ACK && m_fw_acks_pass >= 0) {
+		if (m_fw_acks_pass > 0) {
+			m_fw_acks_pass--;
+		} else if (m_fw_acks_drop != 0) {
+			if (m_fw_acks_drop > 0) {
+				m_fw_acks_drop--;
+			}
+			return false;
+		}
+	}
+
+	if (cmd == CAN_PACKET_TP_FIRST && m_drop_first) {
+		return false;
+	}
+
+	if (cmd == CAN_PACKET_TP_FLOW && from == 1) {
+		if (m_drop_done && frame->data8[0] == TP_FLOW_DONE) {
+			m_drop_done = false;
+			return false;
+		}
+
+		if (m_flows_left == 0) {
+			return false;
+		} else if (m_flows_left > 0) {
+			m_flows_left--;
+		}
+	}
+
+	return true;
+}
+
+static void reset(void) {
+	m_drop_frames = 0;
+	m_corrupt_frame = -1;
+	m_drop_done = false;
+	m_flows_left = -1;
+	m_drop_first = false;
+	m_loss_percent = 0;
+	m_fw_drop_frames = 0;
+	m_fw_repeat = false;
+	m_fw_acks_pass = -1;
+	m_fw_acks_drop = -1;
+	sim_reset(filter);
+}
+
+/*
+ * Send a buffer from node 0 to node 1, and run the process thread of node 1
+ * afterwards.
+ */
+static bool send(int buf, unsigned int len) {
+	sim_select(0);
+	bool res = sim_node(0)->tp_send(sim_node_id(1), m_data[buf], len, 0);
+	sim_process(1);
+	return res;
+}
+
+static bool packet_is(int index, int buf, unsigned int len) {
+	if (index >= sim_packet_num()) {
+		return false;
+	}
+
+	const sim_packet_t *p = sim_packet(index);
+	return p->node == 1 && p->len == len && memcmp(p->data, m_data[buf], len) == 0;
+}
+
+static bool report(const char *name, bool ok) {
+	printf("%-40s %s\r\n", name, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static bool test_clean(void) {
+	reset();
+	bool ok = send(0, 300);
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 0, 300);
+	ok = ok && sim_frames(CAN_PACKET_TP_DATA) == (300 + 6) / 7;
+	return report("Transfer without errors", ok);
+}
+
+static bool test_dropped_data(void) {
+	reset();
+	m_drop_frames = ((uint64_t)1 << 3) | ((uint64_t)1 << 17) |
+			((uint64_t)1 << 18) | ((uint64_t)1 << 30) | ((uint64_t)1 << 42);
+	bool ok = send(0, 300);
+	ok = ok && m_drop_frames == 0;
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 0, 300);
+	return report("Dropped data frames", ok);
+}
+
+static bool test_lost_done(void) {
+	reset();
+	m_drop_done = true;
+	bool ok = send(0, 300);
+	ok = ok && !m_drop_done;
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 0, 300);
+	return report("Lost done frame", ok);
+}
+
+static bool test_abort(void) {
+	reset();
+
+	// The first buffer waits to be processed when the second one starts, so
+	// the second one is aborted and must be sent the old way.
+	sim_select(0);
+	bool ok = sim_node(0)->tp_send(sim_node_id(1), m_data[0], 200, 0);
+	ok = ok && !sim_node(0)->tp_send(sim_node_id(1), m_data[1], 200, 0);
+	sim_process(1);
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 0, 200);
+
+	ok = ok && send(1, 200);
+	ok = ok && sim_packet_num() == 2 && packet_is(1, 1, 200);
+	return report("Abort while the slot is busy", ok);
+}
+
+static bool test_crc(void) {
+	reset();
+	m_corrupt_frame = 5;
+	bool ok = !send(0, 300);
+	ok = ok && m_corrupt_frame < 0 && sim_packet_num() == 0;
+
+	// The next transfer works again
+	ok = ok && send(1, 300);
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 1, 300);
+	return report("CRC mismatch", ok);
+}
+
+static bool test_silent_receiver(void) {
+	reset();
+
+	// Only the answer to the first frame gets through
+	m_flows_left = 1;
+	bool ok = !send(0, 300);
+	ok = ok && sim_packet_num() == 0;
+
+	// The first block is sent once and then once for every retry
+	int data_frames = sim_frames(CAN_PACKET_TP_DATA);
+	ok = ok && data_frames == 16 * (1 + TP_RETRIES);
+	printf("  %d data frames sent\r\n", data_frames);
+	return report("Receiver stops answering", ok);
+}
+
+static bool test_legacy(void) {
+	reset();
+	m_drop_first = true;
+	bool ok = !send(0, 100);
+	ok = ok && sim_frames(CAN_PACKET_TP_FIRST) == TP_RETRIES;
+
+	// The node is not asked again for a while
+	m_drop_first = false;
+	for (int i = 0;i < TP_LEGACY_SENDS - 1;i++) {
+		ok = ok && !send(0, 100);
+	}
+	ok = ok && sim_frames(CAN_PACKET_TP_FIRST) == TP_RETRIES;
+
+	// and then once more
+	ok = ok && send(0, 100);
+	ok = ok && sim_frames(CAN_PACKET_TP_FIRST) == TP_RETRIES + 1;
+	ok = ok && sim_packet_num() == 1 && packet_is(0, 0, 100);
+	return report("Node that does not answer", ok);
+}
+
+/*
+ * Transfers with random lengths over a bus that loses some of all frames.
+ * A transfer that is reported as done must have been processed exactly once
+ * with the right content. The ones that are not fall back to the fill rx
+ * buffer frames, which are not simulated.
+ */
+static bool test_soak(void) {
+	reset();
+	m_loss_percent = SOAK_LOSS_PERCENT;
+	srand(1);
+
+	bool ok = true;
+	int done = 0;
+	int fallbacks = 0;
+	systime_t time = 0;
+
+	for (int i = 0;i < SOAK_TRANSFERS && ok;i++) {
+		unsigned int len = 7 + rand() % (PACKET_MAX_PL_LEN - 6);
+		int buf = i % 2;
+		m_data[buf][0] = i;
+		int packets = sim_packet_num();
+
+		if (send(buf, len)) {
+			ok = sim_packet_num() == packets + 1 && packet_is(packets, buf, len);
+			done++;
+		} else {
+			fallbacks++;
+		}
+
+		// Keep room for the packets
+		if (sim_packet_num() >= SIM_PACKETS_MAX - 1) {
+			time += sim_time();
+			sim_reset(filter);
+		}
+	}
+
+	time += sim_time();
+	printf("  %d done, %d fell back, %.1f s waiting for timeouts\r\n",
+			done, fallbacks, (double)time / (double)CH_CFG_ST_FREQUENCY);
+	return report("Random frame loss", ok);
+}
+
+/*
+ * Send the firmware image from node 0 to node 1 with the broadcast update.
+ */
+static const can_fw_node *fw_send(void) {
+	sim_select(0);
+	sim_node(0)->fw_add_node(sim_node_id(1));
+
+	for (int i = 0;i < FW_CHUNKS;i++) {
+		sim_node(0)->fw_send_chunk(i * FW_CHUNK_MAX, m_fw + i * FW_CHUNK_MAX, FW_CHUNK_MAX, i == 0);
+	}
+
+	return sim_node(0)->fw_node(0);
+}
+
+static bool fw_written(void) {
+	return sim_flash_writes(1) == FW_CHUNKS && memcmp(sim_flash(1), m_fw, FW_LEN) == 0;
+}
+
+static bool test_fw_clean(void) {
+	reset();
+	const can_fw_node *node = fw_send();
+	bool ok = fw_written() && node->bytes_written == FW_LEN;
+	ok = ok && !node->legacy && !node->failed && node->frames_resent == 0;
+	ok = ok && sim_frames(CAN_PACKET_FW_DATA) == FW_CHUNKS * FW_CHUNK_FRAMES;
+	return report("Firmware update without errors", ok);
+}
+
+static bool test_fw_missing_frames(void) {
+	reset();
+	m_fw_drop_frames = ((uint64_t)1 << 0) | ((uint64_t)1 << 7) | ((uint64_t)1 << 39);
+	const can_fw_node *node = fw_send();
+	bool ok = fw_written() && m_fw_drop_frames == 0;
+	ok = ok && !node->failed && node->frames_resent == 3;
+	ok = ok && sim_frames(CAN_PACKET_FW_DATA) == FW_CHUNKS * FW_CHUNK_FRAMES + 3;
+	return report("Firmware frames missing", ok);
+}
+
+static bool test_fw_repeated(void) {
+	reset();
+	m_fw_repeat = true;
+	const can_fw_node *node = fw_send();
+	bool ok = fw_written() && !node->failed && node->frames_resent == 0;
+	return report("Firmware begin and end repeated", ok);
+}
+
+static bool test_fw_lost_ack(void) {
+	reset();
+
+	// The chunk is sent again, but written only once
+	m_fw_acks_pass = 0;
+	m_fw_acks_drop = 1;
+	const can_fw_node *node = fw_send();
+	bool ok = fw_written() && !node->failed && node->frames_resent == FW_CHUNK_FRAMES;
+	return report("Firmware ack lost", ok);
+}
+
+static bool test_fw_legacy(void) {
+	reset();
+
+	// A node that never answers the first chunk is sent the firmware
+	// separately later, and is not waited for after that.
+	m_fw_acks_pass = 0;
+	const can_fw_node *node = fw_send();
+	bool ok = node->legacy && !node->failed && node->bytes_written == 0;
+	ok = ok && sim_frames(CAN_PACKET_FW_DATA) == (FW_ROUNDS_MAX + FW_CHUNKS - 1) * FW_CHUNK_FRAMES;
+	return report("Firmware node without broadcast support", ok);
+}
+
+static bool test_fw_failed(void) {
+	reset();
+
+	// A node that stops answering is given up on after the chunk it missed
+	m_fw_acks_pass = 1;
+	const can_fw_node *node = fw_send();
+	bool ok = !node->legacy && node->failed && node->bytes_written == FW_CHUNK_MAX;
+	ok = ok && sim_frames(CAN_PACKET_FW_DATA) == (1 + FW_ROUNDS_MAX + 1) * FW_CHUNK_FRAMES;
+	return report("Firmware node that stops answering", ok);
+}
+
+static CANRxFrame fw_frame(CAN_PACKET_ID cmd, const uint8_t *data, int len) {
+	CANRxFrame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.IDE = CAN_IDE_EXT;
+	frame.EID = 255 | ((uint32_t)cmd << 8);
+	frame.DLC = len;
+	memcpy(frame.data8, data, len);
+	return frame;
+}
+
+static bool test_fw_other_chunk(void) {
+	reset();
+
+	// A node that has missed the begin frame of the next chunk gets its data
+	// frames while it is still on the previous one.
+	const uint8_t seq = 5;
+	uint8_t d[8];
+	int32_t ind = 0;
+	d[ind++] = seq;
+	d[ind++] = 0;
+	d[ind++] = 0;
+	d[ind++] = 0;
+	d[ind++] = FW_CHUNK_MAX >> 8;
+	d[ind++] = FW_CHUNK_MAX & 0xFF;
+	uint16_t crc = crc16(m_fw, FW_CHUNK_MAX);
+	d[ind++] = crc >> 8;
+	d[ind++] = crc & 0xFF;
+	CANRxFrame frame = fw_frame(CAN_PACKET_FW_CHUNK_BEGIN, d, ind);
+	sim_deliver(0, &frame);
+
+	for (int i = 0;i < FW_CHUNK_FRAMES;i++) {
+		d[0] = ((seq & 3) << 6) | i;
+		memcpy(d + 1, m_fw + i * 7, 7);
+		frame = fw_frame(CAN_PACKET_FW_DATA, d, 8);
+		sim_deliver(0, &frame);
+
+		d[0] = (((seq + 1) & 3) << 6) | i;
+		memset(d + 1, 0x55, 7);
+		frame = fw_frame(CAN_PACKET_FW_DATA, d, 8);
+		sim_deliver(0, &frame);
+	}
+
+	d[0] = seq;
+	d[1] = sim_node_id(0);
+	frame = fw_frame(CAN_PACKET_FW_CHUNK_END, d, 2);
+	sim_deliver(0, &frame);
+
+	bool ok = sim_flash_writes(1) == 1 && memcmp(sim_flash(1), m_fw, FW_CHUNK_MAX) == 0;
+	return report("Firmware frames of another chunk", ok);
+}
+
+/*
+ * Set the status messages that node 0 sends.
+ */
+static void status_config(CAN_STATUS_MODE mode, uint32_t rate_1, uint32_t rate_2, bool on_change) {
+	sim_select(0);
+	app_configuration conf = *app_get_configuration();
+	conf.send_can_status = mode;
+	conf.send_can_status_rate_hz = rate_1;
+	conf.send_can_status_2_rate_hz = rate_2;
+	conf.send_can_status_3_rate_hz = 0;
+	conf.send_can_status_4_rate_hz = 0;
+	conf.send_can_status_5_rate_hz = 0;
+	conf.send_can_status_on_change = on_change;
+	app_set_configuration(&conf);
+}
+
+static bool test_status_rates(void) {
+	reset();
+	status_config(CAN_STATUS_1_2, 50, 10, false);
+	sim_run_status(0, S2ST(1));
+
+	// Only woken up for the slots in which a message is due
+	bool ok = sim_frames(CAN_PACKET_STATUS) == 50 && sim_frames(CAN_PACKET_STATUS_2) == 10;
+	ok = ok && sim_sleeps() <= 60 && sim_value_reads() <= 60;
+	printf("  %d wakeups, %d value reads\r\n", sim_sleeps(), sim_value_reads());
+	return report("Status messages at their rates", ok);
+}
+
+static bool test_status_on_change(void) {
+	reset();
+	status_config(CAN_STATUS_1_2_3_4_5, 0, 0, true);
+	sim_run_status(0, S2ST(1));
+
+	// Nothing changes, so nothing is sent and the values are only polled
+	bool ok = sim_frames(CAN_PACKET_STATUS) == 0 && sim_frames(CAN_PACKET_STATUS_5) == 0;
+	ok = ok && sim_value_reads() <= 1000 / STATUS_CHANGE_MIN_MS + 1;
+	printf("  %d wakeups, %d value reads\r\n", sim_sleeps(), sim_value_reads());
+	return report("Status messages on change only", ok);
+}
+
+static bool test_status_behind(void) {
+	reset();
+	status_config(CAN_STATUS_1, 50, 0, false);
+	sim_set_values_delay(MS2ST(5));
+	sim_run_status(0, S2ST(1));
+
+	// The slots that were missed while reading the values still count
+	bool ok = sim_frames(CAN_PACKET_STATUS) == 50;
+	printf("  %d sent\r\n", sim_frames(CAN_PACKET_STATUS));
+	return report("Status rate with slow value reads", ok);
+}
+
+int main(void) {
+	for (int i = 0;i < PACKET_MAX_PL_LEN;i++) {
+		m_data[0][i] = rand();
+		m_data[1][i] = rand();
+	}
+
+	for (int i = 0;i < FW_LEN;i++) {
+		m_fw[i] = rand();
+	}
+
+	bool ok = true;
+	ok &= test_clean();
+	ok &= test_dropped_data();
+	ok &= test_lost_done();
+	ok &= test_abort();
+	ok &= test_crc();
+	ok &= test_silent_receiver();
+	ok &= test_legacy();
+	ok &= test_soak();
+	ok &= test_fw_clean();
+	ok &= test_fw_missing_frames();
+	ok &= test_fw_repeated();
+	ok &= test_fw_lost_ack();
+	ok &= test_fw_legacy();
+	ok &= test_fw_failed();
+	ok &= test_fw_other_chunk();
+	ok &= test_status_rates();
+	ok &= test_status_on_change();
+	ok &= test_status_behind();
+
+	return ok ? 0 : 1;
+}
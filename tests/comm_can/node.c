@@ -0,0 +1,78 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * One node on the simulated bus. comm_can.c is included so that its private
+ * state and functions can be reached. The file is built once for every node
+ * with NODE_NAME set, and NODE_NAME is the only global symbol that is kept,
+ * see the Makefile. The CAN read and process threads are not run. Received
+ * frames go straight to the segmented transfer and firmware update handlers
+ * instead. The status thread is run until the clock passes a deadline, see
+ * sim_run_status.
+ */
+
+#include "comm_can.c"
+#include "sim.h"
+
+static void node_reset(void) {
+	chBSemObjectInit(&tp_flow_sem, true);
+	tp_tx_active = false;
+	memset(tp_legacy, 0, sizeof(tp_legacy));
+	memset(tp_rx_slots, 0, sizeof(tp_rx_slots));
+	memset(tp_rx_evicted, 0, sizeof(tp_rx_evicted));
+
+	fw_node_num = 0;
+	fw_tx_seq = 0;
+	fw_rx_seq = 0;
+	fw_rx_offset = 0;
+	fw_rx_len = 0;
+	fw_rx_crc = 0;
+	fw_rx_frames = 0;
+	fw_rx_status = FW_ACK_MISSING;
+}
+
+static void node_rx(const CANRxFrame *frame) {
+	if (tp_rx_frame(frame) || frame->IDE != CAN_IDE_EXT) {
+		return;
+	}
+
+	uint8_t id = frame->EID & 0xFF;
+	if (id == 255 || id == app_get_configuration()->controller_id) {
+		fw_rx_frame(frame->EID >> 8, frame->data8, frame->DLC);
+	}
+}
+
+static void node_fw_add_node(uint8_t controller_id) {
+	fw_node_index(controller_id, true);
+}
+
+static void node_status(void) {
+	cancom_status_thread(NULL);
+}
+
+const sim_node_t NODE_NAME = {
+		node_reset,
+		node_rx,
+		tp_rx_process,
+		tp_send,
+		node_fw_add_node,
+		fw_send_chunk,
+		comm_can_fw_node,
+		node_status
+};
@@ -0,0 +1,390 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * A CAN bus with SIM_NODES nodes, and the parts of ChibiOS and of the rest of
+ * the firmware that comm_can.c needs. Everything runs in one thread. A
+ * transmitted frame reaches the other nodes before canTransmit returns, and
+ * waiting for something that has not happened yet advances the virtual clock
+ * by the whole timeout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+
+#include "sim.h"
+#include "comm_can.h"
+#include "commands.h"
+#include "mc_interface.h"
+#include "app.h"
+#include "conf_general.h"
+#include "can_dict.h"
+#include "canard_driver.h"
+#include "encoder.h"
+#include "flash_helper.h"
+#include "nrf_driver.h"
+#include "timeout.h"
+
+extern const sim_node_t sim_node_a;
+extern const sim_node_t sim_node_b;
+
+// Private variables
+static const sim_node_t *m_nodes[SIM_NODES] = {&sim_node_a, &sim_node_b};
+static app_configuration m_appconf[SIM_NODES];
+static int m_node_now = 0;
+static systime_t m_time = 0;
+static sim_filter_t m_filter = 0;
+static int m_frames[256];
+static sim_packet_t m_packets[SIM_PACKETS_MAX];
+static int m_packet_num = 0;
+static uint8_t m_flash[SIM_NODES][SIM_FLASH_SIZE];
+static int m_flash_writes[SIM_NODES];
+static jmp_buf m_run_jmp;
+static bool m_run_active = false;
+static systime_t m_run_end = 0;
+static int m_sleeps = 0;
+static int m_value_reads = 0;
+static systime_t m_values_delay = 0;
+
+// Private functions
+static void sleep_ticks(systime_t time);
+
+// Variables used by the firmware
+CANDriver CAND1;
+volatile uint16_t ADC_Value[32];
+
+/**
+ * Reset the bus, the clock and all nodes.
+ *
+ * @param filter
+ * Function that sees every frame on the bus, or 0 to deliver all of them.
+ */
+void sim_reset(sim_filter_t filter) {
+	m_filter = filter;
+	m_time = 0;
+	m_packet_num = 0;
+	memset(m_frames, 0, sizeof(m_frames));
+	memset(m_flash, 0xFF, sizeof(m_flash));
+	memset(m_flash_writes, 0, sizeof(m_flash_writes));
+	m_sleeps = 0;
+	m_value_reads = 0;
+	m_values_delay = 0;
+
+	for (int i = 0;i < SIM_NODES;i++) {
+		memset(&m_appconf[i], 0, sizeof(app_configuration));
+		m_appconf[i].controller_id = sim_node_id(i);
+		m_appconf[i].can_mode = CAN_MODE_VESC;
+
+		sim_select(i);
+		m_nodes[i]->reset();
+	}
+
+	sim_select(0);
+}
+
+const sim_node_t *sim_node(int node) {
+	return m_nodes[node];
+}
+
+uint8_t sim_node_id(int node) {
+	return 10 + node;
+}
+
+/**
+ * Select the node that the firmware functions called next run on.
+ */
+void sim_select(int node) {
+	m_node_now = node;
+}
+
+/**
+ * Run the CAN process thread of a node once.
+ */
+void sim_process(int node) {
+	int node_old = m_node_now;
+	sim_select(node);
+	m_nodes[node]->process();
+	sim_select(node_old);
+}
+
+/**
+ * Deliver a frame from a node to all other nodes, without counting or
+ * filtering it.
+ */
+void sim_deliver(int from, const CANRxFrame *frame) {
+	int node_old = m_node_now;
+
+	for (int i = 0;i < SIM_NODES;i++) {
+		if (i != from) {
+			sim_select(i);
+			m_nodes[i]->rx(frame);
+		}
+	}
+
+	sim_select(node_old);
+}
+
+/**
+ * Get how many frames of a type have been transmitted, including the ones
+ * that were dropped.
+ */
+int sim_frames(uint8_t cmd) {
+	return m_frames[cmd];
+}
+
+int sim_packet_num(void) {
+	return m_packet_num;
+}
+
+const sim_packet_t *sim_packet(int index) {
+	return &m_packets[index];
+}
+
+systime_t sim_time(void) {
+	return m_time;
+}
+
+/**
+ * Get the new app flash area of a node.
+ */
+const uint8_t *sim_flash(int node) {
+	return m_flash[node];
+}
+
+int sim_flash_writes(int node) {
+	return m_flash_writes[node];
+}
+
+/**
+ * Run the status thread of a node until it goes to sleep after the clock
+ * has advanced by time.
+ */
+void sim_run_status(int node, systime_t time) {
+	int node_old = m_node_now;
+	sim_select(node);
+	m_run_end = m_time + time;
+	m_run_active = true;
+
+	if (setjmp(m_run_jmp) == 0) {
+		m_nodes[node]->status();
+	}
+
+	m_run_active = false;
+	sim_select(node_old);
+}
+
+/**
+ * Get how many times a thread has gone to sleep.
+ */
+int sim_sleeps(void) {
+	return m_sleeps;
+}
+
+/**
+ * Get how many times the motor values have been read.
+ */
+int sim_value_reads(void) {
+	return m_value_reads;
+}
+
+/**
+ * Make reading the motor values take time, so that the status thread falls
+ * behind.
+ */
+void sim_set_values_delay(systime_t delay) {
+	m_values_delay = delay;
+}
+
+static void sleep_ticks(systime_t time) {
+	m_time += time;
+	m_sleeps++;
+
+	if (m_run_active && (int32_t)(m_time - m_run_end) >= 0) {
+		longjmp(m_run_jmp, 1);
+	}
+}
+
+// ChibiOS
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg) {
+	(void)wsp; (void)size; (void)prio; (void)pf; (void)arg;
+	return 0;
+}
+
+void chThdSleep(systime_t time) {
+	sleep_ticks(time);
+}
+
+void chThdSleepMilliseconds(uint32_t msec) {
+	sleep_ticks(MS2ST(msec));
+}
+
+systime_t chVTGetSystemTime(void) {
+	return m_time;
+}
+
+eventmask_t chEvtWaitAny(eventmask_t events) {
+	(void)events;
+	printf("chEvtWaitAny would block forever\r\n");
+	exit(1);
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time) {
+	(void)events;
+	m_time += time;
+	return 0;
+}
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken) {
+	bsp->taken = taken;
+}
+
+void chBSemReset(binary_semaphore_t *bsp, bool taken) {
+	bsp->taken = taken;
+}
+
+void chBSemSignalI(binary_semaphore_t *bsp) {
+	bsp->taken = false;
+}
+
+msg_t chBSemWaitTimeout(binary_semaphore_t *bsp, systime_t time) {
+	if (!bsp->taken) {
+		bsp->taken = true;
+		return MSG_OK;
+	}
+
+	m_time += time;
+	return MSG_TIMEOUT;
+}
+
+// HAL
+
+msg_t canTransmit(CANDriver *canp, int mailbox, const CANTxFrame *ctfp, systime_t timeout) {
+	(void)canp; (void)mailbox; (void)timeout;
+
+	CANRxFrame frame = *ctfp;
+	const int from = m_node_now;
+
+	if (frame.IDE == CAN_IDE_EXT) {
+		m_frames[(frame.EID >> 8) & 0xFF]++;
+	}
+
+	if (!m_filter || m_filter(from, &frame)) {
+		sim_deliver(from, &frame);
+	}
+
+	return MSG_OK;
+}
+
+// Firmware
+
+const app_configuration* app_get_configuration(void) {
+	return &m_appconf[m_node_now];
+}
+
+void app_set_configuration(app_configuration *conf) {
+	m_appconf[m_node_now] = *conf;
+}
+
+void commands_process_packet(unsigned char *data, unsigned int len,
+		void(*reply_func)(unsigned char *data, unsigned int len)) {
+	(void)reply_func;
+
+	if (m_packet_num < SIM_PACKETS_MAX && len <= sizeof(m_packets[0].data)) {
+		sim_packet_t *p = &m_packets[m_packet_num++];
+		p->node = m_node_now;
+		p->len = len;
+		memcpy(p->data, data, len);
+	}
+}
+
+void commands_send_packet(unsigned char *data, unsigned int len) {
+	commands_process_packet(data, len, 0);
+}
+
+void commands_fwd_can_frame(int len, unsigned char *data, uint32_t id, bool is_extended) {
+	(void)len; (void)data; (void)id; (void)is_extended;
+}
+
+void commands_printf(const char* format, ...) {
+	(void)format;
+}
+
+uint8_t can_dict_handle_read_request(can_dict_type id, uint8_t *result, uint8_t result_length) {
+	(void)id; (void)result; (void)result_length;
+	return 0;
+}
+
+bool can_dict_handle_write_request(can_dict_type id, uint8_t *payload, uint8_t payload_length) {
+	(void)id; (void)payload; (void)payload_length;
+	return false;
+}
+
+bool can_dict_init(void) { return true; }
+void canard_driver_init(void) {}
+int conf_general_detect_apply_all_foc(float max_power_loss,
+		bool store_mcconf_on_success, bool send_mcconf_on_success) {
+	(void)max_power_loss; (void)store_mcconf_on_success; (void)send_mcconf_on_success;
+	return -1;
+}
+bool conf_general_store_app_configuration(app_configuration *conf) { (void)conf; return true; }
+bool conf_general_store_mc_configuration(mc_configuration *conf) { (void)conf; return true; }
+uint8_t* encoder_ts5700n8501_get_raw_status(void) { static uint8_t status[8]; return status; }
+uint16_t flash_helper_write_new_app_data(uint32_t offset, uint8_t *data, uint32_t len) {
+	if (offset + len > SIM_FLASH_SIZE) {
+		return FLASH_ERROR_PROGRAM;
+	}
+
+	memcpy(m_flash[m_node_now] + offset, data, len);
+	m_flash_writes[m_node_now]++;
+	return FLASH_COMPLETE;
+}
+bool nrf_driver_ext_nrf_running(void) { return false; }
+void nrf_driver_pause(int ms) { (void)ms; }
+void timeout_feed_WDT(uint8_t index) { (void)index; }
+void timeout_reset(void) {}
+
+static mc_configuration m_mcconf;
+const volatile mc_configuration* mc_interface_get_configuration(void) { return &m_mcconf; }
+void mc_interface_set_configuration(mc_configuration *configuration) { (void)configuration; }
+mc_state mc_interface_get_state(void) { return MC_STATE_OFF; }
+void mc_interface_set_state(mc_state newState, bool force) { (void)newState; (void)force; }
+void mc_interface_set_duty(float dutyCycle) { (void)dutyCycle; }
+void mc_interface_set_pid_speed(float rpm) { (void)rpm; }
+void mc_interface_set_pid_pos(float pos) { (void)pos; }
+void mc_interface_set_current(float current) { (void)current; }
+void mc_interface_set_brake_current(float current) { (void)current; }
+void mc_interface_set_current_rel(float val) { (void)val; }
+void mc_interface_set_brake_current_rel(float val) { (void)val; }
+void mc_interface_set_handbrake(float current) { (void)current; }
+void mc_interface_set_handbrake_rel(float val) { (void)val; }
+float mc_interface_get_amp_hours(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_amp_hours_charged(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_watt_hours(bool reset) { (void)reset; return 0.0; }
+float mc_interface_get_watt_hours_charged(bool reset) { (void)reset; return 0.0; }
+float mc_interface_temp_fet_filtered(void) { return 25.0; }
+float mc_interface_temp_motor_filtered(void) { return 25.0; }
+void mc_interface_get_values(mc_motor_values *val) {
+	memset(val, 0, sizeof(mc_motor_values));
+	m_value_reads++;
+	m_time += m_values_delay;
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal.h"
+#include "datatypes.h"
+
+// Settings
+#define SIM_NODES				2
+#define SIM_PACKETS_MAX			16
+#define SIM_FLASH_SIZE			4096
+
+// The functions of one node, see node.c
+typedef struct {
+	void (*reset)(void);
+	void (*rx)(const CANRxFrame *frame);
+	void (*process)(void);
+	bool (*tp_send)(uint8_t controller_id, uint8_t *data, unsigned int len, uint8_t send);
+	void (*fw_add_node)(uint8_t controller_id);
+	void (*fw_send_chunk)(uint32_t offset, uint8_t *data, unsigned int len, bool first);
+	can_fw_node *(*fw_node)(int index);
+	void (*status)(void);
+} sim_node_t;
+
+// A buffer that a node has passed on to the commands
+typedef struct {
+	int node;
+	unsigned int len;
+	uint8_t data[1024];
+} sim_packet_t;
+
+/*
+ * Called for every frame on the bus, before it reaches the other nodes. The
+ * frame can be changed, and it is dropped when false is returned.
+ */
+typedef bool (*sim_filter_t)(int from, CANRxFrame *frame);
+
+// Functions
+void sim_reset(sim_filter_t filter);
+const sim_node_t *sim_node(int node);
+uint8_t sim_node_id(int node);
+void sim_select(int node);
+void sim_process(int node);
+void sim_deliver(int from, const CANRxFrame *frame);
+int sim_frames(uint8_t cmd);
+int sim_packet_num(void);
+const sim_packet_t *sim_packet(int index);
+systime_t sim_time(void);
+const uint8_t *sim_flash(int node);
+int sim_flash_writes(int node);
+void sim_run_status(int node, systime_t time);
+int sim_sleeps(void);
+int sim_value_reads(void);
+void sim_set_values_delay(systime_t delay);
+
+#endif /* SIM_H_ */
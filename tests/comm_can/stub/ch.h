@@ -0,0 +1,91 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Minimal ChibiOS kernel API for the host build of comm_can.c. Everything
+ * runs in one thread on a virtual clock: frames are delivered as soon as
+ * they are transmitted, and waiting for something that has not happened
+ * yet just advances the clock, see main.c.
+ */
+
+#ifndef CH_H_
+#define CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint8_t tprio_t;
+typedef uint32_t eventmask_t;
+typedef struct { int dummy; } thread_t;
+typedef struct { int dummy; } mutex_t;
+typedef struct { int dummy; } event_source_t;
+typedef struct { int dummy; } event_listener_t;
+typedef struct { bool taken; } binary_semaphore_t;
+
+#define CH_CFG_ST_FREQUENCY			10000
+#define MS2ST(msec)					((systime_t)(((msec) * CH_CFG_ST_FREQUENCY + 999) / 1000))
+#define US2ST(usec)					((systime_t)(((usec) * CH_CFG_ST_FREQUENCY + 999999) / 1000000))
+#define S2ST(sec)					((systime_t)((sec) * CH_CFG_ST_FREQUENCY))
+#define ST2MS(n)					((((n) - 1) * 1000) / CH_CFG_ST_FREQUENCY + 1)
+
+#define TIME_IMMEDIATE				((systime_t)0)
+#define TIME_INFINITE				((systime_t)-1)
+#define MSG_OK						((msg_t)0)
+#define MSG_TIMEOUT					((msg_t)-1)
+#define ALL_EVENTS					((eventmask_t)-1)
+
+#define NORMALPRIO					128
+#define THD_WORKING_AREA(s, n)		uint8_t s[n]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+
+static inline void chSysLock(void) {}
+static inline void chSysUnlock(void) {}
+static inline void chSchRescheduleS(void) {}
+static inline void chMtxObjectInit(mutex_t *mp) {(void)mp;}
+static inline void chMtxLock(mutex_t *mp) {(void)mp;}
+static inline void chMtxUnlock(mutex_t *mp) {(void)mp;}
+static inline void chRegSetThreadName(const char *name) {(void)name;}
+static inline bool chThdShouldTerminateX(void) {return false;}
+static inline thread_t *chThdGetSelfX(void) {return 0;}
+static inline void chEvtSignal(thread_t *tp, eventmask_t events) {(void)tp; (void)events;}
+static inline eventmask_t chEvtGetAndClearEvents(eventmask_t events) {(void)events; return 0;}
+static inline void chEvtRegister(event_source_t *esp, event_listener_t *elp, int event) {
+	(void)esp; (void)elp; (void)event;
+}
+static inline void chEvtUnregister(event_source_t *esp, event_listener_t *elp) {(void)esp; (void)elp;}
+#define chVTGetSystemTimeX()		chVTGetSystemTime()
+#define chVTTimeElapsedSinceX(start)	((systime_t)(chVTGetSystemTime() - (start)))
+#define chVTIsSystemTimeWithinX(start, end)	\
+	((systime_t)(chVTGetSystemTime() - (start)) < (systime_t)((end) - (start)))
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg);
+void chThdSleep(systime_t time);
+void chThdSleepMilliseconds(uint32_t msec);
+systime_t chVTGetSystemTime(void);
+eventmask_t chEvtWaitAny(eventmask_t events);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time);
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken);
+void chBSemReset(binary_semaphore_t *bsp, bool taken);
+void chBSemSignalI(binary_semaphore_t *bsp);
+msg_t chBSemWaitTimeout(binary_semaphore_t *bsp, systime_t time);
+
+#endif /* CH_H_ */
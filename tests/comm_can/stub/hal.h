@@ -0,0 +1,89 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Minimal ChibiOS HAL for the host build of comm_can.c. Transmitted frames
+ * go to the simulated bus in main.c.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include "ch.h"
+#include "stm32f4xx_conf.h"
+
+typedef struct {
+	uint8_t DLC;
+	uint8_t RTR;
+	uint8_t IDE;
+	uint32_t SID;
+	uint32_t EID;
+	union {
+		uint8_t data8[8];
+		uint32_t data32[2];
+	};
+} CANRxFrame;
+
+typedef CANRxFrame CANTxFrame;
+
+typedef struct {
+	uint32_t mcr;
+	uint32_t btr;
+} CANConfig;
+
+typedef struct {
+	uint32_t filter;
+	uint32_t mode;
+	uint32_t scale;
+	uint32_t assignment;
+	uint32_t register1;
+	uint32_t register2;
+} CANFilter;
+
+typedef struct {
+	event_source_t rxfull_event;
+} CANDriver;
+
+extern CANDriver CAND1;
+
+#define CAN_IDE_STD					0
+#define CAN_IDE_EXT					1
+#define CAN_RTR_DATA				0
+#define CAN_ANY_MAILBOX				0
+#define STM32_CAN_MAX_FILTERS		28
+
+#define palSetPadMode(port, pad, mode)
+#define palSetPad(port, pad)
+#define palClearPad(port, pad)
+#define PAL_MODE_ALTERNATE(n)		0
+#define PAL_STM32_OTYPE_PUSHPULL	0
+#define PAL_STM32_OSPEED_MID1		0
+
+static inline void canStart(CANDriver *canp, const CANConfig *config) {(void)canp; (void)config;}
+static inline void canStop(CANDriver *canp) {(void)canp;}
+static inline void canSTM32SetFilters(uint32_t can2sb, uint32_t num, const CANFilter *cfp) {
+	(void)can2sb; (void)num; (void)cfp;
+}
+static inline msg_t canReceive(CANDriver *canp, int mailbox, CANRxFrame *crfp, systime_t timeout) {
+	(void)canp; (void)mailbox; (void)crfp; (void)timeout;
+	return MSG_TIMEOUT;
+}
+msg_t canTransmit(CANDriver *canp, int mailbox, const CANTxFrame *ctfp, systime_t timeout);
+
+#endif /* HAL_H_ */
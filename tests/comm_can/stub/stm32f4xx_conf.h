@@ -0,0 +1,43 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * The parts of the peripheral library header that comm_can.c uses. It has
+ * the include guard of the real one, which is then skipped.
+ */
+
+#ifndef __STM32F4xx_CONF_H
+#define __STM32F4xx_CONF_H
+
+#include <stdint.h>
+
+#define CAN_MCR_ABOM				(1 << 6)
+#define CAN_MCR_AWUM				(1 << 5)
+#define CAN_MCR_TXFP				(1 << 2)
+#define CAN_BTR_SJW(n)				((n) << 24)
+#define CAN_BTR_TS2(n)				((n) << 20)
+#define CAN_BTR_TS1(n)				((n) << 16)
+#define CAN_BTR_BRP(n)				(n)
+
+#define FLASH_ERROR_PROGRAM			7
+#define FLASH_COMPLETE				9
+
+#define __DMB()
+
+#endif /* __STM32F4xx_CONF_H */
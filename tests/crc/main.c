@@ -0,0 +1,186 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Cross-check of crc16 in crc.c and utils_crc32c in utils.c against plain
+ * byte at a time and bit at a time reference implementations, for all
+ * lengths and alignments that the slicing and the tail handling can hit, and
+ * their throughput compared to the references. The incremental crc16 API
+ * must match crc16 however the data is split up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc.h"
+#include "utils.h"
+
+// Settings
+#define CHECK_LEN_MAX		600
+#define BENCH_LEN			512
+#define BENCH_ROUNDS		20000
+
+static uint8_t m_data[CHECK_LEN_MAX + 8];
+static volatile uint32_t m_sink;
+
+// utils.c uses these for utils_sys_lock_cnt
+void chSysLock(void) {}
+void chSysUnlock(void) {}
+
+extern const unsigned short crc16_tab[];
+
+static double time_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned short ref_crc16(unsigned char *buf, unsigned int len) {
+	unsigned short cksum = 0;
+	for (unsigned int i = 0;i < len;i++) {
+		cksum = crc16_tab[(((cksum >> 8) ^ *buf++) & 0xFF)] ^ (cksum << 8);
+	}
+	return cksum;
+}
+
+static uint32_t ref_crc32c(uint8_t *data, uint32_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (uint32_t i = 0; i < len;i++) {
+		crc ^= data[i];
+		for (int j = 7;j >= 0;j--) {
+			uint32_t mask = -(crc & 1);
+			crc = (crc >> 1) ^ (0x82F63B78 & mask);
+		}
+	}
+
+	return ~crc;
+}
+
+static uint32_t crc16_wrap(uint8_t *data, uint32_t len) {
+	return crc16(data, len);
+}
+
+static uint32_t ref_crc16_wrap(uint8_t *data, uint32_t len) {
+	return ref_crc16(data, len);
+}
+
+/**
+ * Compare an implementation against a reference for every length up to
+ * CHECK_LEN_MAX at every alignment within a word.
+ *
+ * @return
+ * The number of mismatches.
+ */
+static int check(const char *name, uint32_t(*func)(uint8_t*, uint32_t),
+		uint32_t(*ref)(uint8_t*, uint32_t)) {
+	int errors = 0;
+
+	for (int ofs = 0;ofs < 8;ofs++) {
+		for (uint32_t len = 0;len <= CHECK_LEN_MAX;len++) {
+			if (func(m_data + ofs, len) != ref(m_data + ofs, len)) {
+				if (errors == 0) {
+					printf("FAILED: %s differs at offset %d, length %u\n", name, ofs, len);
+				}
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+/**
+ * Feed random splits of the data to the incremental crc16 API.
+ *
+ * @return
+ * The number of mismatches.
+ */
+static int check_incremental(void) {
+	int errors = 0;
+
+	for (int i = 0;i < 10000;i++) {
+		unsigned int len = rand() % (CHECK_LEN_MAX + 1);
+		crc16_ctx_t ctx;
+		crc16_init(&ctx);
+
+		unsigned int pos = 0;
+		while (pos < len) {
+			unsigned int chunk = rand() % (len - pos + 1);
+			crc16_update(&ctx, m_data + pos, chunk);
+			pos += chunk;
+		}
+
+		if (crc16_final(&ctx) != crc16(m_data, len) || ctx.len != len) {
+			if (errors == 0) {
+				printf("FAILED: incremental crc16 differs at length %u\n", len);
+			}
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/**
+ * @return
+ * Throughput in MB/s.
+ */
+static double bench(uint32_t(*func)(uint8_t*, uint32_t)) {
+	double t_start = time_now_ns();
+	for (int r = 0;r < BENCH_ROUNDS;r++) {
+		m_sink = func(m_data, BENCH_LEN);
+	}
+	return (double)BENCH_LEN * BENCH_ROUNDS / (time_now_ns() - t_start) * 1e3;
+}
+
+int main(void) {
+	srand(1);
+	for (unsigned int i = 0;i < sizeof(m_data);i++) {
+		m_data[i] = rand();
+	}
+
+	int res = 0;
+
+	// CRC-16/XMODEM check value
+	if (crc16((unsigned char*)"123456789", 9) != 0x31C3) {
+		printf("FAILED: crc16 check value\n");
+		res = 1;
+	}
+
+	// CRC-32C check value
+	if (utils_crc32c((uint8_t*)"123456789", 9) != 0xE3069283) {
+		printf("FAILED: utils_crc32c check value\n");
+		res = 1;
+	}
+
+	if (check("crc16", crc16_wrap, ref_crc16_wrap) ||
+			check("utils_crc32c", utils_crc32c, ref_crc32c) ||
+			check_incremental()) {
+		res = 1;
+	}
+
+	printf("  %-28s %10s %10s\n", "Function", "MB/s", "Ref MB/s");
+	printf("  %-28s %10.1f %10.1f\n", "crc16", bench(crc16_wrap), bench(ref_crc16_wrap));
+	printf("  %-28s %10.1f %10.1f\n", "utils_crc32c", bench(utils_crc32c), bench(ref_crc32c));
+
+	return res;
+}
@@ -0,0 +1,484 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Software-in-the-loop test of the FOC control loop. The unmodified
+ * mcpwm_foc.c runs against the virtual motor in virtual_motor.c, and the
+ * time spent in each stage of the ADC interrupt is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "sil_hw.h"
+#include "mcpwm_foc.h"
+#include "virtual_motor.h"
+#include "confgenerator.h"
+#include "mc_interface.h"
+#include "utils.h"
+
+// Virtual motor: load torque, inertia, Ld, Lq, R, flux linkage, bus voltage.
+// The firmware uses 2/3 of the phase resistance and inductance of the model.
+#define VIRTUAL_MOTOR_CMD		"connect_virtual_motor 0.0 0.001 0.0000105 0.0000105 0.0225 0.00245 48.0"
+// Motor with a higher inductance on a low bus voltage, so that it runs out of
+// voltage well below the speed limit and field weakening has some effect
+#define VIRTUAL_MOTOR_CMD_FW	"connect_virtual_motor 0.0 0.001 0.0001 0.0001 0.0225 0.00245 12.0"
+#define VIRTUAL_MOTOR_FW_L		(0.0001 / 1.5)
+// Salient motor with Lq = 1.5 * Ld
+#define VIRTUAL_MOTOR_CMD_IPM	"connect_virtual_motor 0.0 0.001 0.00006 0.00009 0.0225 0.00245 48.0"
+#define VIRTUAL_MOTOR_IPM_L		(0.000075 / 1.5)
+#define VIRTUAL_MOTOR_IPM_LD_LQ	(0.00003 / 1.5)
+// The first motor with the default hardware dead time, without and with load
+#define VIRTUAL_MOTOR_CMD_DT	"connect_virtual_motor 0.0 0.001 0.0000105 0.0000105 0.0225 0.00245 48.0 360"
+#define VIRTUAL_MOTOR_CMD_DT_LOAD	"connect_virtual_motor 0.1 0.001 0.0000105 0.0000105 0.0225 0.00245 48.0 360"
+
+static mc_configuration m_conf;
+
+static double wall_time_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Run the motor for a while and measure how well the estimated angle
+ * follows the angle of the virtual motor.
+ *
+ * @return
+ * RMS angle error in degrees.
+ */
+static float run_and_track(int cycles, float *max_err) {
+	double err_sq = 0.0;
+	*max_err = 0.0;
+
+	for (int i = 0;i < cycles;i++) {
+		sil_run_cycles(1);
+		float err = fabsf(utils_angle_difference(mcpwm_foc_get_phase(),
+				virtual_motor_get_angle_deg()));
+		err_sq += err * err;
+		if (err > *max_err) {
+			*max_err = err;
+		}
+	}
+
+	return sqrtf(err_sq / (double)cycles);
+}
+
+/**
+ * Compare the angle error and the CPU time of the observer variants at
+ * a few speeds.
+ */
+static void bench_observers(float f_ctrl) {
+	static const float speeds[] = {5000.0, 20000.0, 40000.0};
+	static const struct {
+		mc_foc_observer_type type;
+		const char *name;
+	} observers[] = {
+			{FOC_OBSERVER_ORTEGA_ORIGINAL, "Original"},
+			{FOC_OBSERVER_ORTEGA_ITERATIVE, "Iterative"},
+			{FOC_OBSERVER_ORTEGA_ADAPTIVE, "Adaptive"},
+	};
+
+	printf("Observer variants\n");
+	printf("  %-10s %10s %14s %14s %12s\n", "Observer", "ERPM", "Err RMS (deg)",
+			"Err max (deg)", "ns / sample");
+
+	for (unsigned int i = 0;i < sizeof(speeds) / sizeof(speeds[0]);i++) {
+		mcpwm_foc_set_pid_speed(speeds[i]);
+		sil_run_cycles((int)(1.0 * f_ctrl));
+
+		for (unsigned int j = 0;j < sizeof(observers) / sizeof(observers[0]);j++) {
+			m_conf.foc_observer_type = observers[j].type;
+			sil_run_cycles((int)(0.05 * f_ctrl));
+
+			sil_profile_reset();
+			float max_err;
+			float rms_err = run_and_track((int)(0.1 * f_ctrl), &max_err);
+			const sil_stage_stats_t *s = &sil_stage_stats[SIL_STAGE_OBSERVER];
+
+			printf("  %-10s %10.0f %14.2f %14.2f %12.1f\n", observers[j].name,
+					(double)mcpwm_foc_get_rpm(), (double)rms_err, (double)max_err,
+					(double)s->ticks / (double)s->calls / sil_ticks_per_ns());
+		}
+	}
+
+	m_conf.foc_observer_type = FOC_OBSERVER_ORTEGA_ORIGINAL;
+	printf("\n");
+}
+
+/**
+ * Step the q axis current at high speed and measure how long it takes to
+ * settle within 5 % of the step.
+ *
+ * @return
+ * The settling time in seconds.
+ */
+static float current_step(float f_ctrl, float erpm, float *overshoot, float *id_max) {
+	const float i_start = 5.0;
+	const float i_end = 20.0;
+	const int cycles = (int)(0.005 * f_ctrl);
+
+	mcpwm_foc_set_pid_speed(erpm);
+	sil_run_cycles((int)(0.5 * f_ctrl));
+	mcpwm_foc_set_current(i_start);
+	sil_run_cycles((int)(0.005 * f_ctrl));
+	mcpwm_foc_set_current(i_end);
+
+	int last_outside = 0;
+	*overshoot = 0.0;
+	*id_max = 0.0;
+
+	for (int i = 0;i < cycles;i++) {
+		sil_run_cycles(1);
+		const float iq = mcpwm_foc_get_iq();
+		if (fabsf(iq - i_end) > 0.05 * (i_end - i_start)) {
+			last_outside = i + 1;
+		}
+		if ((iq - i_end) > *overshoot) {
+			*overshoot = iq - i_end;
+		}
+		if (fabsf(mcpwm_foc_get_id()) > *id_max) {
+			*id_max = fabsf(mcpwm_foc_get_id());
+		}
+	}
+
+	return (float)last_outside / f_ctrl;
+}
+
+/**
+ * Compare current step responses with the configured gains and with gains
+ * scheduled from the motor parameters plus feed-forward.
+ *
+ * @return
+ * True if the scheduled controller settles at least as fast everywhere.
+ */
+static bool bench_current_controller(float f_ctrl) {
+	static const float speeds[] = {10000.0, 25000.0, 40000.0};
+	const float kp_old = m_conf.foc_current_kp;
+	const float ki_old = m_conf.foc_current_ki;
+	const mc_foc_cc_decoupling_mode dec_old = m_conf.foc_cc_decoupling;
+	bool ok = true;
+
+	printf("Current step 5 A -> 20 A\n");
+	printf("  %-10s %10s %14s %14s %12s\n", "Controller", "ERPM", "Settling (us)",
+			"Overshoot (A)", "Id max (A)");
+
+	for (unsigned int i = 0;i < sizeof(speeds) / sizeof(speeds[0]);i++) {
+		float t_settle[2];
+
+		for (int j = 0;j < 2;j++) {
+			if (j == 0) {
+				m_conf.foc_cc_bandwidth = 0.0;
+				m_conf.foc_cc_decoupling = dec_old;
+			} else {
+				m_conf.foc_cc_bandwidth = 0.25 * f_ctrl;
+				m_conf.foc_cc_decoupling = FOC_CC_DECOUPLING_FEED_FORWARD;
+			}
+
+			float overshoot, id_max;
+			t_settle[j] = current_step(f_ctrl, speeds[i], &overshoot, &id_max);
+			printf("  %-10s %10.0f %14.1f %14.2f %12.2f\n", j == 0 ? "Fixed" : "Scheduled",
+					(double)speeds[i], (double)t_settle[j] * 1e6, (double)overshoot, (double)id_max);
+		}
+
+		if (t_settle[1] > t_settle[0]) {
+			ok = false;
+		}
+	}
+
+	m_conf.foc_cc_bandwidth = 0.0;
+	m_conf.foc_current_kp = kp_old;
+	m_conf.foc_current_ki = ki_old;
+	m_conf.foc_cc_decoupling = dec_old;
+	printf("\n");
+
+	return ok;
+}
+
+/**
+ * Start the motor in open loop and switch to current control.
+ */
+static void spin_up(float f_ctrl, float current) {
+	mcpwm_foc_set_openloop(10.0, 1000.0);
+	sil_run_cycles((int)(0.2 * f_ctrl));
+	mcpwm_foc_set_current(current);
+}
+
+/**
+ * Accelerate the motor on a low bus voltage with a constant current command
+ * and compare the highest speed reached with and without field weakening.
+ *
+ * @return
+ * True if field weakening raises the top speed.
+ */
+static bool bench_field_weakening(float f_ctrl) {
+	const float current = 10.0;
+	const mc_configuration conf_old = m_conf;
+	float erpm[2];
+
+	m_conf.foc_motor_l = VIRTUAL_MOTOR_FW_L;
+	m_conf.foc_cc_bandwidth = 2000.0;
+
+	printf("Field weakening, %.0f A on a 12 V bus\n", (double)current);
+	printf("  %-10s %10s %10s %10s %10s\n", "FW max (A)", "ERPM max", "Id (A)", "Iq (A)", "Duty");
+
+	for (int i = 0;i < 2;i++) {
+		m_conf.foc_fw_current_max = i == 0 ? 0.0 : 20.0;
+
+		sil_terminal_cmd("disconnect_virtual_motor");
+		sil_terminal_cmd(VIRTUAL_MOTOR_CMD_FW);
+		spin_up(f_ctrl, current);
+
+		erpm[i] = 0.0;
+		for (int j = 0;j < 250;j++) {
+			sil_run_cycles((int)(0.01 * f_ctrl));
+			erpm[i] = fmaxf(erpm[i], mcpwm_foc_get_rpm());
+		}
+
+		printf("  %-10.0f %10.0f %10.2f %10.2f %10.3f\n",
+				(double)m_conf.foc_fw_current_max, (double)erpm[i],
+				(double)mcpwm_foc_get_id(), (double)mcpwm_foc_get_iq(),
+				(double)mcpwm_foc_get_duty_cycle_now());
+	}
+
+	m_conf = conf_old;
+	mcpwm_foc_set_current(0.0);
+	sil_terminal_cmd("disconnect_virtual_motor");
+	sil_terminal_cmd(VIRTUAL_MOTOR_CMD);
+	printf("\n");
+
+	return isfinite(erpm[1]) && erpm[1] > 1.25 * erpm[0];
+}
+
+/**
+ * Accelerate a salient motor with and without maximum torque per amp and
+ * compare the acceleration, which is proportional to the torque, at the
+ * same current magnitude.
+ *
+ * @return
+ * True if MTPA gives more torque per amp.
+ */
+static bool bench_mtpa(float f_ctrl) {
+	const float current = 40.0;
+	const mc_configuration conf_old = m_conf;
+	float accel[2];
+
+	m_conf.foc_motor_l = VIRTUAL_MOTOR_IPM_L;
+	m_conf.foc_motor_ld_lq_diff = VIRTUAL_MOTOR_IPM_LD_LQ;
+	m_conf.foc_cc_bandwidth = 2000.0;
+	m_conf.foc_cc_decoupling = FOC_CC_DECOUPLING_FEED_FORWARD;
+
+	printf("MTPA, %.0f A on a salient motor\n", (double)current);
+	printf("  %-10s %12s %10s %10s %10s\n", "MTPA", "ERPM / s", "Id (A)", "Iq (A)", "I abs (A)");
+
+	for (int i = 0;i < 2;i++) {
+		m_conf.foc_mtpa_enable = i == 1;
+		mcpwm_foc_set_configuration(&m_conf);
+
+		sil_terminal_cmd("disconnect_virtual_motor");
+		sil_terminal_cmd(VIRTUAL_MOTOR_CMD_IPM);
+		spin_up(f_ctrl, current);
+		sil_run_cycles((int)(0.05 * f_ctrl));
+
+		const float erpm_start = mcpwm_foc_get_rpm();
+		sil_run_cycles((int)(0.1 * f_ctrl));
+		accel[i] = (mcpwm_foc_get_rpm() - erpm_start) / 0.1;
+
+		const float id = mcpwm_foc_get_id();
+		const float iq = mcpwm_foc_get_iq();
+		printf("  %-10s %12.0f %10.2f %10.2f %10.2f\n", i == 0 ? "Off" : "On",
+				(double)accel[i], (double)id, (double)iq, (double)sqrtf(SQ(id) + SQ(iq)));
+	}
+
+	m_conf = conf_old;
+	mcpwm_foc_set_configuration(&m_conf);
+	mcpwm_foc_set_current(0.0);
+	sil_terminal_cmd("disconnect_virtual_motor");
+	sil_terminal_cmd(VIRTUAL_MOTOR_CMD);
+	printf("\n");
+
+	return isfinite(accel[1]) && accel[1] > 1.05 * accel[0];
+}
+
+/**
+ * Run a loaded virtual motor that loses voltage to the dead time at a fixed
+ * duty cycle, and compare the speed it reaches and the current ripple with
+ * and without dead time compensation in the output.
+ *
+ * @return
+ * True if the compensation recovers speed and reduces the current ripple.
+ */
+static bool bench_dead_time(float f_ctrl) {
+	const float duty = 0.1;
+	const mc_configuration conf_old = m_conf;
+	float ripple[2], rpm[2];
+
+	m_conf.foc_dt_us = HW_DEAD_TIME_NSEC * 1e-3;
+
+	printf("Dead time compensation, %.0f ns at %.2f duty\n",
+			(double)HW_DEAD_TIME_NSEC, (double)duty);
+	printf("  %-10s %14s %14s\n", "Factor", "ERPM", "Iq RMS (A)");
+
+	for (int i = 0;i < 2;i++) {
+		m_conf.foc_dt_comp_factor = i == 0 ? 0.0 : 1.0;
+
+		// Reconnecting while connected keeps the speed, so the load is
+		// only applied once the motor runs.
+		sil_terminal_cmd("disconnect_virtual_motor");
+		sil_terminal_cmd(VIRTUAL_MOTOR_CMD_DT);
+		spin_up(f_ctrl, 10.0);
+		sil_terminal_cmd(VIRTUAL_MOTOR_CMD_DT_LOAD);
+		mcpwm_foc_set_duty(duty);
+		sil_run_cycles((int)(1.0 * f_ctrl));
+
+		const int cycles = (int)(0.2 * f_ctrl);
+		double iq_sum = 0.0, iq_sq = 0.0, rpm_sum = 0.0;
+		for (int j = 0;j < cycles;j++) {
+			sil_run_cycles(1);
+			const float iq = mcpwm_foc_get_iq();
+			iq_sum += iq;
+			iq_sq += iq * iq;
+			rpm_sum += mcpwm_foc_get_rpm();
+		}
+
+		const double iq_mean = iq_sum / cycles;
+		ripple[i] = sqrt(iq_sq / cycles - iq_mean * iq_mean);
+		rpm[i] = rpm_sum / cycles;
+		printf("  %-10.1f %14.0f %14.3f\n", (double)m_conf.foc_dt_comp_factor,
+				(double)rpm[i], (double)ripple[i]);
+	}
+
+	m_conf = conf_old;
+	mcpwm_foc_set_current(0.0);
+	sil_terminal_cmd("disconnect_virtual_motor");
+	sil_terminal_cmd(VIRTUAL_MOTOR_CMD);
+	printf("\n");
+
+	return rpm[1] > rpm[0] && ripple[1] < ripple[0];
+}
+
+/**
+ * Print the ISR duration histogram that the firmware keeps for
+ * COMM_GET_FOC_TIMING_HIST.
+ */
+static void print_isr_hist(void) {
+	uint32_t bins[MCPWM_FOC_TIMING_HIST_BINS];
+	float max;
+	mcpwm_foc_get_timing_hist(FOC_TIMING_HIST_ISR_DURATION, bins, &max);
+
+	uint64_t total = 0;
+	for (int i = 0;i < MCPWM_FOC_TIMING_HIST_BINS;i++) {
+		total += bins[i];
+	}
+
+	printf("ISR duration histogram (%llu samples, max %.2f us)\n",
+			(unsigned long long)total, (double)max * 1e6);
+	for (int i = 0;i < MCPWM_FOC_TIMING_HIST_BINS;i++) {
+		if (bins[i] > 0) {
+			printf("  %2d us%s %10u\n", i, i == (MCPWM_FOC_TIMING_HIST_BINS - 1) ? "+" : " ",
+					(unsigned int)bins[i]);
+		}
+	}
+}
+
+int main(void) {
+	confgenerator_set_defaults_mcconf(&m_conf);
+	m_conf.motor_type = MOTOR_TYPE_FOC;
+	m_conf.foc_motor_r = 0.015;
+	m_conf.foc_motor_l = 0.000007;
+	m_conf.foc_motor_flux_linkage = 0.00245;
+
+	sil_init(&m_conf);
+	sil_terminal_cmd(VIRTUAL_MOTOR_CMD);
+
+	const float f_ctrl = mcpwm_foc_get_sampling_frequency_now();
+	printf("Control loop: %.1f kHz, %s ISR\n", (double)f_ctrl / 1e3,
+			MCPWM_FOC_SPECIALISED_ISR ? "specialised" : "generic");
+
+	// Start in open loop, as the observer has nothing to track at standstill,
+	// then spin up and check that the observer locks on
+	spin_up(f_ctrl, 10.0);
+	sil_run_cycles((int)(0.3 * f_ctrl));
+
+	float max_err;
+	float rms_err = run_and_track((int)(0.1 * f_ctrl), &max_err);
+	const float erpm = mcpwm_foc_get_rpm();
+	printf("Spin-up: %.0f ERPM, angle error %.2f deg RMS, %.2f deg max\n",
+			(double)erpm, (double)rms_err, (double)max_err);
+
+	int res = 0;
+	if (erpm < 1000.0 || rms_err > 10.0) {
+		printf("FAILED: the observer did not lock on\n");
+		res = 1;
+	}
+
+	bench_observers(f_ctrl);
+
+	if (!bench_current_controller(f_ctrl)) {
+		printf("FAILED: the scheduled current controller settles slower\n");
+		res = 1;
+	}
+
+	// Benchmark at constant speed
+	mcpwm_foc_set_pid_speed(erpm);
+	sil_run_cycles((int)(0.1 * f_ctrl));
+
+	const int bench_cycles = 500000;
+	sil_profile_reset();
+	mcpwm_foc_reset_timing_hist();
+	double t_start = wall_time_now();
+	sil_run_cycles(bench_cycles);
+	double t_run = wall_time_now() - t_start;
+
+	printf("\n%d control cycles in %.3f s (%.2f M cycles/s, %.1f s simulated)\n",
+			bench_cycles, t_run, (double)bench_cycles / t_run / 1e6,
+			(double)bench_cycles / (double)f_ctrl);
+	printf("Ticks per ns: %.3f\n\n", sil_ticks_per_ns());
+	sil_profile_print("Control loop stages");
+	printf("\n");
+	print_isr_hist();
+
+	const float erpm_end = mcpwm_foc_get_rpm();
+	if (!isfinite(erpm_end) || fabsf(erpm_end - erpm) > 0.1 * erpm) {
+		printf("FAILED: speed not held during the benchmark (%.0f ERPM)\n",
+				(double)erpm_end);
+		res = 1;
+	}
+
+	printf("\n");
+	if (!bench_field_weakening(f_ctrl)) {
+		printf("FAILED: field weakening did not raise the top speed\n");
+		res = 1;
+	}
+
+	if (!bench_mtpa(f_ctrl)) {
+		printf("FAILED: MTPA did not give more torque per amp\n");
+		res = 1;
+	}
+
+	if (!bench_dead_time(f_ctrl)) {
+		printf("FAILED: dead time compensation did not improve the output\n");
+		res = 1;
+	}
+
+	return res;
+}
@@ -0,0 +1,526 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Host replacement for the parts of the system that mcpwm_foc.c and
+ * virtual_motor.c depend on: peripheral registers, the ChibiOS kernel and the
+ * firmware modules that are not part of the control loop.
+ *
+ * The ChibiOS threads started by the firmware run as coroutines on the main
+ * thread. They are resumed from sil_advance_time when the simulated time
+ * passes their wakeup time, which keeps every run deterministic.
+ */
+
+#include "sil_hw.h"
+#include "ch.h"
+#include "hal.h"
+#include "mc_interface.h"
+#include "mcpwm_foc.h"
+#include "timer.h"
+#include "utils.h"
+#include "terminal.h"
+#include "commands.h"
+#include "encoder.h"
+#include "timeout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+// Settings
+#define MAX_THREADS					8
+#define THREAD_STACK_SIZE			(128 * 1024)
+#define MAX_TERMINAL_CALLBACKS		40
+#define TIM5_HZ						10000000ULL
+
+// Private types
+typedef struct {
+	ucontext_t ctx;
+	void (*func)(void *arg);
+	void *arg;
+	double wake_time;
+	bool finished;
+} sil_thread_t;
+
+typedef struct {
+	const char *command;
+	void(*cbf)(int argc, const char **argv);
+} terminal_callback_struct;
+
+// Global variables
+volatile uint16_t ADC_Value[HW_ADC_CHANNELS];
+volatile int ADC_curr_norm_value[3];
+TIM_TypeDef sil_tim1;
+TIM_TypeDef sil_tim8;
+ADC_Common_TypeDef sil_adc_common;
+DMA_Stream_TypeDef sil_dma2_stream4;
+GPIO_TypeDef sil_gpio[9];
+stm32_dma_stream_t sil_dma_streams[16];
+sil_stage_stats_t sil_stage_stats[SIL_STAGE_NUM];
+uint64_t sil_stage_start[SIL_STAGE_NUM];
+
+// Private variables
+static TIM_TypeDef m_tim5;
+static struct timespec m_tim5_start;
+static mc_configuration *m_conf;
+static double m_time_now = 0.0;
+static sil_thread_t m_threads[MAX_THREADS];
+static int m_thread_cnt = 0;
+static sil_thread_t *m_thread_now = 0;
+static ucontext_t m_main_ctx;
+static terminal_callback_struct m_callbacks[MAX_TERMINAL_CALLBACKS];
+static int m_callback_cnt = 0;
+static volatile bool m_dccal_isr_run = false;
+static volatile bool m_isr_enabled = false;
+static double m_ticks_per_ns = 0.0;
+
+// Private functions
+static void thread_wrapper(void);
+static void *dccal_isr_thread(void *arg);
+
+// Registers
+
+TIM_TypeDef *sil_tim5(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ns = (uint64_t)(ts.tv_sec - m_tim5_start.tv_sec) * 1000000000ULL +
+			(uint64_t)ts.tv_nsec - (uint64_t)m_tim5_start.tv_nsec;
+	m_tim5.CNT = (uint32_t)(ns / (1000000000ULL / TIM5_HZ));
+	return &m_tim5;
+}
+
+// ChibiOS
+
+void chSysLock(void) {
+	// Only one context runs at a time
+}
+
+void chSysUnlock(void) {
+	// Only one context runs at a time
+}
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg) {
+	(void)wsp; (void)size; (void)prio;
+
+	if (m_thread_cnt >= MAX_THREADS) {
+		fprintf(stderr, "SIL: too many threads\n");
+		exit(1);
+	}
+
+	sil_thread_t *t = &m_threads[m_thread_cnt++];
+	t->func = pf;
+	t->arg = arg;
+	t->wake_time = m_time_now;
+	t->finished = false;
+
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = malloc(THREAD_STACK_SIZE);
+	t->ctx.uc_stack.ss_size = THREAD_STACK_SIZE;
+	t->ctx.uc_link = &m_main_ctx;
+	makecontext(&t->ctx, thread_wrapper, 0);
+
+	return (thread_t*)t;
+}
+
+void chRegSetThreadName(const char *name) {
+	(void)name;
+}
+
+void chThdSleepMicroseconds(uint32_t usec) {
+	sil_thread_t *t = m_thread_now;
+
+	if (!t) {
+		// Sleeping in the main context just lets the simulated time pass.
+		sil_advance_time((float)usec * 1e-6);
+		return;
+	}
+
+	t->wake_time = m_time_now + (double)usec * 1e-6;
+	swapcontext(&t->ctx, &m_main_ctx);
+}
+
+void chThdSleepMilliseconds(uint32_t msec) {
+	chThdSleepMicroseconds(msec * 1000);
+}
+
+void chThdSleep(systime_t time) {
+	chThdSleepMicroseconds((uint32_t)(((uint64_t)time * 1000000) / CH_CFG_ST_FREQUENCY));
+}
+
+systime_t chVTGetSystemTimeX(void) {
+	return (systime_t)(m_time_now * CH_CFG_ST_FREQUENCY);
+}
+
+systime_t chVTGetSystemTime(void) {
+	return chVTGetSystemTimeX();
+}
+
+static void thread_wrapper(void) {
+	sil_thread_t *t = m_thread_now;
+	t->func(t->arg);
+	t->finished = true;
+}
+
+// HAL
+
+bool dmaStreamAllocate(stm32_dma_stream_t *dmastp, uint32_t priority,
+		stm32_dmaisr_t func, void *param) {
+	(void)dmastp; (void)priority; (void)func; (void)param;
+	return false;
+}
+
+void dmaStreamRelease(stm32_dma_stream_t *dmastp) {
+	(void)dmastp;
+}
+
+void nvicEnableVector(int vector, uint32_t prio) {
+	(void)prio;
+
+	if (vector == TIM8_CC_IRQn) {
+		m_isr_enabled = true;
+	}
+}
+
+void nvicDisableVector(int vector) {
+	(void)vector;
+}
+
+// Standard peripheral library. Only the registers that the control loop
+// reads back are emulated.
+
+void RCC_AHB1PeriphClockCmd(uint32_t p, FunctionalState s) { (void)p; (void)s; }
+void RCC_APB1PeriphClockCmd(uint32_t p, FunctionalState s) { (void)p; (void)s; }
+void RCC_APB2PeriphClockCmd(uint32_t p, FunctionalState s) { (void)p; (void)s; }
+void ADC_DeInit(void) {}
+void ADC_Init(ADC_TypeDef* a, ADC_InitTypeDef* i) { (void)a; (void)i; }
+void ADC_CommonInit(ADC_CommonInitTypeDef* i) { (void)i; }
+void ADC_Cmd(ADC_TypeDef* a, FunctionalState s) { (void)a; (void)s; }
+void ADC_TempSensorVrefintCmd(FunctionalState s) { (void)s; }
+void ADC_MultiModeDMARequestAfterLastTransferCmd(FunctionalState s) { (void)s; }
+void DMA_DeInit(DMA_Stream_TypeDef* d) { (void)d; }
+void DMA_Init(DMA_Stream_TypeDef* d, DMA_InitTypeDef* i) { (void)d; (void)i; }
+void DMA_Cmd(DMA_Stream_TypeDef* d, FunctionalState s) { (void)d; (void)s; }
+void DMA_ITConfig(DMA_Stream_TypeDef* d, uint32_t it, FunctionalState s) { (void)d; (void)it; (void)s; }
+void TIM_DeInit(TIM_TypeDef* t) { memset(t, 0, sizeof(TIM_TypeDef)); }
+void TIM_OC1Init(TIM_TypeDef* t, TIM_OCInitTypeDef* i) { t->CCR1 = i->TIM_Pulse; }
+void TIM_OC2Init(TIM_TypeDef* t, TIM_OCInitTypeDef* i) { t->CCR2 = i->TIM_Pulse; }
+void TIM_OC3Init(TIM_TypeDef* t, TIM_OCInitTypeDef* i) { t->CCR3 = i->TIM_Pulse; }
+void TIM_OC4Init(TIM_TypeDef* t, TIM_OCInitTypeDef* i) { t->CCR4 = i->TIM_Pulse; }
+void TIM_OC1PreloadConfig(TIM_TypeDef* t, uint16_t p) { (void)t; (void)p; }
+void TIM_OC2PreloadConfig(TIM_TypeDef* t, uint16_t p) { (void)t; (void)p; }
+void TIM_OC3PreloadConfig(TIM_TypeDef* t, uint16_t p) { (void)t; (void)p; }
+void TIM_OC4PreloadConfig(TIM_TypeDef* t, uint16_t p) { (void)t; (void)p; }
+void TIM_BDTRConfig(TIM_TypeDef* t, TIM_BDTRInitTypeDef *i) { (void)t; (void)i; }
+void TIM_CCPreloadControl(TIM_TypeDef* t, FunctionalState s) { (void)t; (void)s; }
+void TIM_ARRPreloadConfig(TIM_TypeDef* t, FunctionalState s) { (void)t; (void)s; }
+void TIM_CtrlPWMOutputs(TIM_TypeDef* t, FunctionalState s) { (void)t; (void)s; }
+void TIM_SelectOutputTrigger(TIM_TypeDef* t, uint16_t s) { (void)t; (void)s; }
+void TIM_SelectMasterSlaveMode(TIM_TypeDef* t, uint16_t m) { (void)t; (void)m; }
+void TIM_SelectInputTrigger(TIM_TypeDef* t, uint16_t s) { (void)t; (void)s; }
+void TIM_SelectSlaveMode(TIM_TypeDef* t, uint16_t m) { (void)t; (void)m; }
+void TIM_Cmd(TIM_TypeDef* t, FunctionalState s) { (void)t; (void)s; }
+void TIM_ITConfig(TIM_TypeDef* t, uint16_t it, FunctionalState s) { (void)t; (void)it; (void)s; }
+void TIM_SelectOCxM(TIM_TypeDef* t, uint16_t c, uint16_t m) { (void)t; (void)c; (void)m; }
+void TIM_CCxCmd(TIM_TypeDef* t, uint16_t c, uint16_t s) { (void)t; (void)c; (void)s; }
+void TIM_CCxNCmd(TIM_TypeDef* t, uint16_t c, uint16_t s) { (void)t; (void)c; (void)s; }
+void TIM_GenerateEvent(TIM_TypeDef* t, uint16_t e) { (void)t; (void)e; }
+
+void TIM_TimeBaseInit(TIM_TypeDef* t, TIM_TimeBaseInitTypeDef* i) {
+	t->ARR = i->TIM_Period;
+	t->PSC = i->TIM_Prescaler;
+}
+
+// Firmware modules that are not part of the control loop
+
+const volatile mc_configuration* mc_interface_get_configuration(void) {
+	return m_conf;
+}
+
+float mc_interface_temp_motor_filtered(void) {
+	return 25.0;
+}
+
+void mc_interface_mc_timer_isr(void) {
+	// Sampling and fault checks are not simulated
+}
+
+void mc_interface_fault_stop(mc_fault_code fault) {
+	fprintf(stderr, "SIL: fault %d\n", fault);
+}
+
+mc_fault_code mc_interface_get_fault(void) {
+	return FAULT_CODE_NONE;
+}
+
+void mc_interface_lock(void) {}
+void mc_interface_unlock(void) {}
+
+bool encoder_is_configured(void) { return false; }
+float encoder_read_deg(void) { return 0.0; }
+float encoder_read_deg_multiturn(void) { return 0.0; }
+bool encoder_index_found(void) { return false; }
+
+void timeout_configure(systime_t timeout, float brake_current) { (void)timeout; (void)brake_current; }
+void timeout_reset(void) {}
+systime_t timeout_get_timeout_msec(void) { return 1000; }
+float timeout_get_brake_current(void) { return 0.0; }
+bool timeout_had_IWDG_reset(void) { return false; }
+void timeout_feed_WDT(uint8_t index) { (void)index; }
+
+void hw_setup_adc_channels(void) {}
+uint8_t hw_id_from_uuid(void) { return 0; }
+
+uint8_t conf_general_calculate_deadtime(float deadtime_ns, float core_clock_freq) {
+	(void)deadtime_ns; (void)core_clock_freq;
+	return 0;
+}
+
+void terminal_register_command_callback(
+		const char* command,
+		const char *help,
+		const char *arg_names,
+		void(*cbf)(int argc, const char **argv)) {
+	(void)help; (void)arg_names;
+
+	if (m_callback_cnt < MAX_TERMINAL_CALLBACKS) {
+		m_callbacks[m_callback_cnt].command = command;
+		m_callbacks[m_callback_cnt].cbf = cbf;
+		m_callback_cnt++;
+	}
+}
+
+void commands_printf(const char* format, ...) {
+	va_list arg;
+	va_start(arg, format);
+	vprintf(format, arg);
+	va_end(arg);
+	printf("\n");
+}
+
+void commands_init_plot(char *namex, char *namey) { (void)namex; (void)namey; }
+void commands_plot_add_graph(char *name) { (void)name; }
+void commands_plot_set_graph(int graph) { (void)graph; }
+void commands_send_plot_points(float x, float y) { (void)x; (void)y; }
+
+// Simulation
+
+/**
+ * Initialize the simulated hardware and run mcpwm_foc_init.
+ *
+ * @param conf
+ * The motor configuration to use. Must stay valid for the whole simulation.
+ */
+void sil_init(mc_configuration *conf) {
+	m_conf = conf;
+
+	// Limits as set by mc_interface, without any temperature or speed derating
+	conf->lo_current_max = conf->l_current_max * conf->l_current_max_scale;
+	conf->lo_current_min = conf->l_current_min * conf->l_current_min_scale;
+	conf->lo_in_current_max = conf->l_in_current_max;
+	conf->lo_in_current_min = conf->l_in_current_min;
+	conf->lo_current_motor_max_now = conf->lo_current_max;
+	conf->lo_current_motor_min_now = conf->lo_current_min;
+	clock_gettime(CLOCK_MONOTONIC, &m_tim5_start);
+
+	// No DRV fault
+	GPIOC->IDR = 0xFFFF;
+
+	for (int i = 0;i < HW_ADC_CHANNELS;i++) {
+		ADC_Value[i] = 2048;
+	}
+
+	timer_init();
+#if UTILS_TRIG_LUT
+	utils_trig_lut_init();
+#endif
+
+	// The current offset calibration in mcpwm_foc_init waits for the
+	// ADC interrupt, so run it from a separate thread until init is done.
+	pthread_t dccal_thd;
+	m_dccal_isr_run = true;
+	pthread_create(&dccal_thd, 0, dccal_isr_thread, 0);
+	mcpwm_foc_init(conf);
+	m_dccal_isr_run = false;
+	pthread_join(dccal_thd, 0);
+
+	// Count down, so that the first interrupt is in V0.
+	TIM1->CR1 |= TIM_CR1_DIR;
+}
+
+static void *dccal_isr_thread(void *arg) {
+	(void)arg;
+
+	while (m_dccal_isr_run) {
+		if (m_isr_enabled) {
+			TIM1->CR1 |= TIM_CR1_DIR;
+			mcpwm_foc_adc_int_handler(0, 0);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Run the control loop with the virtual motor. Every cycle consists of the
+ * TIM8 interrupts in V0 and V7, like on the hardware.
+ *
+ * @param cycles
+ * Number of PWM cycles to run.
+ */
+void sil_run_cycles(int cycles) {
+	const float dt = mcpwm_foc_get_ts();
+
+	for (int i = 0;i < cycles;i++) {
+		for (int j = 0;j < 2;j++) {
+			TIM1->CR1 ^= TIM_CR1_DIR;
+			mcpwm_foc_tim_sample_int_handler();
+			sil_advance_time(dt);
+		}
+	}
+}
+
+/**
+ * Let the simulated time pass and run the threads that wake up meanwhile.
+ *
+ * @param seconds
+ * The time to advance.
+ */
+void sil_advance_time(float seconds) {
+	const double end = m_time_now + (double)seconds;
+
+	for (;;) {
+		sil_thread_t *next = 0;
+		for (int i = 0;i < m_thread_cnt;i++) {
+			sil_thread_t *t = &m_threads[i];
+			if (!t->finished && t->wake_time <= end &&
+					(!next || t->wake_time < next->wake_time)) {
+				next = t;
+			}
+		}
+
+		if (!next) {
+			break;
+		}
+
+		if (next->wake_time > m_time_now) {
+			m_time_now = next->wake_time;
+		}
+
+		m_thread_now = next;
+		swapcontext(&m_main_ctx, &next->ctx);
+		m_thread_now = 0;
+	}
+
+	m_time_now = end;
+}
+
+float sil_time_now(void) {
+	return (float)m_time_now;
+}
+
+/**
+ * Run a terminal command, e.g. connect_virtual_motor.
+ *
+ * @param cmd
+ * The command line, with arguments separated by spaces.
+ */
+void sil_terminal_cmd(const char *cmd) {
+	char buffer[256];
+	const char *argv[16];
+	int argc = 0;
+
+	strncpy(buffer, cmd, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+
+	char *p = strtok(buffer, " ");
+	while (p && argc < 16) {
+		argv[argc++] = p;
+		p = strtok(0, " ");
+	}
+
+	if (argc == 0) {
+		return;
+	}
+
+	for (int i = 0;i < m_callback_cnt;i++) {
+		if (strcmp(m_callbacks[i].command, argv[0]) == 0) {
+			m_callbacks[i].cbf(argc, argv);
+			return;
+		}
+	}
+
+	fprintf(stderr, "SIL: unknown command %s\n", argv[0]);
+}
+
+void sil_profile_reset(void) {
+	memset(sil_stage_stats, 0, sizeof(sil_stage_stats));
+}
+
+double sil_ticks_per_ns(void) {
+	if (m_ticks_per_ns == 0.0) {
+		struct timespec ts0, ts1;
+		clock_gettime(CLOCK_MONOTONIC, &ts0);
+		uint64_t t0 = sil_ticks();
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &ts1);
+		} while ((ts1.tv_sec - ts0.tv_sec) * 1000000000LL + (ts1.tv_nsec - ts0.tv_nsec) < 20000000LL);
+		uint64_t t1 = sil_ticks();
+		m_ticks_per_ns = (double)(t1 - t0) /
+				(double)((ts1.tv_sec - ts0.tv_sec) * 1000000000LL + (ts1.tv_nsec - ts0.tv_nsec));
+	}
+
+	return m_ticks_per_ns;
+}
+
+void sil_profile_print(const char *title) {
+	static const char *names[SIL_STAGE_NUM] = {
+			"ISR total", "Clarke/Park", "Observer", "PLL", "SVM"
+	};
+
+	// Cost of the profiling hooks themselves
+	uint64_t overhead = UINT64_MAX;
+	for (int i = 0;i < 1000;i++) {
+		uint64_t t0 = sil_ticks();
+		uint64_t t1 = sil_ticks();
+		if ((t1 - t0) < overhead) {
+			overhead = t1 - t0;
+		}
+	}
+
+	const double tpn = sil_ticks_per_ns();
+
+	printf("%s\n", title);
+	printf("  %-12s %10s %10s %10s %10s\n", "Stage", "Calls", "Ticks", "ns avg", "ns max");
+	for (int i = 0;i < SIL_STAGE_NUM;i++) {
+		const sil_stage_stats_t *s = &sil_stage_stats[i];
+		double avg = 0.0;
+		if (s->calls > 0) {
+			avg = (double)s->ticks / (double)s->calls - (double)overhead;
+			if (avg < 0.0) {
+				avg = 0.0;
+			}
+		}
+		printf("  %-12s %10llu %10.1f %10.1f %10.1f\n", names[i],
+				(unsigned long long)s->calls, avg, avg / tpn,
+				(double)s->ticks_max / tpn);
+	}
+}
@@ -0,0 +1,36 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SIL_HW_H_
+#define SIL_HW_H_
+
+#include "datatypes.h"
+#include "sil_profile.h"
+
+// Functions
+void sil_init(mc_configuration *conf);
+void sil_run_cycles(int cycles);
+void sil_advance_time(float seconds);
+float sil_time_now(void);
+void sil_terminal_cmd(const char *cmd);
+void sil_profile_reset(void);
+double sil_ticks_per_ns(void);
+void sil_profile_print(const char *title);
+
+#endif /* SIL_HW_H_ */
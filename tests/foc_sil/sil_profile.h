@@ -0,0 +1,80 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Force-included in every translation unit of the host build. Implements the
+ * FOC_PROFILE_START/FOC_PROFILE_END hooks in mcpwm_foc.c, which compile to
+ * nothing on the target.
+ */
+
+#ifndef SIL_PROFILE_H_
+#define SIL_PROFILE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef enum {
+	SIL_STAGE_ISR = 0,
+	SIL_STAGE_CLARKE_PARK,
+	SIL_STAGE_OBSERVER,
+	SIL_STAGE_PLL,
+	SIL_STAGE_SVM,
+	SIL_STAGE_NUM
+} sil_stage_t;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t ticks;
+	uint64_t ticks_max;
+} sil_stage_stats_t;
+
+extern sil_stage_stats_t sil_stage_stats[SIL_STAGE_NUM];
+extern uint64_t sil_stage_start[SIL_STAGE_NUM];
+
+/**
+ * Free-running tick counter. This is the TSC on x86 and nanoseconds
+ * elsewhere, see sil_ticks_per_ns.
+ */
+static inline uint64_t sil_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void sil_profile_add(sil_stage_t stage, uint64_t ticks) {
+	sil_stage_stats_t *s = &sil_stage_stats[stage];
+	s->calls++;
+	s->ticks += ticks;
+	if (ticks > s->ticks_max) {
+		s->ticks_max = ticks;
+	}
+}
+
+#define FOC_PROFILE_START(stage)	sil_stage_start[SIL_STAGE_##stage] = sil_ticks()
+#define FOC_PROFILE_END(stage)		sil_profile_add(SIL_STAGE_##stage, sil_ticks() - sil_stage_start[SIL_STAGE_##stage])
+
+#endif /* SIL_PROFILE_H_ */
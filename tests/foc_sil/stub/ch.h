@@ -0,0 +1,56 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Minimal ChibiOS kernel API for the host build. Threads are run in lockstep
+ * with the simulated time, see sil_hw.c.
+ */
+
+#ifndef CH_H_
+#define CH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint8_t tprio_t;
+typedef struct { int dummy; } thread_t;
+
+#define CH_CFG_ST_FREQUENCY			10000
+#define MS2ST(msec)					((systime_t)(((msec) * CH_CFG_ST_FREQUENCY + 999) / 1000))
+#define US2ST(usec)					((systime_t)(((usec) * CH_CFG_ST_FREQUENCY + 999999) / 1000000))
+#define ST2MS(n)					((((n) - 1) * 1000) / CH_CFG_ST_FREQUENCY + 1)
+
+#define NORMALPRIO					128
+#define THD_WORKING_AREA(s, n)		uint8_t s[n]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+
+void chSysLock(void);
+void chSysUnlock(void);
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg);
+void chRegSetThreadName(const char *name);
+void chThdSleep(systime_t time);
+void chThdSleepMilliseconds(uint32_t msec);
+void chThdSleepMicroseconds(uint32_t usec);
+systime_t chVTGetSystemTime(void);
+systime_t chVTGetSystemTimeX(void);
+
+#endif /* CH_H_ */
@@ -0,0 +1,4 @@
+/*
+ * Provided by ch.h in the host build.
+ */
+#include "ch.h"
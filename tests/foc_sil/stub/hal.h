@@ -0,0 +1,85 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Minimal ChibiOS HAL for the host build. The peripherals that the control
+ * loop touches directly are redirected from their fixed addresses to
+ * register blocks in host memory.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include "ch.h"
+#include "stm32f4xx_conf.h"
+
+#ifndef SYSTEM_CORE_CLOCK
+#define SYSTEM_CORE_CLOCK			168000000
+#endif
+
+// Register blocks in host memory
+extern TIM_TypeDef sil_tim1;
+extern TIM_TypeDef sil_tim8;
+extern ADC_Common_TypeDef sil_adc_common;
+extern DMA_Stream_TypeDef sil_dma2_stream4;
+extern GPIO_TypeDef sil_gpio[9];
+TIM_TypeDef *sil_tim5(void);
+
+#undef TIM1
+#undef TIM5
+#undef TIM8
+#undef ADC
+#undef DMA2_Stream4
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef GPIOE
+
+#define TIM1						(&sil_tim1)
+#define TIM5						(sil_tim5())
+#define TIM8						(&sil_tim8)
+#define ADC							(&sil_adc_common)
+#define DMA2_Stream4				(&sil_dma2_stream4)
+#define GPIOA						(&sil_gpio[0])
+#define GPIOB						(&sil_gpio[1])
+#define GPIOC						(&sil_gpio[2])
+#define GPIOD						(&sil_gpio[3])
+#define GPIOE						(&sil_gpio[4])
+
+// PAL
+#define palSetPad(port, pad)		((port)->ODR |= (1 << (pad)))
+#define palClearPad(port, pad)		((port)->ODR &= ~(1 << (pad)))
+#define palReadPad(port, pad)		(((port)->IDR >> (pad)) & 1)
+
+// DMA
+typedef void (*stm32_dmaisr_t)(void *p, uint32_t flags);
+typedef struct { int dummy; } stm32_dma_stream_t;
+#define STM32_DMA_STREAM_ID(dma, stream)	((((dma) - 1) * 8) + (stream))
+#define STM32_DMA_STREAM(id)				(&sil_dma_streams[id])
+extern stm32_dma_stream_t sil_dma_streams[16];
+bool dmaStreamAllocate(stm32_dma_stream_t *dmastp, uint32_t priority,
+		stm32_dmaisr_t func, void *param);
+void dmaStreamRelease(stm32_dma_stream_t *dmastp);
+
+// NVIC
+void nvicEnableVector(int vector, uint32_t prio);
+void nvicDisableVector(int vector);
+
+#endif /* HAL_H_ */
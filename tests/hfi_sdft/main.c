@@ -0,0 +1,126 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks that the sliding DFT used for HFI gives the same bins as the batch
+ * functions utils_fftN_bin1 and utils_fftN_bin2 after every sample, the way
+ * the ADC ISR feeds it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "utils.h"
+
+// Settings
+#define PASSES				100000
+#define MAX_ERR				1e-5	// Relative to the sample amplitude
+
+// utils.c uses these for utils_sys_lock_cnt
+void chSysLock(void) {}
+void chSysUnlock(void) {}
+
+typedef struct {
+	int samples;
+	void(*bin1_func)(float*, float*, float*);
+	void(*bin2_func)(float*, float*, float*);
+} fft_variant_t;
+
+static float rand_float(float min, float max) {
+	return min + (max - min) * (float)rand() / (float)RAND_MAX;
+}
+
+/**
+ * Feed samples that look like the HFI inductance samples, including the
+ * ones that are skipped because the current is too low, and restarts from
+ * index 0 in the middle of a pass.
+ *
+ * @return
+ * The largest difference between the sliding and the batch bins.
+ */
+static double test_variant(const fft_variant_t *v) {
+	float buffer[32];
+	float bins[4];
+	float bins_acc[4];
+	double max_err = 0.0;
+
+	memset(buffer, 0, sizeof(buffer));
+	memset(bins, 0, sizeof(bins));
+	memset(bins_acc, 0, sizeof(bins_acc));
+
+	const int table_fact = 32 / v->samples;
+	int ind = 0;
+	const float amp = 20e-6;
+
+	for (int i = 0;i < PASSES * v->samples;i++) {
+		// Saliency: two periods per buffer, plus noise
+		float sample = amp + 0.2 * amp * cosf(4.0 * M_PI * (float)ind / (float)v->samples + 0.7) +
+				rand_float(-0.05, 0.05) * amp;
+		if (rand() % 10 == 0) {
+			sample = buffer[ind];
+		}
+
+		utils_sdft_bin12_step(buffer, ind, sample, v->samples, table_fact, bins, bins_acc);
+
+		ind++;
+		if (ind == v->samples || rand() % 100000 == 0) {
+			if (ind != v->samples) {
+				memset(bins_acc, 0, sizeof(bins_acc));
+			}
+			ind = 0;
+		}
+
+		float ref[4];
+		v->bin1_func(buffer, &ref[0], &ref[1]);
+		v->bin2_func(buffer, &ref[2], &ref[3]);
+
+		for (int j = 0;j < 4;j++) {
+			double err = fabs((double)bins[j] - (double)ref[j]) / (double)amp;
+			if (err > max_err) {
+				max_err = err;
+			}
+		}
+	}
+
+	return max_err;
+}
+
+int main(void) {
+	static const fft_variant_t variants[] = {
+			{8, utils_fft8_bin1, utils_fft8_bin2},
+			{16, utils_fft16_bin1, utils_fft16_bin2},
+			{32, utils_fft32_bin1, utils_fft32_bin2},
+	};
+
+	int res = 0;
+	srand(1);
+
+	for (unsigned int i = 0;i < sizeof(variants) / sizeof(variants[0]);i++) {
+		double err = test_variant(&variants[i]);
+		printf("%2d samples: max relative error %.3g\n", variants[i].samples, err);
+		if (err > MAX_ERR) {
+			printf("FAILED: the sliding DFT does not match the batch bins\n");
+			res = 1;
+		}
+	}
+
+	return res;
+}
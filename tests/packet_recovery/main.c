@@ -18,9 +18,166 @@ void process_packet(unsigned char *data, unsigned int len) {
 	printf("Packet rx (%03d bytes): %s\r\n", len, (char*)data + rand_prepend);
 }
 
+static unsigned int perf_packets = 0;
+static uint32_t perf_hash = 0;
+
 void process_packet_perf(unsigned char *data, unsigned int len) {
 	(void)data;
-	(void)len;
+	perf_packets++;
+	perf_hash = perf_hash * 31 + len;
+}
+
+void process_packet_hash(unsigned char *data, unsigned int len) {
+	perf_packets++;
+	perf_hash = perf_hash * 31 + len;
+	for (unsigned int i = 0;i < len;i++) {
+		perf_hash = perf_hash * 31 + data[i];
+	}
+}
+
+/*
+ * Like process_packet_hash, but then writes past the payload the way the
+ * command handlers do when they decompress data in place.
+ */
+void process_packet_overwrite(unsigned char *data, unsigned int len) {
+	process_packet_hash(data, len);
+	data[-1] = 0xFF;
+	memset(data + len, 0xAA, PACKET_MAX_PL_LEN - len);
+}
+
+/*
+ * Feed the stream in buffer to the decoder, one byte at a time when chunk is
+ * zero and in chunks of chunk bytes with packet_process_buffer otherwise. A
+ * negative chunk uses random chunk lengths up to -chunk bytes.
+ */
+static void feed_stream(int chunk) {
+	unsigned int i = 0;
+	while (i < write) {
+		if (chunk == 0) {
+			packet_process_byte(buffer[i++], 0);
+			continue;
+		}
+
+		unsigned int len = chunk > 0 ? (unsigned int)chunk : (unsigned int)(1 + rand() % -chunk);
+		if (len > write - i) {
+			len = write - i;
+		}
+
+		packet_process_buffer(buffer + i, len, 0);
+		i += len;
+	}
+}
+
+/*
+ * Decoder throughput on a long stream of back to back packets with
+ * payloads of random length. Every corrupt_every byte is flipped when
+ * corrupt_every is nonzero, which makes the decoder drop packets and
+ * resynchronize. The byte and the buffer API are compared for speed, and
+ * must decode exactly the same packets.
+ */
+static bool throughput_test(const char *name, unsigned int corrupt_every) {
+	packet_init(send_packet, process_packet_perf, 0);
+
+	srand(42);
+	write = 0;
+	unsigned int sent = 0;
+	unsigned char pl[PACKET_MAX_PL_LEN];
+	for (;;) {
+		unsigned int len = 1 + rand() % PACKET_MAX_PL_LEN;
+		if (write + len + 8 > sizeof(buffer)) {
+			break;
+		}
+
+		for (unsigned int i = 0;i < len;i++) {
+			pl[i] = rand();
+		}
+
+		packet_send_packet(pl, len, 0);
+		sent++;
+	}
+
+	if (corrupt_every) {
+		for (unsigned int i = corrupt_every / 2;i < write;i += corrupt_every) {
+			buffer[i] ^= 1 << (rand() % 8);
+		}
+	}
+
+	// Correctness
+	packet_init(send_packet, process_packet_hash, 0);
+	perf_packets = 0;
+	perf_hash = 0;
+	feed_stream(0);
+	const unsigned int byte_packets = perf_packets;
+	const uint32_t byte_hash = perf_hash;
+
+	packet_reset(0);
+	perf_packets = 0;
+	perf_hash = 0;
+	feed_stream(-700);
+	bool same = perf_packets == byte_packets && perf_hash == byte_hash;
+
+	// Speed
+	packet_init(send_packet, process_packet_perf, 0);
+	const int rounds = 200;
+	const int chunks[] = {0, 64};
+	double mbs[2];
+
+	for (int c = 0;c < 2;c++) {
+		packet_reset(0);
+		clock_t start = clock();
+		for (int r = 0;r < rounds;r++) {
+			feed_stream(chunks[c]);
+		}
+		double time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+		mbs[c] = (double)write * rounds / time / 1e6;
+	}
+
+	printf("%s: %u of %u packets decoded, byte %.1f MB/s, buffer %.1f MB/s, %s\r\n",
+			name, byte_packets, sent, mbs[0], mbs[1], same ? "same result" : "MISMATCH");
+
+	return same;
+}
+
+/*
+ * Packets must survive a process function that writes past the payload when
+ * they are received in the same chunk as the packet before them.
+ */
+static bool overwrite_test(void) {
+	packet_init(send_packet, process_packet_hash, 0);
+
+	srand(7);
+	write = 0;
+	unsigned int sent = 0;
+	unsigned char pl[PACKET_MAX_PL_LEN];
+	while (write + PACKET_MAX_PL_LEN + 8 < 50000) {
+		unsigned int len = 1 + rand() % PACKET_MAX_PL_LEN;
+		for (unsigned int i = 0;i < len;i++) {
+			pl[i] = rand();
+		}
+
+		packet_send_packet(pl, len, 0);
+		sent++;
+	}
+
+	perf_packets = 0;
+	perf_hash = 0;
+	feed_stream(0);
+	const uint32_t hash = perf_hash;
+	bool ok = perf_packets == sent;
+
+	packet_init(send_packet, process_packet_overwrite, 0);
+	const int chunks[] = {0, 64, -700, (int)write};
+	for (int c = 0;c < 4;c++) {
+		packet_reset(0);
+		perf_packets = 0;
+		perf_hash = 0;
+		feed_stream(chunks[c]);
+		ok &= perf_packets == sent && perf_hash == hash;
+	}
+
+	printf("Writes past the payload: %s\r\n", ok ? "all packets decoded" : "PACKETS LOST");
+
+	return ok;
 }
 
 int main(void) {
@@ -92,6 +249,14 @@ int main(void) {
 	cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
 	
 	printf("Time: %.3f s\r\n", cpu_time_used);
-	
-	return 0;
+
+	// Throughput
+	printf("\r\nThroughput Test\r\n");
+	bool ok = true;
+	ok &= throughput_test("Clean stream", 0);
+	ok &= throughput_test("Corrupted stream", 5000);
+	ok &= throughput_test("Heavily corrupted stream", 97);
+	ok &= overwrite_test();
+
+	return ok ? 0 : 1;
 }
@@ -0,0 +1,172 @@
+/*
+	Copyright 2020 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Accuracy and speed of the trig functions in utils.c. Every variant is
+ * compared against libm over a sweep of angles, like the ones the FOC loop
+ * feeds them. This is built once with the polynomial approximations and once
+ * with the lookup tables, see the Makefile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "utils.h"
+#include "conf_general.h"
+
+// Settings
+#define SWEEP_POINTS		100000
+#define BENCH_ROUNDS		50
+
+// Maximum allowed errors for the lookup tables in degrees
+#define LUT_SINCOS_MAX_ERR	0.001
+#define LUT_ATAN2_MAX_ERR	0.001
+
+static float m_angles[SWEEP_POINTS];
+static float m_x[SWEEP_POINTS];
+static float m_y[SWEEP_POINTS];
+static volatile float m_sink;
+
+// utils.c uses these for utils_sys_lock_cnt
+void chSysLock(void) {}
+void chSysUnlock(void) {}
+
+static double time_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void libm_sincos(float angle, float *s, float *c) {
+	*s = sinf(angle);
+	*c = cosf(angle);
+}
+
+/**
+ * Test a sin/cos implementation.
+ *
+ * @return
+ * The largest error, expressed as an angle in degrees.
+ */
+static double test_sincos(const char *name, void(*func)(float, float*, float*)) {
+	double max_err = 0.0;
+
+	for (int i = 0;i < SWEEP_POINTS;i++) {
+		float s, c;
+		func(m_angles[i], &s, &c);
+		double err_s = fabs((double)s - sin((double)m_angles[i]));
+		double err_c = fabs((double)c - cos((double)m_angles[i]));
+		double err = (err_s > err_c ? err_s : err_c) * (180.0 / M_PI);
+		if (err > max_err) {
+			max_err = err;
+		}
+	}
+
+	double t_start = time_now_ns();
+	for (int r = 0;r < BENCH_ROUNDS;r++) {
+		for (int i = 0;i < SWEEP_POINTS;i++) {
+			float s, c;
+			func(m_angles[i], &s, &c);
+			m_sink = s + c;
+		}
+	}
+	double ns = (time_now_ns() - t_start) / ((double)BENCH_ROUNDS * SWEEP_POINTS);
+
+	printf("  %-28s %12.5f %10.2f\n", name, max_err, ns);
+	return max_err;
+}
+
+/**
+ * Test an atan2 implementation.
+ *
+ * @return
+ * The largest error in degrees.
+ */
+static double test_atan2(const char *name, float(*func)(float, float)) {
+	double max_err = 0.0;
+
+	for (int i = 0;i < SWEEP_POINTS;i++) {
+		double err = fabs((double)func(m_y[i], m_x[i]) -
+				atan2((double)m_y[i], (double)m_x[i]));
+		if (err > M_PI) {
+			err = 2.0 * M_PI - err;
+		}
+		err *= 180.0 / M_PI;
+		if (err > max_err) {
+			max_err = err;
+		}
+	}
+
+	double t_start = time_now_ns();
+	for (int r = 0;r < BENCH_ROUNDS;r++) {
+		for (int i = 0;i < SWEEP_POINTS;i++) {
+			m_sink = func(m_y[i], m_x[i]);
+		}
+	}
+	double ns = (time_now_ns() - t_start) / ((double)BENCH_ROUNDS * SWEEP_POINTS);
+
+	printf("  %-28s %12.5f %10.2f\n", name, max_err, ns);
+	return max_err;
+}
+
+int main(void) {
+#if UTILS_TRIG_LUT
+	utils_trig_lut_init();
+	printf("Lookup tables (UTILS_TRIG_LUT = 1)\n");
+#else
+	printf("Polynomial approximations (UTILS_TRIG_LUT = 0)\n");
+#endif
+
+	// Angles slightly outside of -pi to pi as well, as the phase compensation
+	// in the FOC loop can push them there. The vectors have varying magnitude
+	// like the observer state.
+	srand(1);
+	for (int i = 0;i < SWEEP_POINTS;i++) {
+		m_angles[i] = -1.2 * M_PI + 2.4 * M_PI * (float)rand() / (float)RAND_MAX;
+		float mag = 1e-3 + 10.0 * (float)rand() / (float)RAND_MAX;
+		m_x[i] = mag * cosf(m_angles[i]);
+		m_y[i] = mag * sinf(m_angles[i]);
+	}
+
+	int res = 0;
+
+	printf("  %-28s %12s %10s\n", "Function", "Max err (deg)", "ns/call");
+	test_sincos("sinf + cosf", libm_sincos);
+	test_sincos("utils_fast_sincos", utils_fast_sincos);
+	test_sincos("utils_fast_sincos_better", utils_fast_sincos_better);
+#if UTILS_TRIG_LUT
+	if (test_sincos("utils_lut_sincos", utils_lut_sincos) > LUT_SINCOS_MAX_ERR) {
+		printf("FAILED: utils_lut_sincos is not accurate enough\n");
+		res = 1;
+	}
+#endif
+
+	test_atan2("atan2f", atan2f);
+	test_atan2("utils_fast_atan2", utils_fast_atan2);
+#if UTILS_TRIG_LUT
+	if (test_atan2("utils_lut_atan2", utils_lut_atan2) > LUT_ATAN2_MAX_ERR) {
+		printf("FAILED: utils_lut_atan2 is not accurate enough\n");
+		res = 1;
+	}
+#endif
+
+	return res;
+}
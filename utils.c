@@ -20,9 +20,18 @@
 #include "utils.h"
 #include "ch.h"
 #include "hal.h"
+#include "conf_general.h"
 #include <math.h>
 #include <string.h>
 
+#if UTILS_TRIG_LUT
+// Lookup tables for the trig functions. They are filled in by
+// utils_trig_lut_init and placed in the core-coupled memory, which has no
+// wait states and no bus contention with the DMA.
+__attribute__((section(".ram4"))) static float m_lut_sin[UTILS_TRIG_LUT_SIN_SIZE + 1];
+__attribute__((section(".ram4"))) static float m_lut_atan[UTILS_TRIG_LUT_ATAN_SIZE + 2];
+#endif
+
 // Private variables
 static volatile int sys_lock_cnt = 0;
 
@@ -307,6 +316,9 @@ float utils_fast_inv_sqrt(float x) {
  * The angle in radians
  */
 float utils_fast_atan2(float y, float x) {
+#if UTILS_TRIG_LUT
+	return utils_lut_atan2(y, x);
+#else
 	float abs_y = fabsf(y) + 1e-20; // kludge to prevent 0/0 condition
 	float angle;
 
@@ -325,6 +337,7 @@ float utils_fast_atan2(float y, float x) {
 	} else {
 		return(angle);
 	}
+#endif
 }
 
 /**
@@ -423,6 +436,9 @@ void utils_fast_sincos(float angle, float *sin, float *cos) {
  * A pointer to store the cosine value.
  */
 void utils_fast_sincos_better(float angle, float *sin, float *cos) {
+#if UTILS_TRIG_LUT
+	utils_lut_sincos(angle, sin, cos);
+#else
 	//always wrap input angle to -PI..PI
 	while (angle < -M_PI) {
 		angle += 2.0 * M_PI;
@@ -474,7 +490,98 @@ void utils_fast_sincos_better(float angle, float *sin, float *cos) {
 			*cos = 0.225 * (*cos * *cos - *cos) + *cos;
 		}
 	}
+#endif
+}
+
+#if UTILS_TRIG_LUT
+/**
+ * Fill the lookup tables used by utils_lut_sincos and utils_lut_atan2. Must
+ * be called once at startup, before any of them are used.
+ */
+void utils_trig_lut_init(void) {
+	for (int i = 0;i <= UTILS_TRIG_LUT_SIN_SIZE;i++) {
+		m_lut_sin[i] = sinf((float)i * (2.0 * M_PI / (float)UTILS_TRIG_LUT_SIN_SIZE));
+	}
+
+	for (int i = 0;i <= (UTILS_TRIG_LUT_ATAN_SIZE + 1);i++) {
+		m_lut_atan[i] = atanf((float)i / (float)UTILS_TRIG_LUT_ATAN_SIZE);
+	}
+}
+
+/**
+ * Sine and cosine from an interpolated lookup table.
+ *
+ * @param angle
+ * The angle in radians. Any angle that fits in an int after scaling with
+ * UTILS_TRIG_LUT_SIN_SIZE / (2 * pi) works, no wrapping is needed.
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void utils_lut_sincos(float angle, float *sin, float *cos) {
+	const float ind = angle * ((float)UTILS_TRIG_LUT_SIN_SIZE / (2.0 * M_PI));
+	int ind_int = (int)ind;
+	float frac = ind - (float)ind_int;
+
+	if (frac < 0.0) {
+		frac += 1.0;
+		ind_int--;
+	}
+
+	const unsigned int ind_sin = (unsigned int)ind_int & (UTILS_TRIG_LUT_SIN_SIZE - 1);
+	const unsigned int ind_cos = (ind_sin + UTILS_TRIG_LUT_SIN_SIZE / 4) & (UTILS_TRIG_LUT_SIN_SIZE - 1);
+
+	*sin = m_lut_sin[ind_sin] + frac * (m_lut_sin[ind_sin + 1] - m_lut_sin[ind_sin]);
+	*cos = m_lut_sin[ind_cos] + frac * (m_lut_sin[ind_cos + 1] - m_lut_sin[ind_cos]);
+}
+
+/**
+ * atan2 from an interpolated lookup table.
+ *
+ * @param y
+ * y
+ *
+ * @param x
+ * x
+ *
+ * @return
+ * The angle in radians, or 0 if both x and y are 0.
+ */
+float utils_lut_atan2(float y, float x) {
+	const float abs_x = fabsf(x);
+	const float abs_y = fabsf(y);
+	const bool swap = abs_y > abs_x;
+	const float num = swap ? abs_x : abs_y;
+	const float den = swap ? abs_y : abs_x;
+
+	if (den < 1e-20) {
+		return 0.0;
+	}
+
+	// Angle in the first octant
+	const float ind = (num / den) * (float)UTILS_TRIG_LUT_ATAN_SIZE;
+	const int ind_int = (int)ind;
+	const float frac = ind - (float)ind_int;
+	float angle = m_lut_atan[ind_int] + frac * (m_lut_atan[ind_int + 1] - m_lut_atan[ind_int]);
+
+	if (swap) {
+		angle = (M_PI / 2.0) - angle;
+	}
+
+	if (x < 0.0) {
+		angle = M_PI - angle;
+	}
+
+	if (y < 0.0) {
+		angle = -angle;
+	}
+
+	return angle;
 }
+#endif
 
 /**
  * Calculate the values with the lowest magnitude.
@@ -624,16 +731,20 @@ void utils_sys_unlock_cnt(void) {
 }
 
 uint32_t utils_crc32c(uint8_t *data, uint32_t len) {
+	// CRC of each nibble value, reflected polynomial 0x82F63B78
+	static const uint32_t tab[16] = {
+			0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1,
+			0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+			0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+			0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+	};
+
 	uint32_t crc = 0xFFFFFFFF;
 
 	for (uint32_t i = 0; i < len;i++) {
-		uint32_t byte = data[i];
-		crc = crc ^ byte;
-
-		for (int j = 7;j >= 0;j--) {
-			uint32_t mask = -(crc & 1);
-			crc = (crc >> 1) ^ (0x82F63B78 & mask);
-		}
+		crc ^= data[i];
+		crc = (crc >> 4) ^ tab[crc & 0x0F];
+		crc = (crc >> 4) ^ tab[crc & 0x0F];
 	}
 
 	return ~crc;
@@ -739,6 +850,63 @@ void utils_fft8_bin2(float *real_in, float *real, float *imag) {
 	*imag /= 8.0;
 }
 
+/**
+ * Sliding DFT of bin 1 and 2 of a buffer that is overwritten one sample at a
+ * time in index order. Gives the same result as utils_fftN_bin1 and
+ * utils_fftN_bin2 on the buffer at O(1) cost per sample. Rounding errors do
+ * not build up, as the bins are replaced by sums accumulated during the
+ * latest pass over the buffer every time the last index is written.
+ *
+ * @param buffer
+ * The sample buffer.
+ *
+ * @param ind
+ * The index to write. Must step through 0 to samples - 1 in order; clear
+ * bins_acc when starting over from another index.
+ *
+ * @param sample
+ * The new sample at ind. Use buffer[ind] to keep the old value.
+ *
+ * @param samples
+ * Number of samples in the buffer, 8, 16 or 32.
+ *
+ * @param table_fact
+ * 32 / samples
+ *
+ * @param bins
+ * real bin 1, imag bin 1, real bin 2 and imag bin 2. Updated.
+ *
+ * @param bins_acc
+ * 4 sums used internally. Start at 0.
+ */
+void utils_sdft_bin12_step(float *buffer, int ind, float sample, int samples,
+		int table_fact, float *bins, float *bins_acc) {
+	const float c1 = utils_tab_cos_32_1[ind * table_fact];
+	const float s1 = utils_tab_sin_32_1[ind * table_fact];
+	const float c2 = utils_tab_cos_32_2[ind * table_fact];
+	const float s2 = utils_tab_sin_32_2[ind * table_fact];
+	const float diff = (sample - buffer[ind]) / (float)samples;
+
+	buffer[ind] = sample;
+
+	bins[0] += diff * c1;
+	bins[1] -= diff * s1;
+	bins[2] += diff * c2;
+	bins[3] -= diff * s2;
+
+	bins_acc[0] += sample * c1;
+	bins_acc[1] -= sample * s1;
+	bins_acc[2] += sample * c2;
+	bins_acc[3] -= sample * s2;
+
+	if (ind == (samples - 1)) {
+		for (int i = 0;i < 4;i++) {
+			bins[i] = bins_acc[i] / (float)samples;
+			bins_acc[i] = 0.0;
+		}
+	}
+}
+
 const float utils_tab_sin_32_1[] = {
 	0.000000, 0.195090, 0.382683, 0.555570, 0.707107, 0.831470, 0.923880, 0.980785,
 	1.000000, 0.980785, 0.923880, 0.831470, 0.707107, 0.555570, 0.382683, 0.195090,
@@ -43,6 +43,10 @@ float utils_fast_atan2(float y, float x);
 bool utils_saturate_vector_2d(float *x, float *y, float max);
 void utils_fast_sincos(float angle, float *sin, float *cos);
 void utils_fast_sincos_better(float angle, float *sin, float *cos);
+// Only available when UTILS_TRIG_LUT is set
+void utils_trig_lut_init(void);
+void utils_lut_sincos(float angle, float *sin, float *cos);
+float utils_lut_atan2(float y, float x);
 float utils_min_abs(float va, float vb);
 float utils_max_abs(float va, float vb);
 void utils_byte_to_binary(int x, char *b);
@@ -59,6 +63,8 @@ void utils_fft16_bin2(float *real_in, float *real, float *imag);
 void utils_fft8_bin0(float *real_in, float *real, float *imag);
 void utils_fft8_bin1(float *real_in, float *real, float *imag);
 void utils_fft8_bin2(float *real_in, float *real, float *imag);
+void utils_sdft_bin12_step(float *buffer, int ind, float sample, int samples,
+		int table_fact, float *bins, float *bins_acc);
 
 // Return the sign of the argument. -1 if negative, 1 if zero or positive.
 #define SIGN(x)				((x < 0) ? -1 : 1)
@@ -88,6 +94,11 @@ void utils_fft8_bin2(float *real_in, float *real, float *imag);
  */
 #define UTILS_LP_FAST(value, sample, filter_constant)	(value -= (filter_constant) * ((value) - (sample)))
 
+// Lookup table sizes for utils_lut_sincos and utils_lut_atan2. The sine
+// table size must be a power of two.
+#define UTILS_TRIG_LUT_SIN_SIZE		1024
+#define UTILS_TRIG_LUT_ATAN_SIZE	256
+
 // Constants
 #define ONE_BY_SQRT3			(0.57735026919)
 #define TWO_BY_SQRT3			(2.0f * 0.57735026919)
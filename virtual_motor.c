@@ -62,6 +62,7 @@ typedef struct{
 	float ia;					//phase a current in Amps
 	float ib;					//phase b current in Amps
 	float ic;					//phase c current in Amps
+	float v_dt;					//voltage lost to the dead time in Volts
 }virtual_motor_t;
 
 static volatile virtual_motor_t virtual_motor;
@@ -71,7 +72,7 @@ static volatile int m_curr2_offset_backup;
 
 //private functions
 static void connect_virtual_motor(float ml, float J, float Ld, float Lq,
-									float Rs,float lambda,float Vbus);
+									float Rs,float lambda,float Vbus, float dead_time);
 static void disconnect_virtual_motor(void);
 static inline void run_virtual_motor_electrical(float v_alpha, float v_beta);
 static inline void run_virtual_motor_mechanics(float ml);
@@ -111,7 +112,7 @@ void virtual_motor_init(void){
 	terminal_register_command_callback(
 				"connect_virtual_motor",
 				"connects virtual motor",
-				"[ml][J][Ld][Lq][Rs][lambda][Vbus]",
+				"[ml][J][Ld][Lq][Rs][lambda][Vbus][dead time ns (optional)]",
 				terminal_cmd_connect_virtual_motor);
 
 	terminal_register_command_callback(
@@ -156,9 +157,10 @@ float virtual_motor_get_angle_deg(void){
  * @param Rs: resistance in ohms
  * @param lambda: flux linkage in Vs/rad
  * @param Vbus: Bus voltage in Volts
+ * @param dead_time: Dead time in ns, 0 to disable
  */
 static void connect_virtual_motor(float ml , float J, float Ld, float Lq,
-									float Rs, float lambda, float Vbus){
+									float Rs, float lambda, float Vbus, float dead_time){
 	if(virtual_motor.connected == false){
 		//first we send 0.0 current command to make system stop PWM outputs
 		mcpwm_foc_set_current(0.0);
@@ -194,6 +196,13 @@ static void connect_virtual_motor(float ml , float J, float Ld, float Lq,
 		virtual_motor.phi = mcpwm_foc_get_phase() * M_PI / 180.0;// 0.0;//m_motor_state.phase;
 		utils_fast_sincos_better(virtual_motor.phi, (float*)&virtual_motor.sin_phi,
 														(float*)&virtual_motor.cos_phi);
+
+		// start at standstill with the d axis flux set by the magnets, otherwise
+		// the model begins with a current of -lambda / Ld
+		virtual_motor.id_int = lambda / Ld;
+		virtual_motor.id = 0.0;
+		virtual_motor.iq = 0.0;
+		virtual_motor.we = 0.0;
 	}
 
 	//initialize constants
@@ -209,6 +218,8 @@ static void connect_virtual_motor(float ml , float J, float Ld, float Lq,
 	const volatile mc_configuration *conf = mc_interface_get_configuration();
 	virtual_motor.pole_pairs = conf->si_motor_poles / 2;
 	virtual_motor.km = 1.5 * virtual_motor.pole_pairs;
+	// same voltage scaling as the modulation in mcpwm_foc
+	virtual_motor.v_dt = dead_time * 1e-9 * conf->foc_f_sw * (2.0 / 3.0) * Vbus;
 
 	virtual_motor.connected = true;
 }
@@ -270,6 +281,15 @@ static inline void run_virtual_motor(float v_alpha, float v_beta, float ml){
  */
 static inline void run_virtual_motor_electrical(float v_alpha, float v_beta){
 
+	// dead time: each phase loses voltage in the direction of its current
+	if( virtual_motor.v_dt > 0.0 ){
+		const float sa = SIGN(virtual_motor.ia);
+		const float sb = SIGN(virtual_motor.ib);
+		const float sc = SIGN(virtual_motor.ic);
+		v_alpha -= ((2.0 / 3.0) * sa - (1.0 / 3.0) * sb - (1.0 / 3.0) * sc) * virtual_motor.v_dt;
+		v_beta -= (ONE_BY_SQRT3 * sb - ONE_BY_SQRT3 * sc) * virtual_motor.v_dt;
+	}
+
 	utils_fast_sincos_better( virtual_motor.phi , (float*)&virtual_motor.sin_phi,
 													(float*)&virtual_motor.cos_phi );
 
@@ -279,7 +299,6 @@ static inline void run_virtual_motor_electrical(float v_alpha, float v_beta){
 	// d axis current
 	virtual_motor.id_int += ((virtual_motor.vd +
 								virtual_motor.we *
-								virtual_motor.pole_pairs *
 								virtual_motor.Lq * virtual_motor.iq -
 	 							virtual_motor.Rs * virtual_motor.id )
 								* virtual_motor.Ts ) / virtual_motor.Ld;
@@ -288,7 +307,6 @@ static inline void run_virtual_motor_electrical(float v_alpha, float v_beta){
 	// q axis current
 	virtual_motor.iq += (virtual_motor.vq -
 						virtual_motor.we *
-						virtual_motor.pole_pairs *
 						(virtual_motor.Ld * virtual_motor.id + virtual_motor.flux_linkage) -
 						virtual_motor.Rs * virtual_motor.iq )
 						* virtual_motor.Ts / virtual_motor.Lq;
@@ -302,8 +320,9 @@ static inline void run_virtual_motor_mechanics(float ml){
 	virtual_motor.me =  virtual_motor.km * (virtual_motor.flux_linkage +
 											(virtual_motor.Ld - virtual_motor.Lq) *
 											virtual_motor.id ) * virtual_motor.iq;
-	// omega
-	float w_aux = virtual_motor.we  + virtual_motor.tsj * (virtual_motor.me - ml);
+	// omega (electrical)
+	float w_aux = virtual_motor.we + virtual_motor.pole_pairs *
+			virtual_motor.tsj * (virtual_motor.me - ml);
 
 	if( w_aux < 0.0 ){
 		virtual_motor.we = 0;
@@ -365,7 +384,7 @@ static inline void run_virtual_motor_park_clark_inverse( void ){
  * connect_virtual_motor command
  */
 static void terminal_cmd_connect_virtual_motor(int argc, const char **argv) {
-	if( argc == 8 ){
+	if( argc == 8 || argc == 9 ){
 		float ml; //torque load in motor axis
 		float Ld; //inductance in d axis
 		float Lq; //inductance in q axis
@@ -373,6 +392,7 @@ static void terminal_cmd_connect_virtual_motor(int argc, const char **argv) {
 		float Rs; //resistance of motor inductance
 		float lambda;//rotor flux linkage
 		float Vbus;//Bus voltage
+		float dead_time = 0.0;//dead time in ns
 
 		sscanf(argv[1], "%f", &ml);
 		sscanf(argv[2], "%f", &J);
@@ -381,12 +401,15 @@ static void terminal_cmd_connect_virtual_motor(int argc, const char **argv) {
 		sscanf(argv[5], "%f", &Rs);
 		sscanf(argv[6], "%f", &lambda);
 		sscanf(argv[7], "%f", &Vbus);
+		if( argc == 9 ){
+			sscanf(argv[8], "%f", &dead_time);
+		}
 
-		connect_virtual_motor( ml , J, Ld , Lq , Rs, lambda, Vbus);
+		connect_virtual_motor( ml , J, Ld , Lq , Rs, lambda, Vbus, dead_time);
 		commands_printf("virtual motor connected");
 	}
 	else{
-		commands_printf("arguments should be 7" );
+		commands_printf("arguments should be 7 or 8" );
 	}
 }
 